@@ -0,0 +1,123 @@
+package main
+
+import (
+	"fmt"
+	"strings"
+	"time"
+
+	kbp "github.com/ml8/3x3/cli"
+)
+
+// The command given on the command line, as run on each device of a fleet.
+// Input is read once, before any device is opened.
+func fleetOp() (func(s *kbp.Session) error, error) {
+	switch {
+	case *reset:
+		return (*kbp.Session).LayerReset, nil
+	case *oled == "on" || *oled == "off":
+		on := *oled == "on"
+		return func(s *kbp.Session) error { return s.OledState(on) }, nil
+	case *bulk:
+		data, err := readData()
+		if err != nil {
+			return nil, err
+		}
+		texts := strings.Split(strings.TrimRight(string(data), "\n"), "\n")
+		if len(texts) > kbp.LAYER_COUNT {
+			return nil, fmt.Errorf("device only supports %d layers; got %d lines", kbp.LAYER_COUNT, len(texts))
+		}
+		byLayer := make(map[uint8]string, len(texts))
+		for i := range texts {
+			texts[i] = strings.ReplaceAll(texts[i], "\\n", "\n")
+			byLayer[uint8(i)] = texts[i]
+		}
+		return func(s *kbp.Session) error {
+			if *force {
+				return s.BulkLayerUpdate(texts)
+			}
+			_, err := s.SyncLayers(byLayer)
+			return err
+		}, nil
+	case *field != "":
+		name, value := *field, *text
+		return func(s *kbp.Session) error { return s.SetField(name, value) }, nil
+	case *layer != -1 || *text != "":
+		if *layer < 0 || *layer >= kbp.LAYER_COUNT || *text == "" {
+			return nil, fmt.Errorf("both -layer (0-%d) and -text must be supplied", kbp.LAYER_COUNT-1)
+		}
+		l, txt := uint8(*layer), strings.ReplaceAll(*text, "\\n", "\n")
+		return func(s *kbp.Session) error {
+			if *force {
+				return s.LayerUpdate(l, txt)
+			}
+			_, err := s.SyncLayers(map[uint8]string{l: txt})
+			return err
+		}, nil
+	case *cmd == "script":
+		data, err := readData()
+		if err != nil {
+			return nil, err
+		}
+		return func(s *kbp.Session) error { return runScript(s, data) }, nil
+	case *cmd == "apply":
+		data, err := readData()
+		if err != nil {
+			return nil, err
+		}
+		p, err := kbp.ParseProfile(data)
+		if err != nil {
+			return nil, err
+		}
+		return func(s *kbp.Session) error {
+			_, err := s.ApplyProfile(p)
+			return err
+		}, nil
+	case *flush:
+		// flushed below.
+		return func(s *kbp.Session) error { return nil }, nil
+	}
+	return nil, fmt.Errorf("-fleet supports -text, -field, -bulk, -reset, -oled, -flush, -cmd=script and -cmd=apply")
+}
+
+// Run the command given on the command line on every device matching -device
+// and -serial at once, and report how each fared.
+func programFleet(dev string, serials string) {
+	op, err := fleetOp()
+	if err != nil {
+		fmt.Println("Error:", err)
+		usage()
+		return
+	}
+	if *flush {
+		run := op
+		op = func(s *kbp.Session) error {
+			if err := run(s); err != nil {
+				return err
+			}
+			return s.Flush()
+		}
+	}
+	var only []string
+	if serials != "" {
+		only = strings.Split(serials, ",")
+	}
+	devices, err := kbp.QueryFleet(parse(dev), only)
+	if err != nil {
+		fmt.Printf("No devices found with spec %s: %v\n", dev, err)
+		return
+	}
+	fmt.Printf("Programming %d devices\n", len(devices))
+	start := time.Now()
+	results := kbp.RunFleet(devices, op)
+	elapsed := time.Since(start)
+	failed := 0
+	for _, r := range results {
+		status := "OK"
+		if r.Err != nil {
+			status = fmt.Sprintf("Error: %v", r.Err)
+			failed++
+		}
+		fmt.Printf("%-16s %s: %s (%v)\n", r.Device.SerialNbr, r.Device.Path, status, r.Elapsed.Round(time.Millisecond))
+	}
+	fmt.Printf("%d of %d devices OK in %v\n", len(results)-failed, len(results), elapsed.Round(time.Millisecond))
+}
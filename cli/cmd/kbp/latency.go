@@ -0,0 +1,121 @@
+package main
+
+import (
+	"fmt"
+	"math"
+	"slices"
+	"time"
+
+	kbp "github.com/ml8/3x3/cli"
+)
+
+// How often key events are read while timing; the device keeps 16 between
+// reads.
+const latencyPoll = 100 * time.Millisecond
+
+// Durations of one part of the key events of a group, e.g. a key or layer.
+type latencies []time.Duration
+
+// The p-th percentile (0-100), by nearest rank.
+func (l latencies) percentile(p float64) time.Duration {
+	s := slices.Clone(l)
+	slices.Sort(s)
+	return s[max(int(math.Ceil(p/100*float64(len(s))))-1, 0)]
+}
+
+// Key events of a group, split into the parts of their latency.
+type latencyGroup struct {
+	name                    string
+	debounce, report, total latencies
+}
+
+func (g *latencyGroup) add(t kbp.LatencySample) {
+	g.debounce = append(g.debounce, t.Debounce)
+	g.report = append(g.report, t.Report)
+	g.total = append(g.total, t.Debounce+t.Report)
+}
+
+func (g *latencyGroup) print() {
+	fmt.Printf("%-10s %6d", g.name, len(g.total))
+	for _, l := range []latencies{g.debounce, g.report, g.total} {
+		fmt.Printf(" %8d %8d", l.percentile(50).Microseconds(), l.percentile(99).Microseconds())
+	}
+	fmt.Println()
+}
+
+// Mean time between matrix scans over the stats counted since before.
+func scanInterval(before, after []kbp.Stat) (time.Duration, bool) {
+	for i := range after {
+		if after[i].Name != "scan_interval" || i >= len(before) || after[i].Count <= before[i].Count {
+			continue
+		}
+		us := float64(after[i].Sum-before[i].Sum) / float64(after[i].Count-before[i].Count)
+		return time.Duration(us * float64(time.Microsecond)), true
+	}
+	return 0, false
+}
+
+// Time the keys pressed on the device for d, then show percentiles of their
+// latency per key, per layer and overall.
+func latency(dev string, d time.Duration) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	// drop events from before the run.
+	if _, _, err = s.Latency(); err != nil {
+		fmt.Println("Error reading key timings; the firmware may not record them:", err)
+		return
+	}
+	before, _ := s.Stats(false)
+	fmt.Printf("Timing keys for %v; press keys on the device.\n", d)
+	var samples []kbp.LatencySample
+	dropped := 0
+	for end := time.Now().Add(d); time.Now().Before(end); time.Sleep(latencyPoll) {
+		batch, n, err := s.Latency()
+		if err != nil {
+			fmt.Println("Error reading key timings", err)
+			return
+		}
+		samples, dropped = append(samples, batch...), dropped+n
+	}
+	after, _ := s.Stats(false)
+	if scan, ok := scanInterval(before, after); ok {
+		fmt.Printf("Matrix scan interval: mean %dus\n", scan.Microseconds())
+	}
+	fmt.Printf("%d key events, %d dropped\n", len(samples), dropped)
+	if len(samples) == 0 {
+		return
+	}
+
+	// groups are named so that keys sort before layers.
+	all := &latencyGroup{name: "all"}
+	groups := make(map[string]*latencyGroup)
+	group := func(name string) *latencyGroup {
+		if groups[name] == nil {
+			groups[name] = &latencyGroup{name: name}
+		}
+		return groups[name]
+	}
+	for _, t := range samples {
+		all.add(t)
+		group(fmt.Sprintf("key %d:%d", t.Row, t.Col)).add(t)
+		group(fmt.Sprintf("layer %d", t.Layer)).add(t)
+	}
+	fmt.Printf("\n%-10s %6s %17s %17s %17s\n", "(us)", "", "debounce", "report", "total")
+	fmt.Printf("%-10s %6s %8s %8s %8s %8s %8s %8s\n", "", "count", "p50", "p99", "p50", "p99", "p50", "p99")
+	names := make([]string, 0, len(groups))
+	for name := range groups {
+		names = append(names, name)
+	}
+	slices.Sort(names)
+	for _, name := range names {
+		groups[name].print()
+	}
+	all.print()
+	fmt.Print("\ndebounce: from the first matrix scan seeing a switch change to the scan\n" +
+		"          reporting it.\n" +
+		"report: from that scan to the key's report being queued for usb, or to\n" +
+		"        the firmware handling the key (macros, layer cycling).\n")
+}
@@ -1,27 +1,41 @@
 package main
 
 import (
+	"bufio"
 	"flag"
 	"fmt"
+	"io"
 	"io/ioutil"
 	"os"
 	"strconv"
 	"strings"
+	"time"
 
 	"github.com/golang/glog"
 	kbp "github.com/ml8/3x3/cli"
 )
 
 var (
-	cmd   = flag.String("cmd", "", "one of: ls, deviceinfo, raw")
+	cmd   = flag.String("cmd", "", "one of: ls, deviceinfo, raw, script, apply, stats, latency, get, fb, macro, play")
 	reset = flag.Bool("reset", false, "Reset layer text to device-initialized text")
-	layer = flag.Int("layer", -1, "Layer number (0-3) to update text for")
+	layer = flag.Int("layer", -1, fmt.Sprintf("Layer number (0-%d) to update text for, or to read with -cmd=get", kbp.LAYER_COUNT-1))
 	text  = flag.String("text", "", "Text to set for the given layer")
+	field = flag.String("field", "", "Label field to set to -text, or to clear without it")
+	bulk  = flag.Bool("bulk", false, "Set the text of all layers, one line per layer, from -file or stdin")
+	force = flag.Bool("force", false, "Upload layer text even if the device already has it")
 	dev   = flag.String("device", ":::::", "Name of device as reported by -cmd=ls")
 	fn    = flag.String("file", "", "name of file to read; alt. use stdin")
 	oled  = flag.String("oled", "", "Turn oled on/off; value must be \"on\" or \"off\"")
+	flush = flag.Bool("flush", false, "Write pending changes to eeprom now; may be combined with -text or -bulk")
 	hi    = flag.Bool("hi", false, "Debug: hello message")
 	echo  = flag.String("echo", "", "Text to echo")
+	clear = flag.Bool("clear", false, "With -cmd=stats, clear the device's stats after reading them; with -cmd=macro, delete all macros")
+	macro = flag.Int("macro", -1, "Macro number to upload with -cmd=macro, or to type with -cmd=play")
+	bind  = flag.String("bind", "", "With -cmd=macro, key playing the macro as LAYER:ROW:COL")
+	fleet = flag.Bool("fleet", false, "Run the command on every device matching -device (and -serial) at once")
+	sn    = flag.String("serial", "", "Comma separated serial numbers of the devices to use with -fleet")
+	dur   = flag.Duration("duration", 30*time.Second, "With -cmd=latency, how long to time keys for")
+	cache = flag.String("device_cache", kbp.DeviceCachePath, "File caching the path of each device spec; empty to always search for devices")
 )
 
 func usage() {
@@ -33,15 +47,90 @@ To program layer text:
 	Set the layer text to TEXT for the given LAYER_NUM. 
 	Use \\n for new lines; text will not wrap otherwise.
 
+To program the text of several layers at once:
+	%[1]v -bulk [-file FILE]
+
+	Reads one line of text per layer, starting at layer 0, from FILE or stdin.
+	All layers are sent in a single transfer and committed together.
+
+Only layers whose text differs from the device's are uploaded; the device
+reports a hash of each layer's text, so an update that changes nothing takes a
+single round trip. Add -force to upload regardless.
+
+To show a live value, such as a timer or volume, in layer text:
+	%[1]v -field NAME [-text VALUE]
+
+	Layer text may hold fields, written {NAME}, each showing the value last
+	set for it, left aligned and cut or padded to the width of its braces;
+	spaces inside them make room for longer values, e.g. "Vol {vol  }". A
+	value is sent in a single frame and is not written to eeprom, so it is
+	blank again after a power cycle. Without -text the field is cleared.
+
 To reset layer text to device-default text:
 	%[1]v -reset
 
+The device writes label changes to eeprom after a short quiet period. To make
+them durable immediately, add -flush to an update, or run it on its own:
+	%[1]v -flush
+
 To turn oled off/on:
 	%[1]v -oled on|off
 
 For raw programming and other utilities:
 	%[1]v -cmd=[ls,deviceinfo,prog]
 
+To read back the text of all layers, or of one layer:
+	%[1]v -cmd=get [-layer LAYER_NUM]
+
+To show on-device timings of hid, eeprom, oled and matrix scan paths:
+	%[1]v -cmd=stats [-clear]
+
+To time keys pressed on the device, from the switch to the usb report:
+	%[1]v -cmd=latency [-duration 30s]
+
+	Shows the median and 99th percentile of each key's latency, per key and
+	per layer, split into debouncing and processing until the report is
+	queued, and the mean matrix scan interval.
+
+To show images on the oled instead of layer text:
+	%[1]v -cmd=fb [-file FILE]
+
+	Reads a 128x32 PNG, or any number of PBM bitmaps (P1 or P4), from FILE or
+	stdin; larger images are cropped. Black pixels of bitmaps and dark pixels
+	of PNGs are lit. Each image replaces the last as soon as it is read, so a
+	program can pipe in frames to animate the display. Only the parts of an
+	image that changed are sent. Layer text is shown again with -oled on.
+
+To store a macro on the device, or delete all macros:
+	%[1]v -cmd=macro -macro NUM [-bind LAYER:ROW:COL] [-text TEXT]
+	%[1]v -cmd=macro -clear
+
+	Types TEXT, or the text of -file or stdin, on a US layout. {...} presses a
+	chord of at most one key and any of ctrl, shift, alt and cmd, e.g.
+	"{cmd+space}terminal{enter}"; named keys are enter, esc, backspace, tab,
+	space, delete, home, end, pgup, pgdn, up, down, left, right and f1-f12.
+	{pause} waits a report, and {{ types a {. With -bind, pressing the key at
+	ROW, COL of the matrix while LAYER is the highest active layer plays the
+	macro instead of the key. Empty text deletes the macro.
+
+To type a macro now:
+	%[1]v -cmd=play -macro NUM
+
+To apply a profile of layer text and oled state, changing only what differs:
+	%[1]v -cmd=apply [-file FILE]
+
+	Reads a JSON profile from FILE or stdin, e.g.
+		{"layers": ["Media\nPrev | Play | Next", null, "Zoom"], "oled": "on"}
+	where a null or missing layer, or a missing oled state, is left as it is.
+
+To run a script of commands over a single connection:
+	%[1]v -cmd=script [-file FILE]
+
+	Reads one command per line from FILE or stdin:
+		text LAYER TEXT, bulk (lines of text, then "end"), field NAME
+		[VALUE], reset, oled on|off, flush, hello, echo TEXT
+	Lines starting with # are comments. Stops at the first failing command.
+
 To use echo/hello debug functions:
 	%[1]v -echo TEXT
 	%[1]v -hi
@@ -49,13 +138,21 @@ To use echo/hello debug functions:
 To specific a device (for all commands), supply a device string:
 	%[1]v -device DEVICE_STRING
 
-	DEVICE_STRING format - VENDOR_NAME:PRODUCT_NAME:VENDOR_ID:PRODUCT_ID:USAGE_ID:USAGE_PAGE
+	DEVICE_STRING format - VENDOR_NAME:PRODUCT_NAME:VENDOR_ID:PRODUCT_ID:USAGE_ID:USAGE_PAGE[:SERIAL]
 
 	Any field above may be empty, e.g., "::6d6c:3333::" specifies a vendor and product id only,
 	whereas "Marion Lang:ml8_9:::0001:" specifies vendor and product name as well as usage id.
 	Exact matches are required for any populated field. All ID/PAGE fields must be base 16.
 	By default: usage id and usage page set to generic hid interface for QMK devices, if you 
-	wish to use other id/pages, or any, use 0 for both.
+	wish to use other id/pages, or any, use 0 for both. SERIAL, if given, selects the device
+	with that serial number, as shown by -cmd=ls.
+
+To program many devices at once, add -fleet to -text, -field, -bulk, -reset, -oled,
+-flush, -cmd=script or -cmd=apply:
+	%[1]v -fleet [-serial SERIAL,...] -device DEVICE_STRING -bulk -file FILE
+
+	Every device matching DEVICE_STRING (and, with -serial, having one of the given serial
+	numbers) is programmed concurrently, and the result and time taken of each is reported.
 `, exe)
 }
 
@@ -65,7 +162,7 @@ func ls() {
 
 func parse(dev string) *kbp.DeviceQueryParams {
 	props := strings.Split(dev, ":")
-	if len(props) != 6 {
+	if len(props) != 6 && len(props) != 7 {
 		glog.Errorf("Incorrect query string %s, parsed %d fields", dev, len(props))
 		return nil
 	}
@@ -92,6 +189,9 @@ func parse(dev string) *kbp.DeviceQueryParams {
 		t, _ := strconv.ParseUint(props[5], 16, 16)
 		d.UsagePage = uint16(t)
 	}
+	if len(props) == 7 {
+		d.Serial = props[6]
+	}
 	glog.Infof("Using query params: %s", d)
 	return d
 }
@@ -107,28 +207,30 @@ func deviceinfo(dev string) {
 	}
 }
 
-func getDev(dev string) (device kbp.DeviceInfo, err error) {
-	devs, err := kbp.Query(parse(dev))
-	if len(devs) != 1 || err != nil {
-		fmt.Printf("No unique device found; found %d devices with spec %s. Errors: %v", len(devs), dev, err)
+// Open a session on the device matching the spec. The path of a spec with a
+// serial number is cached, so later invocations skip enumerating devices while
+// it stays plugged in.
+func openDev(dev string) (s *kbp.Session, err error) {
+	s, err = kbp.OpenQuerySession(parse(dev))
+	if err != nil {
+		fmt.Printf("No unique device found with spec %s. Errors: %v", dev, err)
 		usage()
-		return
 	}
-	device = devs[0]
 	return
 }
 
 func raw(dev string) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	data, e := readData()
 	if e != nil {
 		fmt.Println("Error reading data", e)
 		return
 	}
-	resp, e := kbp.SendRaw(device, data)
+	resp, e := s.Raw(data)
 	if e != nil {
 		fmt.Println("Error sending data", e)
 	} else {
@@ -137,14 +239,249 @@ func raw(dev string) {
 	}
 }
 
+func script(dev string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	data, err := readData()
+	if err != nil {
+		fmt.Println("Error reading data", err)
+		return
+	}
+	if err = runScript(s, data); err != nil {
+		fmt.Println("Error running script:", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
+// Apply the profile read from -file or stdin.
+func apply(dev string) {
+	data, err := readData()
+	if err != nil {
+		fmt.Println("Error reading data", err)
+		return
+	}
+	p, err := kbp.ParseProfile(data)
+	if err != nil {
+		fmt.Println(err)
+		return
+	}
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	changes, err := s.ApplyProfile(p)
+	if err != nil {
+		fmt.Println("Error applying profile:", err)
+		return
+	}
+	if len(changes.Layers) > 0 {
+		fmt.Printf("Uploaded layers %v\n", changes.Layers)
+	}
+	if changes.Oled {
+		fmt.Printf("Turned oled %s\n", p.Oled)
+	}
+	if len(changes.Layers) == 0 && !changes.Oled {
+		fmt.Println("Device already matches the profile; nothing to change")
+	}
+	fmt.Println("OK")
+}
+
+// Print the text of one layer, or of all layers if layer is -1, as set by
+// -text (with \n for new lines).
+func get(dev string, layer int) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	var texts []string
+	if layer == -1 {
+		texts, err = s.GetLayers()
+	} else {
+		var txt string
+		txt, err = s.GetLayer(uint8(layer))
+		texts = []string{txt}
+	}
+	if err != nil {
+		fmt.Println("Error reading layer text", err)
+		return
+	}
+	for i, txt := range texts {
+		if layer != -1 {
+			i = layer
+		}
+		fmt.Printf("%d: %s\n", i, strings.ReplaceAll(txt, "\n", "\\n"))
+	}
+}
+
+// Column headers of a stat's histogram buckets.
+func bucketNames() (names []string) {
+	for b := 0; b < kbp.StatBuckets-1; b++ {
+		names = append(names, fmt.Sprintf("<%dus", 16<<(2*b)))
+	}
+	return append(names, "more")
+}
+
+func stats(dev string, clear bool) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	stats, err := s.Stats(clear)
+	if err != nil {
+		fmt.Println("Error reading stats", err)
+		return
+	}
+	fmt.Printf("%-14s %8s %8s %8s %8s", "stat (us)", "count", "min", "mean", "max")
+	for _, n := range bucketNames() {
+		fmt.Printf(" %8s", n)
+	}
+	fmt.Println()
+	for _, st := range stats {
+		if st.Count == 0 {
+			fmt.Printf("%-14s %8d\n", st.Name, 0)
+			continue
+		}
+		fmt.Printf("%-14s %8d %8d %8.0f %8d", st.Name, st.Count, st.Min, st.Mean(), st.Max)
+		for _, n := range st.Buckets {
+			fmt.Printf(" %8d", n)
+		}
+		fmt.Println()
+	}
+}
+
+// Show each image read from -file or stdin in turn.
+func framebuffer(dev string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	in := os.Stdin
+	if *fn != "" {
+		if in, err = os.Open(*fn); err != nil {
+			fmt.Println("Error reading data", err)
+			return
+		}
+		defer in.Close()
+	}
+	r := bufio.NewReader(in)
+	start := time.Now()
+	n := 0
+	for ; ; n++ {
+		fb, err := kbp.ReadFramebuffer(r)
+		if err == io.EOF {
+			break
+		} else if err != nil {
+			fmt.Println("Error reading image", err)
+			return
+		}
+		if err = s.ShowFramebuffer(fb); err != nil {
+			fmt.Println("Error sending image", err)
+			return
+		}
+	}
+	if n > 1 {
+		fmt.Printf("Showed %d images at %.1f/s\n", n, float64(n)/time.Since(start).Seconds())
+	}
+	fmt.Println("OK")
+}
+
+func uploadMacro(dev string, id int, bind string, text string) {
+	var key *kbp.MacroKey
+	if bind != "" {
+		key = &kbp.MacroKey{}
+		if _, err := fmt.Sscanf(bind, "%d:%d:%d", &key.Layer, &key.Row, &key.Col); err != nil {
+			fmt.Println("Bad -bind; expected LAYER:ROW:COL:", err)
+			return
+		}
+	}
+	if text == "" {
+		data, err := readData()
+		if err != nil {
+			fmt.Println("Error reading data", err)
+			return
+		}
+		text = string(data)
+	}
+	steps, err := kbp.ParseMacro(strings.ReplaceAll(text, "\\n", "\n"))
+	if err != nil {
+		fmt.Println("Error parsing macro:", err)
+		return
+	}
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	fmt.Printf("Uploading macro %d of %d steps\n", id, len(steps)/2)
+	if err = s.UploadMacro(uint8(id), key, steps); err != nil {
+		fmt.Println("Error uploading macro:", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
+func eraseMacros(dev string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	fmt.Println("Deleting all macros")
+	if err = s.EraseMacros(); err != nil {
+		fmt.Println("Error deleting macros:", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
+func playMacro(dev string, id int) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	if err = s.PlayMacro(uint8(id)); err != nil {
+		fmt.Println("Error playing macro:", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
+func setField(dev string, name string, value string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	fmt.Printf("Setting field %s to %s\n", name, value)
+	if err = s.SetField(name, value); err != nil {
+		fmt.Println("Error setting field:", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
 func program(dev string, layer int, text string) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	fmt.Printf("Programming layer %d with %s\n", layer, text)
 	text = strings.ReplaceAll(text, "\\n", "\n")
-	err = kbp.SendLayerUpdate(device, uint8(layer), text)
+	if *force {
+		err = s.LayerUpdate(uint8(layer), text)
+	} else {
+		err = sync(s, map[uint8]string{uint8(layer): text})
+	}
 	if err != nil {
 		fmt.Println("Error programming layer data", err)
 	} else {
@@ -152,13 +489,76 @@ func program(dev string, layer int, text string) {
 	}
 }
 
+// Upload the text of layers whose text differs from the device's.
+func sync(s *kbp.Session, texts map[uint8]string) error {
+	updated, err := s.SyncLayers(texts)
+	if err == nil && len(updated) == 0 {
+		fmt.Println("Device already has this text; nothing to upload")
+	} else if err == nil && len(updated) < len(texts) {
+		fmt.Printf("Uploaded changed layers %v\n", updated)
+	}
+	return err
+}
+
+func programBulk(dev string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	data, err := readData()
+	if err != nil {
+		fmt.Println("Error reading data", err)
+		return
+	}
+	texts := strings.Split(strings.TrimRight(string(data), "\n"), "\n")
+	if len(texts) > kbp.LAYER_COUNT {
+		fmt.Printf("Device only supports %d layers; got %d lines\n", kbp.LAYER_COUNT, len(texts))
+		return
+	}
+	for i := range texts {
+		texts[i] = strings.ReplaceAll(texts[i], "\\n", "\n")
+		fmt.Printf("Programming layer %d with %s\n", i, texts[i])
+	}
+	if *force {
+		err = s.BulkLayerUpdate(texts)
+	} else {
+		byLayer := make(map[uint8]string, len(texts))
+		for i, txt := range texts {
+			byLayer[uint8(i)] = txt
+		}
+		err = sync(s, byLayer)
+	}
+	if err != nil {
+		fmt.Println("Error programming layer data", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
+func flushDevice(dev string) {
+	s, err := openDev(dev)
+	if err != nil {
+		return
+	}
+	defer s.Close()
+	fmt.Printf("Flushing pending changes\n")
+	err = s.Flush()
+	if err != nil {
+		fmt.Printf("Error flushing: %v", err)
+	} else {
+		fmt.Println("OK")
+	}
+}
+
 func resetOled(dev string) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	fmt.Printf("Resetting OLED text\n")
-	err = kbp.SendLayerReset(device)
+	err = s.LayerReset()
 	if err != nil {
 		fmt.Printf("Error resetting layer text: %v", err)
 	} else {
@@ -167,40 +567,45 @@ func resetOled(dev string) {
 }
 
 func hello(dev string) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	fmt.Printf("Sending hello message\n")
-	err = kbp.SendHello(device)
+	resp, err := s.Hello()
 	if err != nil {
 		fmt.Printf("Error sending hello: %v", err)
 	} else {
+		fmt.Printf("Got response: %s\n", resp)
 		fmt.Println("OK")
 	}
 }
 
 func ping(dev string, txt string) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	fmt.Printf("Sending echo message\n")
-	err = kbp.SendEcho(device, txt)
+	resp, err := s.Echo(txt)
 	if err != nil {
 		fmt.Printf("Error sending echo: %v", err)
 	} else {
+		fmt.Printf("Got response: %s\n", resp)
 		fmt.Println("OK")
 	}
 }
 
 func toggleOled(dev string, on bool) {
-	device, err := getDev(dev)
+	s, err := openDev(dev)
 	if err != nil {
 		return
 	}
+	defer s.Close()
 	fmt.Printf("Sending oled message, on = %v\n", on)
-	err = kbp.SendOledState(device, on)
+	err = s.OledState(on)
 	if err != nil {
 		fmt.Printf("Error sending oled state toggle: %v", err)
 	} else {
@@ -225,9 +630,15 @@ func readData() (bytes []byte, e error) {
 
 func main() {
 	flag.Parse()
+	kbp.DeviceCachePath = *cache
 	kbp.Init()
 	defer kbp.Exit()
 
+	if *fleet {
+		programFleet(*dev, *sn)
+		return
+	}
+
 	if *reset {
 		resetOled(*dev)
 		return
@@ -256,14 +667,52 @@ func main() {
 		return
 	}
 
+	if *flush {
+		defer flushDevice(*dev)
+	}
+
+	if *bulk {
+		programBulk(*dev)
+		return
+	}
+
+	if *cmd == "get" {
+		if *layer < -1 || *layer >= kbp.LAYER_COUNT {
+			fmt.Printf("Device only supports %d layers numbered 0-%d\n", kbp.LAYER_COUNT, kbp.LAYER_COUNT-1)
+			return
+		}
+		get(*dev, *layer)
+		return
+	}
+
+	if *cmd == "macro" || *cmd == "play" {
+		switch {
+		case *cmd == "macro" && *clear:
+			eraseMacros(*dev)
+		case *macro < 0 || *macro > 0xff:
+			fmt.Printf("-macro must be a macro number\n")
+			usage()
+		case *cmd == "macro":
+			uploadMacro(*dev, *macro, *bind, *text)
+		default:
+			playMacro(*dev, *macro)
+		}
+		return
+	}
+
+	if *field != "" {
+		setField(*dev, *field, *text)
+		return
+	}
+
 	if *layer != -1 || *text != "" {
 		if *layer == -1 || *text == "" {
 			fmt.Printf("When programming layer text, both -layer and -text must be supplied.\n")
 			usage()
 			return
 		}
-		if *layer < 0 || *layer > 3 {
-			fmt.Printf("Device only supports 4 layers numbered 0-4\n")
+		if *layer < 0 || *layer >= kbp.LAYER_COUNT {
+			fmt.Printf("Device only supports %d layers numbered 0-%d\n", kbp.LAYER_COUNT, kbp.LAYER_COUNT-1)
 			return
 		}
 		program(*dev, *layer, *text)
@@ -280,6 +729,20 @@ func main() {
 		break
 	case "raw":
 		raw(*dev)
+	case "script":
+		script(*dev)
+	case "apply":
+		apply(*dev)
+	case "stats":
+		stats(*dev, *clear)
+	case "latency":
+		latency(*dev, *dur)
+	case "fb":
+		framebuffer(*dev)
+	case "":
+		if !*flush {
+			usage()
+		}
 	default:
 		usage()
 	}
@@ -0,0 +1,130 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"strconv"
+	"strings"
+
+	kbp "github.com/ml8/3x3/cli"
+)
+
+// A script is a list of commands, one per line, run in a single session:
+//
+//	text LAYER TEXT   set the text of a layer (\n for new lines)
+//	bulk              set the text of layers 0.. from the following lines,
+//	...               up to a line reading "end"
+//	end
+//	field NAME VALUE  set a field shown in layer text; no VALUE clears it
+//	reset             reset layer text to device defaults
+//	oled on|off       turn the oled on or off
+//	flush             write pending changes to eeprom
+//	get               print the text of all layers
+//	stats             print on-device timings
+//	hello             debug: hello message
+//	echo TEXT         debug: echo TEXT
+//
+// Blank lines and lines starting with # are ignored. As on the command line,
+// text and bulk only upload layers that changed unless -force is given.
+func runScript(s *kbp.Session, script []byte) error {
+	scanner := bufio.NewScanner(bytes.NewReader(script))
+	n := 0
+	next := func() (string, bool) {
+		if !scanner.Scan() {
+			return "", false
+		}
+		n++
+		return strings.TrimRight(scanner.Text(), "\r"), true
+	}
+	for line, ok := next(); ok; line, ok = next() {
+		if strings.TrimSpace(line) == "" || strings.HasPrefix(line, "#") {
+			continue
+		}
+		start := n
+		cmd, args, _ := strings.Cut(strings.TrimSpace(line), " ")
+		args = strings.TrimLeft(args, " ")
+		var err error
+		switch cmd {
+		case "text":
+			l, txt, _ := strings.Cut(args, " ")
+			layer, e := strconv.Atoi(l)
+			if e != nil || layer < 0 || layer >= kbp.LAYER_COUNT {
+				return fmt.Errorf("line %d: layer must be 0-%d, got %q", start, kbp.LAYER_COUNT-1, l)
+			}
+			txt = strings.ReplaceAll(txt, "\\n", "\n")
+			if *force {
+				err = s.LayerUpdate(uint8(layer), txt)
+			} else {
+				err = sync(s, map[uint8]string{uint8(layer): txt})
+			}
+		case "bulk":
+			var texts []string
+			for {
+				txt, ok := next()
+				if !ok {
+					return fmt.Errorf("line %d: bulk without end", start)
+				}
+				if txt == "end" {
+					break
+				}
+				texts = append(texts, strings.ReplaceAll(txt, "\\n", "\n"))
+			}
+			if len(texts) > kbp.LAYER_COUNT {
+				return fmt.Errorf("line %d: device only supports %d layers; got %d lines", start, kbp.LAYER_COUNT, len(texts))
+			}
+			if *force {
+				err = s.BulkLayerUpdate(texts)
+			} else {
+				byLayer := make(map[uint8]string, len(texts))
+				for i, txt := range texts {
+					byLayer[uint8(i)] = txt
+				}
+				err = sync(s, byLayer)
+			}
+		case "field":
+			name, value, _ := strings.Cut(args, " ")
+			err = s.SetField(name, value)
+		case "reset":
+			err = s.LayerReset()
+		case "oled":
+			if args != "on" && args != "off" {
+				return fmt.Errorf("line %d: oled must be on or off", start)
+			}
+			err = s.OledState(args == "on")
+		case "flush":
+			err = s.Flush()
+		case "get":
+			var texts []string
+			if texts, err = s.GetLayers(); err == nil {
+				for i, txt := range texts {
+					fmt.Printf("%d: %s\n", i, strings.ReplaceAll(txt, "\n", "\\n"))
+				}
+			}
+		case "stats":
+			var stats []kbp.Stat
+			if stats, err = s.Stats(false); err == nil {
+				for _, st := range stats {
+					fmt.Printf("%s: count %d min %d mean %.0f max %d us\n", st.Name, st.Count, st.Min, st.Mean(), st.Max)
+				}
+			}
+		case "hello":
+			var resp string
+			if resp, err = s.Hello(); err == nil {
+				fmt.Printf("Got response: %s\n", resp)
+			}
+		case "echo":
+			var resp string
+			if resp, err = s.Echo(args); err == nil {
+				fmt.Printf("Got response: %s\n", resp)
+			}
+		default:
+			return fmt.Errorf("line %d: unknown command %q", start, cmd)
+		}
+		if err != nil {
+			return fmt.Errorf("line %d: %s: %v", start, cmd, err)
+		}
+		fmt.Printf("%d: %s OK\n", start, cmd)
+	}
+	return scanner.Err()
+}
@@ -0,0 +1,305 @@
+// Command kbpbench times kbp sessions end to end against an in-process fake
+// device (kbp.FakeDevice), so that protocol throughput can be measured and
+// regressions caught without a keyboard attached. Every operation's effect
+// on the device is checked; kbpbench exits 1 if any is wrong.
+package main
+
+import (
+	"bytes"
+	"errors"
+	"flag"
+	"fmt"
+	"os"
+	"strings"
+	"testing"
+	"time"
+
+	kbp "github.com/ml8/3x3/cli"
+)
+
+var (
+	frameTime = flag.Duration("frame_time", time.Millisecond, "Time the device takes per frame received, e.g. a usb poll interval")
+	latency   = flag.Duration("latency", 500*time.Microsecond, "Delay of each reply on its way to the host")
+	loss      = flag.Float64("loss", 0.01, "Fraction of frames lost in the lossy scenarios")
+	busy      = flag.Float64("busy", 0.1, "Fraction of label update frames refused as busy in the busy scenarios")
+	only      = flag.String("run", "", "Only run scenarios whose name contains this")
+)
+
+var labels = []string{
+	"Media\nPrev | Play | Next \nStop | Mute | ^\n  <  |   >  | v",
+	"Code\nBuild | Test | Run \nStep | Over | Out\nFind | Next | Prev",
+	"Zoom\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
+	"Git\nPull | Push | Diff \nAdd  | Stash| Log\nBlame|      |",
+}
+
+// A benchmark: set up a device, then run op on it repeatedly. device, if set,
+// acts on the device before operation i, e.g. as keys pressed on it would.
+// check, if set, verifies the device after operation i.
+type scenario struct {
+	name   string
+	lossy  bool
+	busy   bool
+	setup  func(d *kbp.FakeDevice, s *kbp.Session) error
+	device func(d *kbp.FakeDevice, i int)
+	op     func(s *kbp.Session, i int) error
+	check  func(d *kbp.FakeDevice, i int) error
+}
+
+// Labels of every layer for operation i, rotated so each operation changes
+// all of them.
+func rotated(i int) []string {
+	texts := make([]string, len(labels))
+	for l := range texts {
+		texts[l] = labels[(l+i)%len(labels)]
+	}
+	return texts
+}
+
+func checkLabels(want []string) func(d *kbp.FakeDevice, i int) error {
+	return func(d *kbp.FakeDevice, i int) error {
+		got := d.Labels()
+		for l := range want {
+			if got[l] != want[l] {
+				return fmt.Errorf("layer %d is %q, want %q", l, got[l], want[l])
+			}
+		}
+		return nil
+	}
+}
+
+func checkRotated(d *kbp.FakeDevice, i int) error {
+	return checkLabels(rotated(i))(d, i)
+}
+
+// A meter moving along the bottom row, as a live volume display would send.
+func meter(i int) []byte {
+	return kbp.PackFramebuffer(kbp.OledWidth, kbp.OledHeight, func(x, y int) bool {
+		return y >= 24 && x < i*7%kbp.OledWidth || y < 8 && x < 32 && x%4 != 0
+	})
+}
+
+// Diagonal stripes, alternating direction, changing every byte.
+func stripes(i int) []byte {
+	return kbp.PackFramebuffer(kbp.OledWidth, kbp.OledHeight, func(x, y int) bool {
+		if i%2 == 0 {
+			return (x+y)%4 == 0
+		}
+		return (x-y+kbp.OledHeight)%4 == 0
+	})
+}
+
+func checkFramebuffer(image func(int) []byte) func(d *kbp.FakeDevice, i int) error {
+	return func(d *kbp.FakeDevice, i int) error {
+		if fb, raw := d.Framebuffer(); !raw || !bytes.Equal(fb, image(i)) {
+			return errors.New("framebuffer does not show the image")
+		}
+		return nil
+	}
+}
+
+// A meeting timer, as mm:ss, i seconds in.
+func timer(i int) string {
+	return fmt.Sprintf("%02d:%02d", i/60%100, i%60)
+}
+
+// The i-th key event of a run of typing on every key.
+func keyEvent(i int) kbp.LatencySample {
+	return kbp.LatencySample{
+		Row: uint8(i / 2 % 12 / 3), Col: uint8(i / 2 % 3), Pressed: i%2 == 0,
+		Debounce: 5 * time.Millisecond, Report: time.Duration(100+i%50) * time.Microsecond,
+	}
+}
+
+var macroText = strings.Repeat("{cmd+space}terminal{enter}git status{enter}", 3)
+
+var scenarios = []scenario{
+	{name: "hello", op: func(s *kbp.Session, i int) error {
+		_, err := s.Hello()
+		return err
+	}},
+	{name: "label (1 layer)", op: func(s *kbp.Session, i int) error {
+		return s.LayerUpdate(0, labels[i%len(labels)])
+	}, check: func(d *kbp.FakeDevice, i int) error {
+		return checkLabels([]string{labels[i%len(labels)]})(d, i)
+	}},
+	{name: "field (live value)", setup: func(d *kbp.FakeDevice, s *kbp.Session) error {
+		return s.LayerUpdate(0, "Zoom {t    }\nTalk | Mic  | {mic }\nFull | Quit | Enter")
+	}, op: func(s *kbp.Session, i int) error {
+		return s.SetField("t", timer(i))
+	}, check: func(d *kbp.FakeDevice, i int) error {
+		if d.Field("t") != timer(i) {
+			return fmt.Errorf("field is %q, want %q", d.Field("t"), timer(i))
+		}
+		return nil
+	}},
+	{name: "all layers", op: func(s *kbp.Session, i int) error {
+		for l, txt := range rotated(i) {
+			if err := s.LayerUpdate(uint8(l), txt); err != nil {
+				return err
+			}
+		}
+		return nil
+	}, check: checkRotated},
+	{name: "all layers (bulk)", op: func(s *kbp.Session, i int) error {
+		return s.BulkLayerUpdate(rotated(i))
+	}, check: checkRotated},
+	{name: "sync (unchanged)", setup: func(d *kbp.FakeDevice, s *kbp.Session) error {
+		return s.BulkLayerUpdate(labels)
+	}, op: func(s *kbp.Session, i int) error {
+		txts := make(map[uint8]string)
+		for l, txt := range labels {
+			txts[uint8(l)] = txt
+		}
+		_, err := s.SyncLayers(txts)
+		return err
+	}, check: checkLabels(labels)},
+	{name: "profile (1 change)", op: func(s *kbp.Session, i int) error {
+		texts := rotated(i)
+		p := &kbp.Profile{Oled: "on", Layers: []*string{nil, nil, &texts[2]}}
+		_, err := s.ApplyProfile(p)
+		return err
+	}, check: func(d *kbp.FakeDevice, i int) error {
+		return checkLabels([]string{kbp.NewFakeDevice().Labels()[0], kbp.NewFakeDevice().Labels()[1], rotated(i)[2]})(d, i)
+	}},
+	{name: "get (all layers)", op: func(s *kbp.Session, i int) error {
+		_, err := s.GetLayers()
+		return err
+	}},
+	{name: "framebuffer (full)", op: func(s *kbp.Session, i int) error {
+		return s.ShowFramebuffer(stripes(i))
+	}, check: checkFramebuffer(stripes)},
+	{name: "framebuffer (meter)", op: func(s *kbp.Session, i int) error {
+		return s.ShowFramebuffer(meter(i))
+	}, check: checkFramebuffer(meter)},
+	{name: "latency (8 key events)", device: func(d *kbp.FakeDevice, i int) {
+		for e := 8 * i; e < 8*i+8; e++ {
+			d.TimeKey(keyEvent(e))
+		}
+	}, op: func(s *kbp.Session, i int) error {
+		samples, dropped, err := s.Latency()
+		if err != nil {
+			return err
+		}
+		if len(samples) != 8 || dropped != 0 {
+			return fmt.Errorf("read %d key events, %d dropped; want 8", len(samples), dropped)
+		}
+		for e, t := range samples {
+			if t != keyEvent(8*i+e) {
+				return fmt.Errorf("key event %d is %+v, want %+v", e, t, keyEvent(8*i+e))
+			}
+		}
+		return nil
+	}},
+	{name: "macro (upload)", op: func(s *kbp.Session, i int) error {
+		steps, err := kbp.ParseMacro(macroText)
+		if err == nil {
+			// the device reclaims the space of replaced macros.
+			err = s.UploadMacro(uint8(i%2), &kbp.MacroKey{Layer: 0, Row: 1, Col: 2}, steps)
+		}
+		return err
+	}, check: func(d *kbp.FakeDevice, i int) error {
+		want, _ := kbp.ParseMacro(macroText)
+		if steps, layer, pos := d.Macro(uint8(i % 2)); !bytes.Equal(steps, want) || layer != 0 || pos != 0x12 {
+			return errors.New("macro was not stored")
+		}
+		return nil
+	}},
+	{name: "all layers (bulk, lossy)", lossy: true, op: func(s *kbp.Session, i int) error {
+		return s.BulkLayerUpdate(rotated(i))
+	}},
+	{name: "all layers (busy)", busy: true, op: func(s *kbp.Session, i int) error {
+		for l, txt := range rotated(i) {
+			if err := s.LayerUpdate(uint8(l), txt); err != nil {
+				return err
+			}
+		}
+		return nil
+	}, check: checkRotated},
+	{name: "all layers (bulk, busy)", busy: true, op: func(s *kbp.Session, i int) error {
+		return s.BulkLayerUpdate(rotated(i))
+	}, check: checkRotated},
+}
+
+// Run a scenario as a benchmark; returns the result and the first operation
+// that failed or left the device in the wrong state.
+func run(sc scenario) (r testing.BenchmarkResult, failure error) {
+	r = testing.Benchmark(func(b *testing.B) {
+		d := kbp.NewFakeDevice()
+		d.FrameTime, d.Latency = *frameTime, *latency
+		s := kbp.NewSession(d)
+		if sc.lossy {
+			// lost frames are only noticed by timing out.
+			s.ReplyTimeout = 10 * (*frameTime + *latency)
+		}
+		// learn the device's capabilities before any frame can be lost.
+		if _, err := s.State(); err != nil {
+			failure = fmt.Errorf("state: %v", err)
+			return
+		}
+		if sc.setup != nil {
+			if err := sc.setup(d, s); err != nil {
+				failure = fmt.Errorf("setup: %v", err)
+				return
+			}
+		}
+		if sc.lossy {
+			d.Loss = *loss
+		}
+		if sc.busy {
+			d.Busy = *busy
+		}
+		received, sent, commits := d.Received, d.Sent, d.Commits
+		errs := 0
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			if sc.device != nil {
+				sc.device(d, i)
+			}
+			err := sc.op(s, i)
+			if err == nil && sc.check != nil {
+				err = sc.check(d, i)
+			}
+			if err != nil {
+				errs++
+				if !sc.lossy && failure == nil {
+					failure = fmt.Errorf("operation %d: %v", i, err)
+				}
+			}
+		}
+		b.StopTimer()
+		n := float64(b.N)
+		b.ReportMetric(float64(d.Received-received)/n, "frames/op")
+		b.ReportMetric(float64(d.Sent-sent)/n, "replies/op")
+		b.ReportMetric(float64(d.Commits-commits)/n, "commits/op")
+		b.ReportMetric(float64(errs)/n, "errors/op")
+	})
+	return
+}
+
+func main() {
+	testing.Init()
+	flag.Parse()
+	fmt.Printf("Device: %v per frame, %v reply latency, %.1f%% loss in lossy scenarios, %.1f%% busy in busy scenarios.\n\n", *frameTime, *latency, *loss*100, *busy*100)
+	fmt.Printf("%-26s %8s %10s %8s %8s %8s %8s\n", "scenario", "ops", "ms/op", "frames", "replies", "commits", "errors")
+	failed := false
+	for _, sc := range scenarios {
+		if !strings.Contains(sc.name, *only) {
+			continue
+		}
+		r, err := run(sc)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s: %v\n", sc.name, err)
+			failed = true
+			continue
+		}
+		fmt.Printf("%-26s %8d %10.3f %8.2f %8.2f %8.2f %8.2f\n", sc.name, r.N, float64(r.NsPerOp())/1e6,
+			r.Extra["frames/op"], r.Extra["replies/op"], r.Extra["commits/op"], r.Extra["errors/op"])
+	}
+	fmt.Print("\nms/op: wall time per operation, including the modelled device and link.\n" +
+		"frames, replies: frames sent to and by the device per operation.\n" +
+		"commits: label commits, each persisted by the device as one eeprom write.\n" +
+		"errors: operations that failed, e.g. by losing a frame.\n")
+	if failed {
+		os.Exit(1)
+	}
+}
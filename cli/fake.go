@@ -0,0 +1,554 @@
+package kbp
+
+import (
+	"bytes"
+	"encoding/binary"
+	"math/rand"
+	"slices"
+	"time"
+)
+
+// Geometry of the device the fake stands in for, as in the firmware's
+// config.h and hid_codes.h.
+const (
+	fakeLayers    = LAYER_COUNT
+	fakeWindow    = 8
+	fakeLabelSize = 4*21 + 3 // oled_text_t, including the terminator
+	fakeMacros    = 16
+	fakeFields    = 4
+	fakeLatency   = 16 // LATENCY_SAMPLES
+	// Bytes of macro steps; the directory takes the first eeprom page of
+	// the 2KB macro region.
+	fakeMacroSpace = 2048 - 128
+)
+
+var fakeSystemLabels = [fakeLayers]string{
+	"Media\nPrev | Play | Next \nStop | Mute | ^\n  <  |   >  | v",
+	"Zoom\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
+	"Meet\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
+	"Teams\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
+}
+
+// A frame the fake has sent, readable once the host could have received it.
+type fakeReply struct {
+	frame []byte
+	at    time.Time
+}
+
+// A macro stored on the fake: its steps and the key it is bound to.
+type fakeMacro struct {
+	start      int // offset in the macro space; steps are appended, then compacted
+	steps      []byte
+	layer, pos uint8
+}
+
+// An in-process stand-in for the keyboard, speaking the raw hid protocol of
+// firmware/keyboards/ml8/ml8_9/hid_handlers.c frame for frame, so that
+// sessions can be run and timed without hardware. Frames are handled one at
+// a time, each taking FrameTime (a usb poll interval) after the previous one,
+// and replies become readable Latency after the frame that caused them.
+//
+// Like a hid handle, a FakeDevice is used from one goroutine at a time.
+type FakeDevice struct {
+	FrameTime time.Duration
+	Latency   time.Duration
+	// Probability that a frame written to the device is lost; Rand decides
+	// which.
+	Loss float64
+	// Probability that a label update frame is refused as busy, as the
+	// firmware does while it writes labels out; the frame is taken when sent
+	// again.
+	Busy float64
+	Rand *rand.Rand
+
+	// Frames received (including lost ones) and sent, and label commits,
+	// each of which the firmware persists as one eeprom write.
+	Received, Sent, Commits int
+	// Macros played with CMD_MACRO_PLAY.
+	Played []uint8
+
+	replies []fakeReply
+	busy    time.Time // when the device is done with the frames received
+	reply   time.Time // when the frame being handled is replied to
+
+	labels  [fakeLayers]string
+	oledOn  bool
+	oledRaw bool
+	fb      [FramebufferSize]byte
+
+	// transfer in flight, as in g_transfer_state.
+	op       uint8
+	layer    uint8
+	buf      []byte
+	staged   map[uint8]string // layers of a bulk update
+	nextSeq  uint8
+	failed   bool
+	refused  bool // the last update frame was refused as busy
+	fbFailed bool
+
+	fields map[string]string // label field values, held in RAM
+	// key events timed, not yet read, and those dropped since the last read.
+	timed   []LatencySample
+	dropped int
+
+	macros [fakeMacros]fakeMacro
+	upload struct {
+		id uint8 // fakeMacros if none
+		fakeMacro
+		len int
+	}
+}
+
+// A fake device showing the default labels, with the oled on.
+func NewFakeDevice() *FakeDevice {
+	d := &FakeDevice{labels: fakeSystemLabels, oledOn: true, fields: make(map[string]string), Rand: rand.New(rand.NewSource(1))}
+	d.upload.id = fakeMacros
+	return d
+}
+
+// The text of every layer.
+func (d *FakeDevice) Labels() []string {
+	return append([]string(nil), d.labels[:]...)
+}
+
+// The framebuffer, and whether it is shown rather than the labels.
+func (d *FakeDevice) Framebuffer() ([]byte, bool) {
+	return append([]byte(nil), d.fb[:]...), d.oledRaw
+}
+
+// The value of a label field, or "" if it has none.
+func (d *FakeDevice) Field(name string) string {
+	return d.fields[name]
+}
+
+// Time a key event as if it had been pressed on the device, to be read with
+// CMD_LATENCY; dropped like the firmware's if LATENCY_SAMPLES are unread.
+func (d *FakeDevice) TimeKey(sample LatencySample) {
+	if len(d.timed) == fakeLatency {
+		d.dropped++
+		return
+	}
+	d.timed = append(d.timed, sample)
+}
+
+// The steps of a macro and the key it is bound to, or nil if there is none.
+func (d *FakeDevice) Macro(id uint8) (steps []byte, layer, pos uint8) {
+	m := d.macros[id]
+	return m.steps, m.layer, m.pos
+}
+
+func (d *FakeDevice) Write(frame []byte) (int, error) {
+	d.Received++
+	now := time.Now()
+	if d.busy.Before(now) {
+		d.busy = now
+	}
+	d.busy = d.busy.Add(d.FrameTime)
+	d.reply = d.busy.Add(d.Latency)
+	if d.Loss > 0 && d.Rand.Float64() < d.Loss {
+		return len(frame), nil
+	}
+	f := make([]byte, 32)
+	copy(f, frame)
+	d.receive(f)
+	return len(frame), nil
+}
+
+// Read the next reply, waiting until it has arrived. As the fake only replies
+// to frames written to it, waits out the timeout if no reply is pending.
+func (d *FakeDevice) ReadWithTimeout(frame []byte, timeout time.Duration) (int, error) {
+	if len(d.replies) == 0 {
+		time.Sleep(timeout)
+		return 0, nil
+	}
+	r := d.replies[0]
+	if wait := time.Until(r.at); wait > timeout {
+		time.Sleep(timeout)
+		return 0, nil
+	} else if wait > 0 {
+		time.Sleep(wait)
+	}
+	d.replies = d.replies[1:]
+	return copy(frame, r.frame), nil
+}
+
+func (d *FakeDevice) Close() error {
+	return nil
+}
+
+func (d *FakeDevice) send(data ...byte) {
+	f := make([]byte, 32)
+	copy(f, data)
+	d.replies = append(d.replies, fakeReply{f, d.reply})
+	d.Sent++
+}
+
+func (d *FakeDevice) ack(cmd uint8) {
+	d.send(CMD_ACK, cmd)
+}
+
+func (d *FakeDevice) nack() {
+	d.send(CMD_NACK)
+}
+
+// user_hid_receive: frames without the header are left to via.
+func (d *FakeDevice) receive(f []byte) {
+	if f[0] != 'm' || f[1] != 'l' {
+		return
+	}
+	if cmd := f[2]; cmd&FLAG_SEQ != 0 {
+		d.sequenced(cmd&^FLAG_SEQ, f[3], f[4:])
+	} else {
+		d.command(cmd, f[3:])
+	}
+}
+
+// handle_hid_command
+func (d *FakeDevice) command(cmd uint8, b []byte) {
+	switch cmd {
+	case CMD_HELLO:
+		d.send(append([]byte{CMD_ACK, CMD_HELLO}, "hello world"...)...)
+	case CMD_ECHO:
+		d.send(append([]byte{CMD_ACK}, b[:28]...)...)
+	case CMD_CAPS:
+		d.send(CMD_ACK, CMD_CAPS, CAP_WINDOWED|CAP_STATE, fakeWindow)
+	case CMD_OLED_OFF, CMD_OLED_ON:
+		d.oledOn = cmd == CMD_OLED_ON
+		d.oledRaw = false
+		d.ack(cmd)
+	case CMD_FLUSH:
+		d.ack(cmd)
+	case CMD_OLED_RESET:
+		d.labels = fakeSystemLabels
+		d.Commits++
+		d.ack(cmd)
+	case CMD_OLED_GET:
+		d.getLayers(b[0])
+	case CMD_OLED_HASHES:
+		f := []byte{CMD_ACK, CMD_OLED_HASHES, fakeLayers}
+		for _, txt := range d.labels {
+			f = binary.LittleEndian.AppendUint16(f, labelHash(txt))
+		}
+		var state byte
+		if d.oledOn {
+			state |= STATE_OLED_ON
+		}
+		if d.oledRaw {
+			state |= STATE_OLED_RAW
+		}
+		d.send(append(f, state)...)
+	case CMD_LATENCY:
+		d.latency()
+	case CMD_OLED_FIELD:
+		if d.field(b) {
+			d.ack(cmd)
+		} else {
+			d.nack()
+		}
+	case CMD_OLED_FRAMEBUFFER:
+		d.framebuffer(b)
+	case CMD_MACRO_BEGIN, CMD_MACRO_DATA, CMD_MACRO_END, CMD_MACRO_ERASE, CMD_MACRO_PLAY:
+		if d.macro(cmd, b) {
+			d.ack(cmd)
+		} else {
+			d.nack()
+		}
+	case CMD_OLED_UPDATE, CMD_OLED_BULK_UPDATE, CMD_COMPLETE, CMD_CONT:
+		if d.refuse(cmd) {
+			d.send(CMD_BUSY, cmd)
+		} else if d.layerUpdate(cmd, b) {
+			d.ack(cmd)
+		} else {
+			d.resetTransfer()
+			d.nack()
+		}
+	default:
+		// stats are not kept by the fake.
+		d.nack()
+	}
+}
+
+// hid_latency
+func (d *FakeDevice) latency() {
+	n := min(len(d.timed), LATENCY_BATCH)
+	f := []byte{CMD_ACK, CMD_LATENCY, byte(n), byte(min(d.dropped, 0xff))}
+	for _, t := range d.timed[:n] {
+		layer := t.Layer
+		if !t.Pressed {
+			layer |= LATENCY_RELEASE
+		}
+		f = append(f, t.Row<<4|t.Col, layer)
+		f = binary.LittleEndian.AppendUint16(f, uint16(min(t.Debounce/time.Microsecond, 0xffff)))
+		f = binary.LittleEndian.AppendUint16(f, uint16(min(t.Report/time.Microsecond, 0xffff)))
+	}
+	d.timed, d.dropped = d.timed[n:], 0
+	d.send(f...)
+}
+
+// oled_field_set: fields are not persisted, so setting one is no commit.
+func (d *FakeDevice) field(b []byte) bool {
+	n, v := int(b[0]), int(b[1])
+	if n == 0 || n > FIELD_NAME_SIZE || v > FIELD_VALUE_SIZE || n+v > FIELD_DATA_SIZE {
+		return false
+	}
+	name, value := string(b[2:2+n]), string(b[2+n:2+n+v])
+	if _, ok := d.fields[name]; !ok && value != "" && len(d.fields) == fakeFields {
+		return false
+	}
+	if value == "" {
+		delete(d.fields, name)
+	} else {
+		d.fields[name] = value
+	}
+	return true
+}
+
+// continue_windowed_hid_command
+func (d *FakeDevice) sequenced(cmd, seq uint8, b []byte) {
+	switch cmd {
+	case CMD_OLED_UPDATE, CMD_OLED_BULK_UPDATE:
+		d.resetTransfer()
+	case CMD_COMPLETE, CMD_CONT:
+		if d.failed {
+			return
+		}
+	default:
+		d.send(CMD_NACK, cmd, seq)
+		return
+	}
+	if d.refused && seq != d.nextSeq {
+		return
+	}
+	if seq == d.nextSeq && d.refuse(cmd) {
+		d.send(CMD_BUSY, cmd, seq)
+		return
+	}
+	if seq != d.nextSeq || b[1] > 26 || !d.layerUpdate(cmd, b) {
+		expected := d.nextSeq
+		d.resetTransfer()
+		d.failed = true
+		d.send(CMD_NACK, cmd, expected)
+		return
+	}
+	d.nextSeq = seq + 1
+	if cmd == CMD_COMPLETE || d.nextSeq%fakeWindow == 0 {
+		d.send(CMD_ACK, cmd, seq)
+	}
+}
+
+// Whether to refuse a frame continuing an update as busy. Start frames are
+// always taken, as the firmware only writes labels out before staging or
+// committing one.
+func (d *FakeDevice) refuse(cmd uint8) bool {
+	if d.refused || (cmd != CMD_CONT && cmd != CMD_COMPLETE) || d.op == CMD_NOOP {
+		d.refused = false
+		return false
+	}
+	d.refused = d.Busy > 0 && d.Rand.Float64() < d.Busy
+	return d.refused
+}
+
+// reset_transfer_state; staged layers are dropped.
+func (d *FakeDevice) resetTransfer() {
+	d.staged = nil
+	d.buf = d.buf[:0]
+	d.op = CMD_NOOP
+	d.nextSeq = 0
+	d.failed = false
+	d.refused = false
+}
+
+// The buffered text, up to the first NUL as copied by strncpy.
+func (d *FakeDevice) buffered() string {
+	if i := bytes.IndexByte(d.buf, 0); i >= 0 {
+		return string(d.buf[:i])
+	}
+	return string(d.buf)
+}
+
+// start_or_continue_oled_layer_update: < layer len data... >
+func (d *FakeDevice) layerUpdate(cmd uint8, b []byte) bool {
+	layer, n := b[0], int(b[1])
+	if n > 27 || layer >= fakeLayers {
+		return false
+	}
+	switch cmd {
+	case CMD_OLED_UPDATE, CMD_OLED_BULK_UPDATE:
+		d.resetTransfer()
+		d.op = cmd
+	case CMD_CONT, CMD_COMPLETE:
+		if d.op == CMD_OLED_BULK_UPDATE && cmd == CMD_CONT && d.layer != layer {
+			d.stage()
+		} else if d.layer != layer {
+			return false
+		}
+	default:
+		return false
+	}
+	if cmd == CMD_COMPLETE {
+		if d.op == CMD_OLED_BULK_UPDATE {
+			d.stage()
+			for l, txt := range d.staged {
+				d.labels[l] = txt
+			}
+		} else {
+			d.labels[d.layer] = d.buffered()
+		}
+		d.Commits++
+		d.resetTransfer()
+		return true
+	}
+	d.layer = layer
+	if n > 0 {
+		if len(d.buf)+n >= fakeLabelSize {
+			return false
+		}
+		d.buf = append(d.buf, b[2:2+n]...)
+	}
+	return true
+}
+
+// stage_bulk_layer
+func (d *FakeDevice) stage() {
+	if d.staged == nil {
+		d.staged = make(map[uint8]string)
+	}
+	d.staged[d.layer] = d.buffered()
+	d.buf = d.buf[:0]
+}
+
+// hid_get_layers
+func (d *FakeDevice) getLayers(first uint8) {
+	last := first
+	if first == GET_ALL_LAYERS {
+		first, last = 0, fakeLayers-1
+	} else if first >= fakeLayers {
+		d.nack()
+		return
+	}
+	for l := first; l <= last; l++ {
+		txt := d.labels[l]
+		for off := 0; ; {
+			n := min(GET_CHUNK_SIZE, len(txt)-off)
+			d.send(append([]byte{CMD_CONT, l, byte(len(txt))}, txt[off:off+n]...)...)
+			if off += n; off >= len(txt) {
+				break
+			}
+		}
+	}
+	d.send(CMD_ACK, CMD_OLED_GET, last-first+1)
+}
+
+// hid_framebuffer: < flags offset_lo offset_hi N rle... >
+func (d *FakeDevice) framebuffer(b []byte) {
+	off, n := int(b[1])|int(b[2])<<8, int(b[3])
+	if n > FB_CHUNK_SIZE || !d.framebufferWrite(off, b[4:4+n]) {
+		d.fbFailed = true
+	}
+	if b[0]&FB_END != 0 {
+		if d.fbFailed {
+			d.fbFailed = false
+			d.nack()
+		} else {
+			d.ack(CMD_OLED_FRAMEBUFFER)
+		}
+	}
+}
+
+// oled_framebuffer_write
+func (d *FakeDevice) framebufferWrite(off int, data []byte) bool {
+	d.oledRaw = true
+	for i := 0; i < len(data); {
+		c := data[i]
+		i++
+		n, run := int(c&^FB_RUN)+1, c&FB_RUN != 0
+		if off+n > FramebufferSize || (run && i+1 > len(data)) || (!run && i+n > len(data)) {
+			return false
+		}
+		for j := 0; j < n; j++ {
+			if run {
+				d.fb[off] = data[i]
+			} else {
+				d.fb[off] = data[i+j]
+			}
+			off++
+		}
+		if run {
+			i++
+		} else {
+			i += n
+		}
+	}
+	return true
+}
+
+// macros_used: bytes of steps up to the end of the last macro's.
+func (d *FakeDevice) macrosUsed() (used int) {
+	for _, m := range d.macros {
+		if len(m.steps) > 0 {
+			used = max(used, m.start+len(m.steps))
+		}
+	}
+	return
+}
+
+// macros_compact: move the steps of each macro, lowest first, down to the end
+// of the one before it.
+func (d *FakeDevice) compactMacros() {
+	order := make([]*fakeMacro, 0, fakeMacros)
+	for i := range d.macros {
+		if len(d.macros[i].steps) > 0 {
+			order = append(order, &d.macros[i])
+		}
+	}
+	slices.SortFunc(order, func(a, b *fakeMacro) int { return a.start - b.start })
+	end := 0
+	for _, m := range order {
+		m.start = end
+		end += len(m.steps)
+	}
+}
+
+// hid_macro and macro_handlers.c
+func (d *FakeDevice) macro(cmd uint8, b []byte) bool {
+	id := b[0]
+	switch cmd {
+	case CMD_MACRO_BEGIN:
+		n := int(b[3]) | int(b[4])<<8
+		if id >= fakeMacros || n%2 != 0 {
+			return false
+		}
+		used := d.macrosUsed()
+		if n > fakeMacroSpace-used {
+			d.compactMacros()
+			used = d.macrosUsed()
+		}
+		if n > fakeMacroSpace-used {
+			return false
+		}
+		d.upload.id = id
+		d.upload.fakeMacro = fakeMacro{start: used, layer: b[1], pos: b[2]}
+		d.upload.len = n
+	case CMD_MACRO_DATA:
+		off, n := int(b[1])|int(b[2])<<8, int(b[3])
+		if id != d.upload.id || n > MACRO_CHUNK_SIZE || off != len(d.upload.steps) || n > d.upload.len-off {
+			return false
+		}
+		d.upload.steps = append(d.upload.steps, b[4:4+n]...)
+	case CMD_MACRO_END:
+		if id != d.upload.id || len(d.upload.steps) != d.upload.len {
+			return false
+		}
+		d.macros[id] = d.upload.fakeMacro
+		d.upload.id = fakeMacros
+	case CMD_MACRO_ERASE:
+		d.macros = [fakeMacros]fakeMacro{}
+		d.upload.id = fakeMacros
+	case CMD_MACRO_PLAY:
+		if id >= fakeMacros || len(d.macros[id].steps) == 0 {
+			return false
+		}
+		d.Played = append(d.Played, id)
+	}
+	return true
+}
@@ -0,0 +1,77 @@
+package kbp
+
+import (
+	"cmp"
+	"slices"
+	"sync"
+	"time"
+
+	"github.com/golang/glog"
+	hid "github.com/sstallion/go-hid"
+)
+
+// The outcome of running a command on one device of a fleet.
+type FleetResult struct {
+	Device  DeviceInfo
+	Err     error
+	Elapsed time.Duration // from opening the device to closing it
+}
+
+// Find every device matching p and, if serials are given, having one of
+// those serial numbers. Devices are ordered by serial number, then path.
+func QueryFleet(p *DeviceQueryParams, serials []string) ([]DeviceInfo, error) {
+	devs, err := openQuery(p)
+	if err != nil {
+		return nil, err
+	}
+	var fleet []DeviceInfo
+	for _, dev := range from(devs) {
+		if len(serials) == 0 || slices.Contains(serials, dev.SerialNbr) {
+			fleet = append(fleet, dev)
+		}
+	}
+	if len(fleet) == 0 {
+		return nil, NoDeviceFound
+	}
+	slices.SortFunc(fleet, func(a, b DeviceInfo) int {
+		if c := cmp.Compare(a.SerialNbr, b.SerialNbr); c != 0 {
+			return c
+		}
+		return cmp.Compare(a.Path, b.Path)
+	})
+	return fleet, nil
+}
+
+// Serializes opening devices; hidapi's open is not safe to call from several
+// threads on every platform, while reads and writes on distinct handles are.
+var fleetOpenMu sync.Mutex
+
+// Run f on every device at once, each in a session of its own on its own
+// goroutine, and wait for all of them. A device failing does not stop the
+// others. Results are in the order of devices.
+func RunFleet(devices []DeviceInfo, f func(s *Session) error) []FleetResult {
+	results := make([]FleetResult, len(devices))
+	var wg sync.WaitGroup
+	for i, device := range devices {
+		results[i].Device = device
+		wg.Add(1)
+		go func(r *FleetResult) {
+			defer wg.Done()
+			start := time.Now()
+			defer func() { r.Elapsed = time.Since(start) }()
+			fleetOpenMu.Lock()
+			dev, err := hid.OpenPath(r.Device.Path)
+			fleetOpenMu.Unlock()
+			if err != nil {
+				r.Err = err
+				return
+			}
+			s := NewSession(dev)
+			defer s.Close()
+			r.Err = f(s)
+			glog.Infof("Device %s done: %v", r.Device.Path, r.Err)
+		}(&results[i])
+	}
+	wg.Wait()
+	return results
+}
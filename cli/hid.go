@@ -1,8 +1,12 @@
 package kbp
 
 import (
+	"encoding/json"
 	"errors"
 	"fmt"
+	"os"
+	"path/filepath"
+	"sync"
 
 	"github.com/golang/glog"
 	hid "github.com/sstallion/go-hid"
@@ -20,11 +24,12 @@ type DeviceQueryParams struct {
 	ProductID   uint16
 	ProductName string
 	VendorName  string
+	Serial      string // serial number; any if empty
 }
 
 func (d *DeviceQueryParams) String() string {
-	return fmt.Sprintf("(vendor name/id: %s/%04x, product name/id: %s/%04x, usage id/page %04x/%04x)",
-		d.VendorName, d.VendorID, d.ProductName, d.ProductID, d.UsageID, d.UsagePage)
+	return fmt.Sprintf("(vendor name/id: %s/%04x, product name/id: %s/%04x, usage id/page %04x/%04x, s/n: %s)",
+		d.VendorName, d.VendorID, d.ProductName, d.ProductID, d.UsageID, d.UsagePage, d.Serial)
 }
 
 func Init() error {
@@ -56,8 +61,15 @@ type DeviceInfo struct {
 	hid.DeviceInfo
 }
 
+var _ Transport = (*hid.Device)(nil)
+
+// Open a device found by Query. Its path is opened directly; the device is
+// only looked up again if the path is unknown.
 func openDevice(device DeviceInfo) (dev *hid.Device, err error) {
 	glog.Infof("Using device %v", device)
+	if device.Path != "" {
+		return hid.OpenPath(device.Path)
+	}
 	devs, err := openDevices(device)
 	glog.Infof("Found %d devices", len(devs))
 	if err != nil {
@@ -140,6 +152,10 @@ func (p *DeviceQueryParams) match(d *hid.DeviceInfo) bool {
 		// vendor doesn't match
 		return false
 	}
+	if p.Serial != "" && p.Serial != d.SerialNbr {
+		// serial number doesn't match
+		return false
+	}
 	return true
 }
 
@@ -151,6 +167,7 @@ func openDevices(d DeviceInfo) (results []*hid.DeviceInfo, e error) {
 		ProductID:   d.ProductID,
 		UsageID:     d.Usage,
 		UsagePage:   d.UsagePage,
+		Serial:      d.SerialNbr,
 	}
 	return openQuery(q)
 }
@@ -176,6 +193,143 @@ func Query(p *DeviceQueryParams) (d []DeviceInfo, e error) {
 	return
 }
 
+// File caching the path each query with a serial number resolved to, so that
+// opening a known device does not enumerate every hid device on the system.
+// Empty disables the cache.
+var DeviceCachePath = defaultDeviceCachePath()
+
+// Serializes access to the cache file within this process.
+var deviceCacheMu sync.Mutex
+
+func defaultDeviceCachePath() string {
+	dir, err := os.UserCacheDir()
+	if err != nil {
+		return ""
+	}
+	return filepath.Join(dir, "kbp", "devices.json")
+}
+
+func (p *DeviceQueryParams) cacheKey() string {
+	return fmt.Sprintf("%04x:%04x:%04x:%04x:%q:%q:%q", p.VendorID, p.ProductID, p.UsageID, p.UsagePage, p.VendorName, p.ProductName, p.Serial)
+}
+
+// Cached paths, by query.
+func readDeviceCache() map[string]string {
+	cache := make(map[string]string)
+	if DeviceCachePath == "" {
+		return cache
+	}
+	data, err := os.ReadFile(DeviceCachePath)
+	if err == nil {
+		err = json.Unmarshal(data, &cache)
+	}
+	if err != nil && !errors.Is(err, os.ErrNotExist) {
+		glog.Infof("Ignoring device cache %s: %v", DeviceCachePath, err)
+	}
+	return cache
+}
+
+// Set or, if path is empty, drop the cached path of a query. The cache is
+// replaced atomically, so concurrent readers never see a partial file.
+func updateDeviceCache(p *DeviceQueryParams, path string) {
+	if DeviceCachePath == "" {
+		return
+	}
+	deviceCacheMu.Lock()
+	defer deviceCacheMu.Unlock()
+	cache := readDeviceCache()
+	if path == "" {
+		delete(cache, p.cacheKey())
+	} else {
+		cache[p.cacheKey()] = path
+	}
+	data, err := json.Marshal(cache)
+	if err != nil {
+		return
+	}
+	dir := filepath.Dir(DeviceCachePath)
+	if err = os.MkdirAll(dir, 0o755); err != nil {
+		glog.Infof("Cannot write device cache: %v", err)
+		return
+	}
+	f, err := os.CreateTemp(dir, "devices-*.json")
+	if err != nil {
+		glog.Infof("Cannot write device cache: %v", err)
+		return
+	}
+	_, err = f.Write(data)
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(f.Name(), DeviceCachePath)
+	}
+	if err != nil {
+		glog.Infof("Cannot write device cache: %v", err)
+		os.Remove(f.Name())
+	}
+}
+
+// Open the cached path of a query if it still holds a matching device. A path
+// that fails to open, e.g. after the device was unplugged, or that now holds
+// another device, is dropped from the cache.
+func openCached(p *DeviceQueryParams) *hid.Device {
+	deviceCacheMu.Lock()
+	path, ok := readDeviceCache()[p.cacheKey()]
+	deviceCacheMu.Unlock()
+	if !ok {
+		return nil
+	}
+	dev, err := hid.OpenPath(path)
+	if err == nil {
+		var info *hid.DeviceInfo
+		if info, err = dev.GetDeviceInfo(); err == nil && !p.match(info) {
+			err = NoDeviceFound
+		}
+		if err != nil {
+			dev.Close()
+		}
+	}
+	if err != nil {
+		glog.Infof("Cached path %s for %v is stale: %v", path, p, err)
+		updateDeviceCache(p, "")
+		return nil
+	}
+	glog.Infof("Using cached path %s for %v", path, p)
+	return dev
+}
+
+// Open the unique device matching a query. A serial number names a single
+// device, so its cached path is used while still valid. Any other query
+// enumerates devices, so that a second matching board is an error rather
+// than a board picked from the cache.
+func OpenQuery(p *DeviceQueryParams) (*hid.Device, error) {
+	if p.Serial != "" {
+		if dev := openCached(p); dev != nil {
+			return dev, nil
+		}
+	}
+	devs, err := openQuery(p)
+	if err != nil {
+		return nil, err
+	}
+	if len(devs) != 1 {
+		glog.Infof("Found %d devices for %v", len(devs), p)
+		if len(devs) == 0 {
+			return nil, NoDeviceFound
+		}
+		return nil, NoUniqueDeviceFound
+	}
+	dev, err := hid.OpenPath(devs[0].Path)
+	if err != nil {
+		return nil, err
+	}
+	if p.Serial != "" {
+		updateDeviceCache(p, devs[0].Path)
+	}
+	return dev, nil
+}
+
 func Exit() error {
 	e := hid.Exit()
 	glog.Infof("Shutting down hid, error: %v", e)
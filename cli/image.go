@@ -0,0 +1,143 @@
+package kbp
+
+import (
+	"bufio"
+	"errors"
+	"fmt"
+	"image"
+	_ "image/png"
+	"io"
+)
+
+const (
+	// Size of the oled in pixels, and of its framebuffer in bytes.
+	OledWidth       = 128
+	OledHeight      = 32
+	FramebufferSize = OledWidth * OledHeight / 8
+)
+
+// Pack a monochrome image into the display's layout: a byte per column of 8
+// pixels, lowest bit at the top, rows of bytes from the top. lit reports
+// whether a pixel is on; pixels outside the image are off, and the image is
+// cropped to the display.
+func PackFramebuffer(width, height int, lit func(x, y int) bool) []byte {
+	fb := make([]byte, FramebufferSize)
+	for y := 0; y < min(height, OledHeight); y++ {
+		for x := 0; x < min(width, OledWidth); x++ {
+			if lit(x, y) {
+				fb[y/8*OledWidth+x] |= 1 << (y % 8)
+			}
+		}
+	}
+	return fb
+}
+
+// Read the next image from r as a framebuffer. Netpbm bitmaps (P1 and P4)
+// are drawn with their black pixels lit, and any number of them may follow
+// one another, e.g. as frames piped in by another program. Other images
+// (PNG) are drawn with their dark, opaque pixels lit, and must be the only
+// image in r. Returns io.EOF if r holds no more images.
+func ReadFramebuffer(r *bufio.Reader) ([]byte, error) {
+	// images may be separated by whitespace.
+	for c, err := r.Peek(1); err == nil && (c[0] == ' ' || c[0] == '\t' || c[0] == '\r' || c[0] == '\n'); c, err = r.Peek(1) {
+		r.ReadByte()
+	}
+	magic, err := r.Peek(2)
+	if len(magic) == 0 && err != nil {
+		return nil, err
+	}
+	if len(magic) == 2 && magic[0] == 'P' && (magic[1] == '1' || magic[1] == '4') {
+		return readPBM(r)
+	}
+	img, _, err := image.Decode(r)
+	if err != nil {
+		return nil, err
+	}
+	b := img.Bounds()
+	return PackFramebuffer(b.Dx(), b.Dy(), func(x, y int) bool {
+		r, g, bl, a := img.At(b.Min.X+x, b.Min.Y+y).RGBA()
+		// alpha-premultiplied; an opaque pixel darker than mid grey.
+		return a >= 0x8000 && (r*299+g*587+bl*114)/1000 < a/2
+	}), nil
+}
+
+// Read a plain (P1) or raw (P4) bitmap.
+func readPBM(r *bufio.Reader) ([]byte, error) {
+	magic := make([]byte, 2)
+	if _, err := io.ReadFull(r, magic); err != nil {
+		return nil, err
+	}
+	var width, height int
+	if err := pbmInts(r, &width, &height); err != nil {
+		return nil, err
+	}
+	if width <= 0 || height <= 0 {
+		return nil, fmt.Errorf("bad bitmap size %dx%d", width, height)
+	}
+	bits := make([]bool, width*height)
+	if magic[1] == '4' {
+		// a single whitespace byte, then rows padded to whole bytes.
+		if _, err := r.ReadByte(); err != nil {
+			return nil, err
+		}
+		row := make([]byte, (width+7)/8)
+		for y := 0; y < height; y++ {
+			if _, err := io.ReadFull(r, row); err != nil {
+				return nil, err
+			}
+			for x := 0; x < width; x++ {
+				bits[y*width+x] = row[x/8]&(0x80>>(x%8)) != 0
+			}
+		}
+	} else {
+		for i := range bits {
+			c, err := pbmSkip(r)
+			if err != nil {
+				return nil, err
+			}
+			if c != '0' && c != '1' {
+				return nil, errors.New("bad pixel in bitmap")
+			}
+			bits[i] = c == '1'
+		}
+	}
+	return PackFramebuffer(width, height, func(x, y int) bool { return bits[y*width+x] }), nil
+}
+
+// Skip whitespace and comments, returning the next byte.
+func pbmSkip(r *bufio.Reader) (byte, error) {
+	for {
+		c, err := r.ReadByte()
+		switch {
+		case err != nil:
+			return 0, err
+		case c == '#':
+			if _, err := r.ReadString('\n'); err != nil {
+				return 0, err
+			}
+		case c != ' ' && c != '\t' && c != '\r' && c != '\n':
+			return c, nil
+		}
+	}
+}
+
+// Read decimal header fields, which may be separated by comments.
+func pbmInts(r *bufio.Reader, vals ...*int) error {
+	for _, v := range vals {
+		c, err := pbmSkip(r)
+		if err != nil {
+			return err
+		}
+		for *v = 0; c >= '0' && c <= '9'; {
+			*v = *v*10 + int(c-'0')
+			if c, err = r.ReadByte(); err != nil {
+				return err
+			}
+		}
+		// the byte after the number is whitespace, which P4 data follows.
+		if err := r.UnreadByte(); err != nil {
+			return err
+		}
+	}
+	return nil
+}
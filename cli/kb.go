@@ -1,17 +1,20 @@
 package kbp
 
 import (
+	"encoding/binary"
 	"errors"
 	"fmt"
+	"slices"
+	"strings"
 	"time"
 
 	"github.com/golang/glog"
-	hid "github.com/sstallion/go-hid"
 )
 
 var (
 	UnsupportedCommand = errors.New("Unsupported command")
 	TransferAborted    = errors.New("Transfer aborted")
+	DeviceBusy         = errors.New("Device busy")
 )
 
 const (
@@ -27,20 +30,107 @@ const (
 	CMD_CONT     = 0x04
 	CMD_ABORT    = 0x05
 	CMD_COMPLETE = 0x06
+	CMD_CAPS     = 0x07
+	// Reply to a label update frame the device did not take until it has
+	// written labels out: < BUSY cmd >, or < BUSY cmd seq > for a sequenced
+	// frame, which is to be sent again with the frames after it.
+	CMD_BUSY = 0x08
 
 	// Debug commands; hello and echo
 	CMD_HELLO = 0x30 // 0
 	CMD_ECHO  = 0x31
+	CMD_STATS = 0x32 // read on-device timings
+	// Read and remove the oldest keypress latency samples:
+	// < ACK LATENCY count dropped samples... >
+	CMD_LATENCY = 0x33
 
 	// Control commands
 	CMD_OLED_OFF = 0x40 // @
 	CMD_OLED_ON  = 0x41
+	CMD_FLUSH    = 0x42 // write pending changes to eeprom now
 
 	// OLED programming commands
 	CMD_OLED_UPDATE = 0x50 // P
 	CMD_OLED_RESET  = 0x51
+	// Update several layers in one transfer, committed on completion.
+	CMD_OLED_BULK_UPDATE = 0x52
+	// Read back layer text, streamed as CONT frames and a final ACK.
+	CMD_OLED_GET = 0x53
+	// Read the crc16 of every layer's text in one frame.
+	CMD_OLED_HASHES = 0x54
+	// Set a label field's value, held in RAM: < n v name... value... >
+	CMD_OLED_FIELD = 0x55
+	// Write run-length coded data to the framebuffer; acked on FB_END only.
+	CMD_OLED_FRAMEBUFFER = 0x56
+
+	// Macro commands, each acked: BEGIN < id layer pos len_lo len_hi >, then
+	// DATA < id offset_lo offset_hi n steps... > and END < id >.
+	CMD_MACRO_BEGIN = 0x60
+	CMD_MACRO_DATA  = 0x61
+	CMD_MACRO_END   = 0x62
+	CMD_MACRO_ERASE = 0x63 // delete all macros
+	CMD_MACRO_PLAY  = 0x64 // < id >
 )
 
+const (
+	// Set on a command to mark a sequenced frame: < m l C|SEQ S data... >.
+	FLAG_SEQ = 0x80
+
+	// Layers of the firmware's text (LAYER_COUNT in config.h), used to check
+	// arguments before a device is opened. A device reports its own count
+	// with CMD_OLED_HASHES.
+	LAYER_COUNT = 4
+
+	// Layer argument of CMD_OLED_GET reading all layers.
+	GET_ALL_LAYERS = 0xff
+	// Text bytes per CMD_OLED_GET frame: < CONT layer total data... >
+	GET_CHUNK_SIZE = 29
+
+	// Flags of CMD_OLED_FRAMEBUFFER: < FB flags offset_lo offset_hi len rle... >
+	FB_END = 0x01
+	// Set on an RLE control byte C for a run of (C&^FB_RUN)+1 copies of the
+	// next byte; otherwise C+1 literal bytes follow.
+	FB_RUN = 0x80
+	// RLE bytes per CMD_OLED_FRAMEBUFFER frame.
+	FB_CHUNK_SIZE = 25
+
+	// Longest name and value of a label field, and the bytes of both that
+	// fit one CMD_OLED_FIELD frame.
+	FIELD_NAME_SIZE  = 8
+	FIELD_VALUE_SIZE = 21
+	FIELD_DATA_SIZE  = 27
+
+	// Step bytes per CMD_MACRO_DATA frame.
+	MACRO_CHUNK_SIZE = 24
+	// Layer of a macro bound to no key.
+	MACRO_UNBOUND = 0xff
+
+	// Latency samples per CMD_LATENCY reply, of LATENCY_SAMPLE_SIZE bytes:
+	// < pos layer debounce_lo debounce_hi report_lo report_hi >
+	LATENCY_BATCH       = 4
+	LATENCY_SAMPLE_SIZE = 6
+	// Set on the layer of a sample timing a key release.
+	LATENCY_RELEASE = 0x80
+
+	// Flags of CMD_STATS.
+	STATS_CLEAR = 0x01
+
+	// Capability bits reported by CMD_CAPS.
+	CAP_WINDOWED = 0x01
+	CAP_STATE    = 0x02 // CMD_OLED_HASHES reports STATE_* bits
+
+	// Device state bits reported by CMD_OLED_HASHES.
+	STATE_OLED_ON  = 0x01
+	STATE_OLED_RAW = 0x02 // showing a framebuffer rather than labels
+)
+
+// Protocol features supported by the device, as reported by CMD_CAPS.
+type deviceCaps struct {
+	windowed bool  // sequenced frames with cumulative acks
+	window   uint8 // frames per ack in windowed mode
+	state    bool  // hashes are followed by the device state
+}
+
 func prepareMessage(buffer []byte, cmd uint8, data []byte) {
 	buffer[0] = 'm'
 	buffer[1] = 'l'
@@ -59,6 +149,16 @@ func fillLayerMsg(buffer []byte, data []byte, cmd uint8, layer uint8, length uin
 	}
 }
 
+func fillSeqLayerMsg(buffer []byte, data []byte, cmd uint8, seq uint8, layer uint8, length uint8) {
+	prepareMessage(buffer, cmd|FLAG_SEQ, nil)
+	buffer[3] = seq
+	buffer[4] = layer
+	buffer[5] = length
+	if length > 0 {
+		copy(buffer[6:], data[:length])
+	}
+}
+
 func fillStartMsg(buffer []byte, data []byte, cmd uint8, layer uint8, length uint8) {
 	fillLayerMsg(buffer, data, cmd, layer, length)
 }
@@ -71,9 +171,89 @@ func fillCompletionMsg(buffer []byte, layer uint8) {
 	fillLayerMsg(buffer, nil, CMD_COMPLETE, layer, 0)
 }
 
-func handleAckOrNack(dev *hid.Device) (response []byte, err error) {
-	recv := make([]byte, 32)
-	got, err := dev.ReadWithTimeout(recv, time.Duration(10*time.Second))
+// A connection to a device, carrying 32 byte frames. *hid.Device is the real
+// one; FakeDevice stands in for a keyboard in process.
+type Transport interface {
+	Write(frame []byte) (int, error)
+	// Read the next frame, waiting up to timeout. Returns 0 bytes if none
+	// arrived in time.
+	ReadWithTimeout(frame []byte, timeout time.Duration) (int, error)
+	Close() error
+}
+
+// How long a session waits for a reply by default.
+const DefaultReplyTimeout = 10 * time.Second
+
+// A Session holds one open device for any number of commands, so that a
+// batch of commands pays for enumerating and opening the device once. Frame
+// buffers are allocated when the session is opened and reused by every
+// command. A Session is not safe for concurrent use.
+type Session struct {
+	dev  Transport
+	caps *deviceCaps // queried on first use
+	out  []byte      // frame being sent
+	in   []byte      // last frame received
+	fb   []byte      // framebuffer last shown; nil if unknown
+	seq  []byte      // sequenced frames of the transfer in flight, 32 bytes each
+
+	// How long to wait for each reply before giving up on a command.
+	ReplyTimeout time.Duration
+}
+
+// Open a session on the given device. The caller must Close it.
+func OpenSession(device DeviceInfo) (*Session, error) {
+	dev, err := openDevice(device)
+	if err != nil {
+		return nil, err
+	}
+	return NewSession(dev), nil
+}
+
+// Open a session on the unique device matching a query; see OpenQuery.
+func OpenQuerySession(p *DeviceQueryParams) (*Session, error) {
+	dev, err := OpenQuery(p)
+	if err != nil {
+		return nil, err
+	}
+	return NewSession(dev), nil
+}
+
+// Start a session on an open transport, which the session closes.
+func NewSession(dev Transport) *Session {
+	return &Session{dev: dev, out: make([]byte, 32), in: make([]byte, 32), ReplyTimeout: DefaultReplyTimeout}
+}
+
+func (s *Session) Close() error {
+	return s.dev.Close()
+}
+
+// Run f in a session of its own, for one-off commands.
+func withSession(device DeviceInfo, f func(s *Session) error) error {
+	s, err := OpenSession(device)
+	if err != nil {
+		return err
+	}
+	defer s.Close()
+	return f(s)
+}
+
+// Read the next frame sent by the device, whatever it is. The frame is only
+// valid until the next one is received.
+func (s *Session) readFrame() ([]byte, error) {
+	got, err := s.dev.ReadWithTimeout(s.in, s.ReplyTimeout)
+	glog.Infof("Received message: %v", s.in)
+	if got <= 0 || err != nil {
+		glog.Infof("Got %d bytes; err: %v", got, err)
+		return nil, TransferAborted
+	}
+	return s.in, nil
+}
+
+// Wait for the device's reply. The response is only valid until the next
+// frame is received.
+func (s *Session) handleAckOrNack() (response []byte, err error) {
+	recv := s.in
+	got, err := s.dev.ReadWithTimeout(recv, s.ReplyTimeout)
 	glog.Infof("Received message: %v", recv)
 	switch {
 	case got <= 0:
@@ -84,6 +264,11 @@ func handleAckOrNack(dev *hid.Device) (response []byte, err error) {
 		glog.Errorf("Got error %v", err)
 		err = TransferAborted
 		return
+	case recv[0] == CMD_BUSY:
+		glog.Infof("Got BUSY")
+		response = recv
+		err = DeviceBusy
+		return
 	case recv[0] != CMD_ACK:
 		glog.Errorf("Got response code %v", recv[0])
 		err = TransferAborted
@@ -95,144 +280,702 @@ func handleAckOrNack(dev *hid.Device) (response []byte, err error) {
 	return
 }
 
-func sendSegmented(dev *hid.Device, cmd uint8, layer uint8, data []byte) error {
-	buf := make([]byte, 32)
+// Busy replies in a row after which a transfer is given up.
+const busyRetries = 8
+
+// Send the frame in s.out and wait for the reply, sending it again while the
+// device is busy.
+func (s *Session) roundTrip() (response []byte, err error) {
+	for tries := 0; ; tries++ {
+		glog.Infof("Sending %x: %v", s.out[2], s.out)
+		t, err := s.dev.Write(s.out)
+		if err != nil {
+			return nil, err
+		}
+		glog.Infof("Sent %d bytes", t)
+		response, err = s.handleAckOrNack()
+		if err != DeviceBusy || tries == busyRetries {
+			return response, err
+		}
+	}
+}
+
+// Send a command without data and wait for the ack.
+func (s *Session) command(cmd uint8) error {
+	clear(s.out)
+	prepareMessage(s.out, cmd, nil)
+	_, err := s.roundTrip()
+	return err
+}
+
+// Ask the device which protocol features it supports, once per session.
+// Firmware that predates CMD_CAPS nacks it, which leaves all features off.
+func (s *Session) queryCaps() (caps deviceCaps) {
+	if s.caps != nil {
+		return *s.caps
+	}
+	s.caps = &caps
+	defer func() { *s.caps = caps }()
+	clear(s.out)
+	prepareMessage(s.out, CMD_CAPS, nil)
+	resp, err := s.roundTrip()
+	if err != nil || resp[1] != CMD_CAPS {
+		glog.Infof("Device does not report capabilities; using stop-and-wait")
+		return
+	}
+	caps.windowed = resp[2]&CAP_WINDOWED != 0 && resp[3] > 0
+	caps.window = resp[3]
+	caps.state = resp[2]&CAP_STATE != 0
+	glog.Infof("Device capabilities: %+v", caps)
+	return
+}
+
+// A layer's text, as carried by a segmented transfer.
+type layerText struct {
+	layer uint8
+	data  []byte
+}
 
+func (s *Session) sendSegmented(cmd uint8, texts []layerText) error {
 	switch cmd {
 	case CMD_OLED_UPDATE:
 		glog.Infof("Sending OLED update")
+	case CMD_OLED_BULK_UPDATE:
+		glog.Infof("Sending OLED bulk update of %d layers", len(texts))
 	default:
 		return UnsupportedCommand
 	}
 
-	var tot uint8 = uint8(len(data))
-	var l uint8 = 0
-	var err error
-	isStart := true
+	if caps := s.queryCaps(); caps.windowed {
+		return s.sendWindowed(cmd, texts, caps.window)
+	}
+	return s.sendStopAndWait(cmd, texts)
+}
 
-	for tot > 0 {
-		glog.Infof("Writing %s", data)
+// Send a transfer one frame at a time, waiting for an ack after each frame.
+// Every layer's text takes at least one frame, even if it is empty.
+func (s *Session) sendStopAndWait(cmd uint8, texts []layerText) error {
+	buf := s.out
+	isStart := true
 
-		l = tot
-		if tot > 25 {
-			// 2 byte header, 1 byte command, 1 byte layer, 1 byte length
-			l = 25
-			glog.Infof("Chunking %d of %d\n", l, tot)
-		} else {
-			glog.Infof("No chunking necessary, total bytes %d\n", tot)
-		}
+	for _, t := range texts {
+		data := t.data
+		for first := true; first || len(data) > 0; first = false {
+			glog.Infof("Writing %s", data)
 
-		if isStart {
-			fillStartMsg(buf, data[:l], CMD_OLED_UPDATE, layer, l)
-		} else {
-			fillContinueMsg(buf, data[:l], layer, l)
-		}
-		data = data[l:]
-		tot -= l
+			l := len(data)
+			if l > 25 {
+				// 2 byte header, 1 byte command, 1 byte layer, 1 byte length
+				l = 25
+				glog.Infof("Chunking %d of %d\n", l, len(data))
+			} else {
+				glog.Infof("No chunking necessary, total bytes %d\n", l)
+			}
 
-		glog.Infof("Sending %v", buf)
-		_, err = dev.Write(buf)
-		isStart = false
-		if err != nil {
-			return err
-		}
+			if isStart {
+				fillStartMsg(buf, data[:l], cmd, t.layer, uint8(l))
+			} else {
+				fillContinueMsg(buf, data[:l], t.layer, uint8(l))
+			}
+			data = data[l:]
+			isStart = false
 
-		_, err = handleAckOrNack(dev)
-		if err != nil {
-			return err
+			if _, err := s.roundTrip(); err != nil {
+				return err
+			}
+			glog.Infof("Wrote %d; %d bytes remaining", l, len(data))
 		}
-		glog.Infof("Wrote %d; %d bytes remaining", l, tot)
 	}
 	// Prepare and send completion message.
-	fillCompletionMsg(buf, layer)
+	fillCompletionMsg(buf, texts[len(texts)-1].layer)
 	glog.Infof("Sending completion message %v", buf)
-	dev.Write(buf)
-	_, err = handleAckOrNack(dev)
+	_, err := s.roundTrip()
+	return err
+}
+
+// Wait for the cumulative ack of the frame with the given sequence number.
+// If the device was busy, returns DeviceBusy and how many frames before seq
+// it refused, from which the frames are to be sent again.
+func (s *Session) handleSeqAck(seq uint8, window uint8) (back uint8, err error) {
+	resp, err := s.handleAckOrNack()
+	if err == DeviceBusy {
+		if back = seq - resp[2]; back >= window {
+			glog.Errorf("Got busy for frame %d, expected %d or before", resp[2], seq)
+			return 0, TransferAborted
+		}
+		return
+	}
 	if err != nil {
-		return err
+		return
 	}
-
-	return nil
+	if resp[2] != seq {
+		glog.Errorf("Got ack for frame %d, expected %d", resp[2], seq)
+		return 0, TransferAborted
+	}
+	return
 }
 
-func sendCommand(device DeviceInfo, buffer []byte) error {
-	glog.Infof("Sending %x: %v", buffer[2], buffer)
-	_, err := SendRaw(device, buffer)
-	if err != nil {
-		return err
+// Send a transfer as sequenced frames, keeping up to window frames in flight.
+// The device acks once per window and on completion, or nacks once if a frame
+// is lost or rejected. Frames are kept until acked, to be sent again from the
+// one the device was too busy to take.
+func (s *Session) sendWindowed(cmd uint8, texts []layerText, window uint8) error {
+	last := texts[len(texts)-1].layer
+
+	s.seq = s.seq[:0]
+	var seq uint8 = 0
+	for i := 0; i <= len(texts); i++ {
+		done := i == len(texts)
+		var t layerText
+		if !done {
+			t = texts[i]
+		}
+		data := t.data
+		for first := true; first || len(data) > 0; first, seq = false, seq+1 {
+			// 2 byte header, 1 byte command, 1 byte sequence, 1 byte layer, 1 byte length
+			l := len(data)
+			if l > 26 {
+				l = 26
+			}
+			s.seq = append(s.seq, make([]byte, 32)...)
+			buf := s.seq[len(s.seq)-32:]
+			switch {
+			case done:
+				fillSeqLayerMsg(buf, nil, CMD_COMPLETE, seq, last, 0)
+			case seq == 0:
+				fillSeqLayerMsg(buf, data, cmd, seq, t.layer, uint8(l))
+			default:
+				fillSeqLayerMsg(buf, data, CMD_CONT, seq, t.layer, uint8(l))
+			}
+			data = data[l:]
+		}
+	}
+
+	tries := 0
+	for n, i := len(s.seq)/32, 0; i < n; i++ {
+		buf := s.seq[i*32 : (i+1)*32]
+		seq := uint8(i)
+		glog.Infof("Sending frame %d: %v", seq, buf)
+		if _, err := s.dev.Write(buf); err != nil {
+			return err
+		}
+		if i+1 == n || (seq+1)%window == 0 {
+			back, err := s.handleSeqAck(seq, window)
+			if err == DeviceBusy && tries < busyRetries {
+				glog.Infof("Device busy; sending again from frame %d", seq-back)
+				tries++
+				i -= int(back) + 1
+				continue
+			}
+			if err != nil {
+				return err
+			}
+			tries = 0
+			glog.Infof("Frames through %d acked", seq)
+		}
 	}
 	return nil
 }
 
-func SendLayerReset(device DeviceInfo) error {
-	buffer := make([]byte, 32)
-	prepareMessage(buffer, CMD_OLED_RESET, nil)
-	return sendCommand(device, buffer)
+func (s *Session) LayerReset() error {
+	return s.command(CMD_OLED_RESET)
 }
 
-func SendOledState(device DeviceInfo, on bool) error {
-	buffer := make([]byte, 32)
+func (s *Session) OledState(on bool) error {
 	var cmd uint8 = CMD_OLED_OFF
 	if on {
 		cmd = CMD_OLED_ON
 	}
-	prepareMessage(buffer, cmd, nil)
-	return sendCommand(device, buffer)
+	// the device goes back to drawing labels.
+	s.fb = nil
+	return s.command(cmd)
 }
 
-func SendHello(device DeviceInfo) error {
-	buffer := make([]byte, 32)
-	prepareMessage(buffer, CMD_HELLO, nil)
-	glog.Infof("Sending hello message %v", buffer)
-	if resp, err := SendRaw(device, buffer); err != nil {
-		return err
-	} else {
-		// resp should be: < ACK HELLO message >
-		txt := string(resp[2:])
-		fmt.Printf("Got response: %s\n", txt)
+// Ask the device to write pending label changes to eeprom now rather than
+// after its quiet period.
+func (s *Session) Flush() error {
+	return s.command(CMD_FLUSH)
+}
+
+// Set the value of field name, shown in place of {name} in labels, in one
+// frame. The value is not persisted, and an empty value clears the field.
+func (s *Session) SetField(name, value string) error {
+	if name == "" || len(name) > FIELD_NAME_SIZE || strings.ContainsAny(name, "{} \n\r") {
+		return fmt.Errorf("bad field name %q", name)
 	}
-	return nil
+	if len(value) > FIELD_VALUE_SIZE || strings.ContainsAny(value, "\n\r") {
+		return fmt.Errorf("field value %q is longer than %d characters or spans lines", value, FIELD_VALUE_SIZE)
+	}
+	clear(s.out)
+	prepareMessage(s.out, CMD_OLED_FIELD, append([]byte{byte(len(name)), byte(len(value))}, name+value...))
+	_, err := s.roundTrip()
+	return err
 }
 
-func SendEcho(device DeviceInfo, txt string) error {
-	buffer := make([]byte, 32)
+// Returns the device's greeting.
+func (s *Session) Hello() (string, error) {
+	clear(s.out)
+	prepareMessage(s.out, CMD_HELLO, nil)
+	resp, err := s.roundTrip()
+	if err != nil {
+		return "", err
+	}
+	// resp should be: < ACK HELLO message >
+	return string(resp[2:]), nil
+}
+
+// Returns the text echoed by the device.
+func (s *Session) Echo(txt string) (string, error) {
 	// send buffer will be < m l ECHO txt >, so txt has to be < 29 bytes.
 	bytes := []byte(txt)
 	if len(bytes) > 29 {
 		bytes = bytes[:29]
 	}
-	prepareMessage(buffer, CMD_ECHO, []byte(txt))
-	glog.Infof("Sending echo message %v", buffer)
-	if resp, err := SendRaw(device, buffer); err != nil {
-		return err
-	} else {
-		// resp should be: < ACK message >
-		echo := string(resp[1:])
-		fmt.Printf("Got response: %s\n", echo)
+	clear(s.out)
+	prepareMessage(s.out, CMD_ECHO, bytes)
+	resp, err := s.roundTrip()
+	if err != nil {
+		return "", err
 	}
-	return nil
+	// resp should be: < ACK message >
+	return string(resp[1:]), nil
 }
 
-func SendLayerUpdate(device DeviceInfo, layer uint8, txt string) error {
-	dev, err := openDevice(device)
-	if err != nil {
-		return err
+func (s *Session) LayerUpdate(layer uint8, txt string) error {
+	return s.sendSegmented(CMD_OLED_UPDATE, []layerText{{layer, []byte(txt)}})
+}
+
+// Update the text of layers 0 through len(txts)-1 in a single transfer. The
+// device commits all of them at once.
+func (s *Session) BulkLayerUpdate(txts []string) error {
+	if len(txts) == 0 {
+		return nil
 	}
-	defer dev.Close()
-	return sendSegmented(dev, CMD_OLED_UPDATE, layer, []byte(txt))
+	texts := make([]layerText, 0, len(txts))
+	for i, txt := range txts {
+		texts = append(texts, layerText{uint8(i), []byte(txt)})
+	}
+	return s.sendSegmented(CMD_OLED_BULK_UPDATE, texts)
 }
 
-func SendRaw(device DeviceInfo, data []byte) (response []byte, err error) {
-	dev, err := openDevice(device)
-	defer dev.Close()
+// Send a raw frame and return a copy of the reply.
+func (s *Session) Raw(data []byte) (response []byte, err error) {
+	t, err := s.dev.Write(data)
 	if err != nil {
 		return
 	}
-	t, err := dev.Write(data)
+	glog.Infof("Sent %d bytes", t)
+	resp, err := s.handleAckOrNack()
 	if err != nil {
 		return
 	}
-	glog.Infof("Sent %d bytes", t)
-	response, err = handleAckOrNack(dev)
+	response = append([]byte(nil), resp...)
+	return
+}
+
+// Read back the text of one layer, or of all layers if layer is
+// GET_ALL_LAYERS. Returns the text by layer; layers that were not read are
+// left out.
+func (s *Session) getLayers(layer uint8) (map[uint8]string, error) {
+	clear(s.out)
+	prepareMessage(s.out, CMD_OLED_GET, []byte{layer})
+	glog.Infof("Sending %x: %v", s.out[2], s.out)
+	if _, err := s.dev.Write(s.out); err != nil {
+		return nil, err
+	}
+	texts := make(map[uint8][]byte)
+	for {
+		resp, err := s.readFrame()
+		if err != nil {
+			return nil, err
+		}
+		switch {
+		case resp[0] == CMD_CONT:
+			// < CONT layer total data... >
+			l, total := resp[1], int(resp[2])
+			t := texts[l]
+			n := min(total-len(t), GET_CHUNK_SIZE)
+			if n < 0 {
+				return nil, TransferAborted
+			}
+			texts[l] = append(t, resp[3:3+n]...)
+		case resp[0] == CMD_ACK && resp[1] == CMD_OLED_GET:
+			result := make(map[uint8]string, len(texts))
+			for l, t := range texts {
+				result[l] = string(t)
+			}
+			return result, nil
+		default:
+			glog.Errorf("Got response code %v", resp[0])
+			return nil, TransferAborted
+		}
+	}
+}
+
+// Read back the text of a layer.
+func (s *Session) GetLayer(layer uint8) (string, error) {
+	texts, err := s.getLayers(layer)
+	if err != nil {
+		return "", err
+	}
+	return texts[layer], nil
+}
+
+// Read back the text of all layers, in layer order.
+func (s *Session) GetLayers() ([]string, error) {
+	texts, err := s.getLayers(GET_ALL_LAYERS)
+	if err != nil {
+		return nil, err
+	}
+	result := make([]string, len(texts))
+	for l, t := range texts {
+		if int(l) >= len(result) {
+			return nil, TransferAborted
+		}
+		result[l] = t
+	}
+	return result, nil
+}
+
+// CRC-16/CCITT of a layer's text, as the device computes it.
+func labelHash(txt string) uint16 {
+	var crc uint16 = 0xffff
+	for i := 0; i < len(txt); i++ {
+		crc ^= uint16(txt[i]) << 8
+		for b := 0; b < 8; b++ {
+			if crc&0x8000 != 0 {
+				crc = crc<<1 ^ 0x1021
+			} else {
+				crc <<= 1
+			}
+		}
+	}
+	return crc
+}
+
+// What the device holds and shows, as reported by CMD_OLED_HASHES.
+type DeviceState struct {
+	Hashes []uint16 // hash of every layer's text, by layer
+	// Whether the oled state is known; firmware without CAP_STATE only
+	// reports hashes.
+	HasOled bool
+	OledOn  bool
+	OledRaw bool // showing a framebuffer rather than labels
+}
+
+// Read the device state in one round trip, after asking for the device's
+// capabilities if this session has not yet.
+func (s *Session) State() (DeviceState, error) {
+	return s.readState(s.queryCaps())
+}
+
+// Read the device state; the oled state is parsed if caps has it.
+func (s *Session) readState(caps deviceCaps) (st DeviceState, err error) {
+	clear(s.out)
+	prepareMessage(s.out, CMD_OLED_HASHES, nil)
+	resp, err := s.roundTrip()
+	if err != nil {
+		return
+	}
+	// resp is < ACK HASHES count hashes... state >, little endian.
+	n := int(resp[2])
+	if resp[1] != CMD_OLED_HASHES || 4+2*n > len(resp) {
+		return st, TransferAborted
+	}
+	st.Hashes = make([]uint16, n)
+	for i := range st.Hashes {
+		st.Hashes[i] = binary.LittleEndian.Uint16(resp[3+2*i:])
+	}
+	if caps.state {
+		st.HasOled = true
+		st.OledOn = resp[3+2*n]&STATE_OLED_ON != 0
+		st.OledRaw = resp[3+2*n]&STATE_OLED_RAW != 0
+	}
+	return
+}
+
+// Read the hash of every layer's text, by layer.
+func (s *Session) LayerHashes() ([]uint16, error) {
+	st, err := s.readState(deviceCaps{})
+	return st.Hashes, err
+}
+
+// Set the text of the given layers, uploading only those whose text differs
+// from what the device holds; a sync that changes nothing takes one round
+// trip. Several changed layers are sent in one bulk transfer. Returns the
+// layers that were uploaded. Firmware that does not report hashes gets all of
+// them.
+func (s *Session) SyncLayers(txts map[uint8]string) (updated []uint8, err error) {
+	hashes, err := s.LayerHashes()
+	if err != nil {
+		glog.Infof("Device does not report hashes (%v); uploading all layers", err)
+		hashes = nil
+	}
+	return s.syncLayers(txts, hashes)
+}
+
+// Upload the layers of txts whose hash differs from hashes.
+func (s *Session) syncLayers(txts map[uint8]string, hashes []uint16) (updated []uint8, err error) {
+	layers := make([]uint8, 0, len(txts))
+	for l := range txts {
+		layers = append(layers, l)
+	}
+	slices.Sort(layers)
+	if len(layers) > 0 && hashes != nil && int(layers[len(layers)-1]) >= len(hashes) {
+		return nil, fmt.Errorf("device only has %d layers; got layer %d", len(hashes), layers[len(layers)-1])
+	}
+	var texts []layerText
+	for _, l := range layers {
+		if int(l) < len(hashes) && hashes[l] == labelHash(txts[l]) {
+			glog.Infof("Layer %d is up to date", l)
+			continue
+		}
+		texts = append(texts, layerText{l, []byte(txts[l])})
+		updated = append(updated, l)
+	}
+	switch len(texts) {
+	case 0:
+	case 1:
+		err = s.sendSegmented(CMD_OLED_UPDATE, texts)
+	default:
+		err = s.sendSegmented(CMD_OLED_BULK_UPDATE, texts)
+	}
+	return
+}
+
+// Names of the device's stats, by id.
+var StatNames = []string{"hid_receive", "persist", "oled_render", "scan_interval", "layer_switch", "boot", "label_load"}
+
+// Number of histogram buckets of a Stat; bucket b counts durations below
+// 16<<2b microseconds, and the last one counts the rest.
+const StatBuckets = 8
+
+// Timings of one of the device's hot paths, in microseconds.
+type Stat struct {
+	Name    string
+	Count   uint32
+	Sum     uint32
+	Min     uint16
+	Max     uint16
+	Buckets [StatBuckets]uint16
+}
+
+func (s Stat) Mean() float64 {
+	if s.Count == 0 {
+		return 0
+	}
+	return float64(s.Sum) / float64(s.Count)
+}
+
+// Read all of the device's stats, one frame each, clearing each one after it
+// is read if reset is set.
+func (s *Session) Stats(reset bool) (stats []Stat, err error) {
+	var flags uint8
+	if reset {
+		flags = STATS_CLEAR
+	}
+	for id, count := 0, 1; id < count; id++ {
+		clear(s.out)
+		prepareMessage(s.out, CMD_STATS, []byte{uint8(id), flags})
+		resp, err := s.roundTrip()
+		if err != nil {
+			return nil, err
+		}
+		// resp is < ACK STATS id count stat... >, little endian.
+		if resp[1] != CMD_STATS || resp[2] != uint8(id) {
+			return nil, TransferAborted
+		}
+		count = int(resp[3])
+		st := Stat{Name: fmt.Sprintf("stat%d", id)}
+		if id < len(StatNames) {
+			st.Name = StatNames[id]
+		}
+		st.Count = binary.LittleEndian.Uint32(resp[4:])
+		st.Sum = binary.LittleEndian.Uint32(resp[8:])
+		st.Min = binary.LittleEndian.Uint16(resp[12:])
+		st.Max = binary.LittleEndian.Uint16(resp[14:])
+		for b := range st.Buckets {
+			st.Buckets[b] = binary.LittleEndian.Uint16(resp[16+2*b:])
+		}
+		stats = append(stats, st)
+	}
+	return
+}
+
+// A key event timed by the device.
+type LatencySample struct {
+	Row, Col uint8
+	Layer    uint8 // highest active layer
+	Pressed  bool
+	// From the first matrix scan seeing the switch change to the scan
+	// reporting it, and from that scan to the key's report being queued.
+	Debounce, Report time.Duration
+}
+
+// Read the key events the device timed since the last call, a batch per
+// frame. dropped counts the events it could not keep because they were not
+// read in time. Firmware that does not time keys nacks the request.
+func (s *Session) Latency() (samples []LatencySample, dropped int, err error) {
+	for {
+		clear(s.out)
+		prepareMessage(s.out, CMD_LATENCY, nil)
+		resp, err := s.roundTrip()
+		if err != nil {
+			return nil, 0, err
+		}
+		// resp is < ACK LATENCY count dropped samples... >, little endian.
+		n := int(resp[2])
+		if resp[1] != CMD_LATENCY || n > LATENCY_BATCH {
+			return nil, 0, TransferAborted
+		}
+		dropped += int(resp[3])
+		for i := 0; i < n; i++ {
+			b := resp[4+i*LATENCY_SAMPLE_SIZE:]
+			samples = append(samples, LatencySample{
+				Row:      b[0] >> 4,
+				Col:      b[0] & 0xf,
+				Layer:    b[1] &^ LATENCY_RELEASE,
+				Pressed:  b[1]&LATENCY_RELEASE == 0,
+				Debounce: time.Duration(binary.LittleEndian.Uint16(b[2:])) * time.Microsecond,
+				Report:   time.Duration(binary.LittleEndian.Uint16(b[4:])) * time.Microsecond,
+			})
+		}
+		if n < LATENCY_BATCH {
+			return samples, dropped, nil
+		}
+	}
+}
+
+// Run-length code as much of src as fits in dst. Returns the bytes written
+// and the bytes of src consumed. Runs of 3 or more bytes are coded as runs.
+func rleEncode(src, dst []byte) (n, used int) {
+	for used < len(src) && n+2 <= len(dst) {
+		run := 1
+		for used+run < len(src) && run < 128 && src[used+run] == src[used] {
+			run++
+		}
+		if run >= 3 {
+			dst[n], dst[n+1] = FB_RUN|byte(run-1), src[used]
+			n, used = n+2, used+run
+			continue
+		}
+		// literals up to the next run of 3 or the end of dst.
+		start, lit := n, 0
+		for n++; used < len(src) && lit < 128 && n < len(dst); lit++ {
+			if used+2 < len(src) && src[used] == src[used+1] && src[used] == src[used+2] {
+				break
+			}
+			dst[n] = src[used]
+			n, used = n+1, used+1
+		}
+		dst[start] = byte(lit - 1)
+	}
+	return
+}
+
+// Ranges of fb that differ from prev, or all of fb if prev is nil. Ranges
+// closer than a frame's worth of data are merged, as resending the bytes
+// between them costs less than another frame.
+func changedSpans(prev, fb []byte) (spans [][2]int) {
+	if prev == nil {
+		return [][2]int{{0, len(fb)}}
+	}
+	for i := 0; i < len(fb); i++ {
+		if fb[i] == prev[i] {
+			continue
+		}
+		if n := len(spans); n > 0 && i-spans[n-1][1] < FB_CHUNK_SIZE {
+			spans[n-1][1] = i + 1
+		} else {
+			spans = append(spans, [2]int{i, i + 1})
+		}
+	}
+	return
+}
+
+// Show fb, a FramebufferSize byte image in the display's layout (see
+// PackFramebuffer), instead of the layer labels until the oled is turned on
+// again. Only the parts that changed since the last image shown by this
+// session are sent, without waiting for acks until the last frame, so an
+// image costs a single round trip.
+func (s *Session) ShowFramebuffer(fb []byte) error {
+	if len(fb) != FramebufferSize {
+		return fmt.Errorf("framebuffer is %d bytes, want %d", len(fb), FramebufferSize)
+	}
+	var frames [][]byte
+	for _, span := range changedSpans(s.fb, fb) {
+		for off := span[0]; off < span[1]; {
+			frame := make([]byte, len(s.out))
+			n, used := rleEncode(fb[off:span[1]], frame[7:7+FB_CHUNK_SIZE])
+			prepareMessage(frame, CMD_OLED_FRAMEBUFFER, []byte{0, byte(off), byte(off >> 8), byte(n)})
+			frames = append(frames, frame)
+			off += used
+		}
+	}
+	if len(frames) == 0 {
+		// nothing changed; still wait for the device to have shown it.
+		frames = append(frames, make([]byte, len(s.out)))
+		prepareMessage(frames[0], CMD_OLED_FRAMEBUFFER, nil)
+	}
+	frames[len(frames)-1][3] |= FB_END
+	s.fb = nil
+	for _, frame := range frames {
+		glog.Infof("Sending framebuffer frame: %v", frame)
+		if _, err := s.dev.Write(frame); err != nil {
+			return err
+		}
+	}
+	if _, err := s.handleAckOrNack(); err != nil {
+		return err
+	}
+	s.fb = slices.Clone(fb)
+	return nil
+}
+
+func SendLayerReset(device DeviceInfo) error {
+	return withSession(device, (*Session).LayerReset)
+}
+
+func SendOledState(device DeviceInfo, on bool) error {
+	return withSession(device, func(s *Session) error { return s.OledState(on) })
+}
+
+func SendFlush(device DeviceInfo) error {
+	return withSession(device, (*Session).Flush)
+}
+
+func SendHello(device DeviceInfo) error {
+	return withSession(device, func(s *Session) error {
+		txt, err := s.Hello()
+		if err == nil {
+			fmt.Printf("Got response: %s\n", txt)
+		}
+		return err
+	})
+}
+
+func SendEcho(device DeviceInfo, txt string) error {
+	return withSession(device, func(s *Session) error {
+		echo, err := s.Echo(txt)
+		if err == nil {
+			fmt.Printf("Got response: %s\n", echo)
+		}
+		return err
+	})
+}
+
+func SendLayerUpdate(device DeviceInfo, layer uint8, txt string) error {
+	return withSession(device, func(s *Session) error { return s.LayerUpdate(layer, txt) })
+}
+
+func SendBulkLayerUpdate(device DeviceInfo, txts []string) error {
+	return withSession(device, func(s *Session) error { return s.BulkLayerUpdate(txts) })
+}
+
+func SendRaw(device DeviceInfo, data []byte) (response []byte, err error) {
+	err = withSession(device, func(s *Session) (err error) {
+		response, err = s.Raw(data)
+		return
+	})
 	return
 }
@@ -0,0 +1,195 @@
+package kbp
+
+import (
+	"fmt"
+	"strings"
+)
+
+// Modifier bits of a macro step, as in a keyboard report.
+const (
+	MOD_CTRL  = 0x01
+	MOD_SHIFT = 0x02
+	MOD_ALT   = 0x04
+	MOD_GUI   = 0x08
+)
+
+var modNames = map[string]uint8{
+	"ctrl":    MOD_CTRL,
+	"control": MOD_CTRL,
+	"shift":   MOD_SHIFT,
+	"alt":     MOD_ALT,
+	"opt":     MOD_ALT,
+	"option":  MOD_ALT,
+	"gui":     MOD_GUI,
+	"cmd":     MOD_GUI,
+	"win":     MOD_GUI,
+	"super":   MOD_GUI,
+}
+
+// Keys that can be named in a {chord}, by hid usage.
+var keyNames = map[string]uint8{
+	"enter": 0x28, "esc": 0x29, "backspace": 0x2a, "tab": 0x2b, "space": 0x2c,
+	"delete": 0x4c, "home": 0x4a, "end": 0x4d, "pgup": 0x4b, "pgdn": 0x4e,
+	"right": 0x4f, "left": 0x50, "down": 0x51, "up": 0x52,
+}
+
+// Usage of each character on a US layout; shifted characters map to the key
+// typing them with shift held.
+var usKeys = map[rune]uint8{
+	'\n': 0x28, '\t': 0x2b, ' ': 0x2c, '-': 0x2d, '=': 0x2e, '[': 0x2f, ']': 0x30,
+	'\\': 0x31, ';': 0x33, '\'': 0x34, '`': 0x35, ',': 0x36, '.': 0x37, '/': 0x38,
+}
+var usShifted = map[rune]rune{
+	'!': '1', '@': '2', '#': '3', '$': '4', '%': '5', '^': '6', '&': '7', '*': '8',
+	'(': '9', ')': '0', '_': '-', '+': '=', '{': '[', '}': ']', '|': '\\', ':': ';',
+	'"': '\'', '~': '`', '<': ',', '>': '.', '?': '/',
+}
+
+func init() {
+	for c := 'a'; c <= 'z'; c++ {
+		usKeys[c] = uint8(0x04 + c - 'a')
+	}
+	for c := '1'; c <= '9'; c++ {
+		usKeys[c] = uint8(0x1e + c - '1')
+	}
+	usKeys['0'] = 0x27
+	for i := 1; i <= 12; i++ {
+		keyNames[fmt.Sprintf("f%d", i)] = uint8(0x3a + i - 1)
+	}
+}
+
+// Key to press for a character, and whether shift must be held.
+func usKey(c rune) (key uint8, shift bool, ok bool) {
+	switch {
+	case c >= 'A' && c <= 'Z':
+		key, ok = usKeys[c-'A'+'a']
+		return key, true, ok
+	case usShifted[c] != 0:
+		key, ok = usKeys[usShifted[c]]
+		return key, true, ok
+	}
+	key, ok = usKeys[c]
+	return key, false, ok
+}
+
+// Parse a {chord} such as {ctrl+shift+t}, {enter} or {cmd} into a step.
+// {pause} waits for one report.
+func parseChord(chord string) ([]byte, error) {
+	if chord == "pause" {
+		return []byte{0, 0}, nil
+	}
+	var mods, key uint8
+	for _, part := range strings.Split(strings.ToLower(chord), "+") {
+		if m, ok := modNames[part]; ok {
+			mods |= m
+			continue
+		}
+		if key != 0 {
+			return nil, fmt.Errorf("{%s} has more than one key", chord)
+		}
+		k, shift, ok := keyNames[part], false, keyNames[part] != 0
+		if !ok && len([]rune(part)) == 1 {
+			k, shift, ok = usKey([]rune(part)[0])
+		}
+		if !ok {
+			return nil, fmt.Errorf("unknown key %q in {%s}", part, chord)
+		}
+		if shift {
+			mods |= MOD_SHIFT
+		}
+		key = k
+	}
+	return []byte{mods, key}, nil
+}
+
+// Translate text into macro steps for a US layout: each character is typed as
+// is, and {...} is a chord of modifiers and at most one key, e.g.
+// "{cmd+space}terminal{enter}". {{ types a {.
+func ParseMacro(text string) (steps []byte, err error) {
+	for len(text) > 0 {
+		if strings.HasPrefix(text, "{{") {
+			steps = append(steps, MOD_SHIFT, usKeys['['])
+			text = text[2:]
+			continue
+		}
+		if text[0] == '{' {
+			chord, rest, ok := strings.Cut(text[1:], "}")
+			if !ok {
+				return nil, fmt.Errorf("unterminated {%s", chord)
+			}
+			step, err := parseChord(chord)
+			if err != nil {
+				return nil, err
+			}
+			steps = append(steps, step...)
+			text = rest
+			continue
+		}
+		c := []rune(text)[0]
+		key, shift, ok := usKey(c)
+		if !ok {
+			return nil, fmt.Errorf("cannot type %q", c)
+		}
+		var mods uint8
+		if shift {
+			mods = MOD_SHIFT
+		}
+		steps = append(steps, mods, key)
+		text = text[len(string(c)):]
+	}
+	return steps, nil
+}
+
+// Key a macro is played by, on the highest active layer.
+type MacroKey struct {
+	Layer, Row, Col uint8
+}
+
+// Store steps (see ParseMacro) as macro id, played by key if it is not nil.
+// No steps deletes the macro.
+func (s *Session) UploadMacro(id uint8, key *MacroKey, steps []byte) error {
+	layer, pos := uint8(MACRO_UNBOUND), uint8(0)
+	if key != nil {
+		if key.Row > 0xf || key.Col > 0xf {
+			return fmt.Errorf("no key at row %d, column %d", key.Row, key.Col)
+		}
+		layer, pos = key.Layer, key.Row<<4|key.Col
+	}
+	if len(steps)%2 != 0 || len(steps) > 0xffff {
+		return fmt.Errorf("bad macro of %d bytes", len(steps))
+	}
+	clear(s.out)
+	prepareMessage(s.out, CMD_MACRO_BEGIN, []byte{id, layer, pos, byte(len(steps)), byte(len(steps) >> 8)})
+	if _, err := s.roundTrip(); err != nil {
+		if err == TransferAborted {
+			// the device has already reclaimed the space of replaced macros.
+			return fmt.Errorf("macro %d of %d bytes refused; either the id is out of range or the other macros leave no room: %w", id, len(steps), err)
+		}
+		return err
+	}
+	for off := 0; off < len(steps); off += MACRO_CHUNK_SIZE {
+		chunk := steps[off:min(off+MACRO_CHUNK_SIZE, len(steps))]
+		clear(s.out)
+		prepareMessage(s.out, CMD_MACRO_DATA, append([]byte{id, byte(off), byte(off >> 8), byte(len(chunk))}, chunk...))
+		if _, err := s.roundTrip(); err != nil {
+			return err
+		}
+	}
+	clear(s.out)
+	prepareMessage(s.out, CMD_MACRO_END, []byte{id})
+	_, err := s.roundTrip()
+	return err
+}
+
+// Delete all macros.
+func (s *Session) EraseMacros() error {
+	return s.command(CMD_MACRO_ERASE)
+}
+
+// Type macro id now.
+func (s *Session) PlayMacro(id uint8) error {
+	clear(s.out)
+	prepareMessage(s.out, CMD_MACRO_PLAY, []byte{id})
+	_, err := s.roundTrip()
+	return err
+}
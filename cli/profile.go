@@ -0,0 +1,74 @@
+package kbp
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+)
+
+// The desired configuration of a device, as read from a JSON file:
+//
+//	{
+//	  "layers": ["Media\nPrev | Play | Next", null, "Zoom\nTalk | Mic"],
+//	  "oled": "on"
+//	}
+//
+// Layers are by number; a missing or null layer is left as it is, as is the
+// oled if "oled" is missing.
+type Profile struct {
+	Layers []*string `json:"layers,omitempty"`
+	Oled   string    `json:"oled,omitempty"` // "on", "off" or empty
+}
+
+// Parse a profile, rejecting unknown fields so that typos are not ignored.
+func ParseProfile(data []byte) (*Profile, error) {
+	var p Profile
+	dec := json.NewDecoder(bytes.NewReader(data))
+	dec.DisallowUnknownFields()
+	if err := dec.Decode(&p); err != nil {
+		return nil, fmt.Errorf("bad profile: %w", err)
+	}
+	if len(p.Layers) > LAYER_COUNT {
+		return nil, fmt.Errorf("bad profile: device only supports %d layers; got %d", LAYER_COUNT, len(p.Layers))
+	}
+	if p.Oled != "" && p.Oled != "on" && p.Oled != "off" {
+		return nil, fmt.Errorf("bad profile: oled must be \"on\" or \"off\", got %q", p.Oled)
+	}
+	return &p, nil
+}
+
+// What applying a profile changed.
+type ProfileChanges struct {
+	Layers []uint8 // layers uploaded
+	Oled   bool    // whether the oled state was set
+}
+
+// Apply a profile, changing only what differs from the device. The device
+// state is read in one round trip, and all changed layers are uploaded in one
+// transfer committed at once, so applying a profile the device already
+// matches writes nothing. Firmware that does not report its oled state has
+// it set regardless.
+func (s *Session) ApplyProfile(p *Profile) (changes ProfileChanges, err error) {
+	st, err := s.State()
+	if err != nil {
+		return
+	}
+	if p.Oled != "" {
+		on := p.Oled == "on"
+		// a framebuffer is only replaced by the labels when turning on.
+		if !st.HasOled || st.OledOn != on || (on && st.OledRaw) {
+			if err = s.OledState(on); err != nil {
+				return
+			}
+			changes.Oled = true
+		}
+	}
+	txts := make(map[uint8]string, len(p.Layers))
+	for l, txt := range p.Layers {
+		if txt != nil {
+			txts[uint8(l)] = *txt
+		}
+	}
+	changes.Layers, err = s.syncLayers(txts, st.Hashes)
+	return
+}
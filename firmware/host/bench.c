@@ -0,0 +1,881 @@
+// Benchmarks for the firmware's hid, oled and persistence paths, run on the
+// host against the stand-ins in qmk/. Drives user_hid_receive with the same
+// frames kbp sends and reports throughput plus the modelled device cost of
+// each operation.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_stubs.h"
+
+#include "action.h"
+#include "action_layer.h"
+#include "config.h"
+#include "crc16.h"
+#include "eeprom_driver.h"
+#include "encoder_handlers.h"
+#include "hid_codes.h"
+#include "hid_handlers.h"
+#include "keycode_config.h"
+#include "latency.h"
+#include "macro_handlers.h"
+#include "oled_handlers.h"
+#include "persistence.h"
+#include "stats.h"
+
+// Payload bytes per update frame, as chunked by kbp.
+#define CHUNK_SIZE 25
+#define SEQ_CHUNK_SIZE 26
+// Busy replies in a row after which kbp gives up on a transfer.
+#define BUSY_RETRIES 8
+
+// clang-format off
+static const char *g_labels[] = {
+    "Media\nPrev | Play | Next \nStop | Mute | ^\n  <  |   >  | v",
+    "Zoom\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
+    "Build\nMake | Test | Lint \nRun  | Dbg  | Stop\nPush | Pull | Log",
+    "Teams\nTalk | Mic  | Video \nFull | Quit | Enter\nHand | Chat | Blur",
+};
+static const char *g_label_edit = "Zoom\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |*";
+// clang-format on
+
+// The keyboard's encoder map, as in default_keymap.c.
+const uint16_t encoder_map[LAYER_COUNT][NUM_ENCODERS][2] = {[0] = {{KC_VOLU, KC_VOLD}}};
+
+// Set by keyboard_post_init_user; cleared to boot the firmware again.
+extern bool g_post_init;
+
+// A label with fields, and what it shows once they are set.
+static const char *g_field_label = "Zoom {t    }\nTalk | Mic  | {mic }\nFull | Quit | Enter\nHand |      |";
+static const char *g_field_shown = "Zoom %02ld:%02ld\nTalk | Mic  | %s\nFull | Quit | Enter\nHand |      |";
+
+// Typed by the macro scenarios; the runs of ascending keys are longer than a
+// 6kro report holds.
+static const char *g_macro_text = "abcdefghij klmnopqrstuvwxyz. The quick brown fox jumps over the lazy dog.";
+
+// Number of operations per scenario; overridable from the command line.
+static long g_iterations = 2000;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Deliver one frame to the firmware, sending it again while the firmware
+// replies busy, as kbp does; the main loop runs before it arrives again.
+// Returns false if it was not acked.
+static bool send_frame(uint8_t cmd, const uint8_t *payload, uint8_t length) {
+    uint8_t frame[32] = {'m', 'l', cmd};
+    memcpy(&frame[3], payload, length);
+    for (uint8_t tries = 0;; tries++) {
+        uint32_t replies = g_host_counters.hid_frames_out;
+        g_host_counters.hid_frames_in++;
+        user_hid_receive(frame, sizeof(frame));
+        if (g_host_counters.hid_frames_out == replies || host_last_hid_reply()[0] != HID_CMD_BUSY || tries == BUSY_RETRIES) {
+            break;
+        }
+        host_task();
+    }
+    return host_last_hid_reply()[0] == HID_CMD_ACK;
+}
+
+// Send a layer label the way kbp's sendSegmented does.
+static bool send_layer_update(uint8_t layer, const char *text) {
+    uint8_t     payload[29];
+    const char *p       = text;
+    uint8_t     tot     = strlen(text);
+    bool        is_start = true;
+    while (tot > 0) {
+        uint8_t l  = tot > CHUNK_SIZE ? CHUNK_SIZE : tot;
+        payload[0] = layer;
+        payload[1] = l;
+        memcpy(&payload[2], p, l);
+        if (!send_frame(is_start ? HID_CMD_OLED_UPDATE : HID_CMD_CONT, payload, l + 2)) {
+            return false;
+        }
+        is_start = false;
+        p += l;
+        tot -= l;
+    }
+    payload[0] = layer;
+    payload[1] = 0;
+    return send_frame(HID_CMD_COMPLETE, payload, 2);
+}
+
+// Send the frames of a bulk update of the first count layers without
+// completing it, as a host dying mid-transfer would.
+static bool send_bulk_unfinished(const char *const *texts, uint8_t count) {
+    uint8_t payload[29];
+    uint8_t cmd = HID_CMD_OLED_BULK_UPDATE;
+    for (uint8_t layer = 0; layer < count; layer++) {
+        const char *p   = texts[layer];
+        uint8_t     tot = strlen(p);
+        while (tot > 0) {
+            uint8_t l  = tot > CHUNK_SIZE ? CHUNK_SIZE : tot;
+            payload[0] = layer;
+            payload[1] = l;
+            memcpy(&payload[2], p, l);
+            if (!send_frame(cmd, payload, l + 2)) {
+                return false;
+            }
+            cmd = HID_CMD_CONT;
+            p += l;
+            tot -= l;
+        }
+    }
+    return true;
+}
+
+// Send layer labels as sequenced frames, reading acks only where the firmware
+// sends them (once per window and on completion). Several labels are sent as
+// one bulk update. After a busy reply, the frames from the one it names are
+// sent again once the main loop has run.
+static bool send_windowed(uint8_t cmd, const char *const *texts, uint8_t count) {
+    uint8_t  frames[LAYER_COUNT * ((sizeof(oled_text_t) - 1 + SEQ_CHUNK_SIZE - 1) / SEQ_CHUNK_SIZE) + 1][32];
+    uint8_t  n       = 0;
+    uint8_t  tries   = 0;
+    uint32_t replies = g_host_counters.hid_frames_out;
+    for (uint8_t layer = 0; layer <= count; layer++) {
+        bool        done = layer == count;
+        const char *p    = done ? "" : texts[layer];
+        uint8_t     tot  = strlen(p);
+        for (bool first = true; first || tot > 0; first = false, n++) {
+            uint8_t *frame = frames[n];
+            uint8_t  l     = tot > SEQ_CHUNK_SIZE ? SEQ_CHUNK_SIZE : tot;
+            frame[0]       = 'm';
+            frame[1]       = 'l';
+            frame[2]       = HID_FLAG_SEQ | (done ? HID_CMD_COMPLETE : n == 0 ? cmd : HID_CMD_CONT);
+            frame[3]       = n;
+            frame[4]       = done ? count - 1 : layer;
+            frame[5]       = l;
+            memcpy(&frame[6], p, l);
+            p += l;
+            tot -= l;
+        }
+    }
+    for (uint8_t seq = 0; seq < n; seq++) {
+        g_host_counters.hid_frames_in++;
+        user_hid_receive(frames[seq], sizeof(frames[seq]));
+        if (seq + 1 == n || (seq + 1) % HID_WINDOW_SIZE == 0) {
+            const uint8_t *reply = host_last_hid_reply();
+            if (g_host_counters.hid_frames_out != ++replies) {
+                return false;
+            }
+            if (reply[0] == HID_CMD_BUSY && reply[2] <= seq && seq - reply[2] < HID_WINDOW_SIZE && tries++ < BUSY_RETRIES) {
+                host_task();
+                seq = reply[2] - 1;
+                continue;
+            }
+            if (reply[0] != HID_CMD_ACK || reply[2] != seq) {
+                return false;
+            }
+            tries = 0;
+        }
+    }
+    return g_host_counters.hid_frames_out == replies;
+}
+
+// Run-length code as much of src[0..n) as fits in cap bytes of dst, the way
+// kbp's rleEncode does. Returns the bytes written; *used is set to the bytes
+// of src consumed.
+static uint8_t fb_encode(const uint8_t *src, uint16_t n, uint8_t *dst, uint8_t cap, uint16_t *used) {
+    uint8_t  out = 0;
+    uint16_t i   = 0;
+    while (i < n && out + 2 <= cap) {
+        uint16_t run = 1;
+        while (i + run < n && run < 128 && src[i + run] == src[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            dst[out++] = HID_FB_RUN | (run - 1);
+            dst[out++] = src[i];
+            i += run;
+            continue;
+        }
+        // literals up to the next run of 3 or the end of dst.
+        uint8_t  start = out++;
+        uint16_t lit   = 0;
+        while (i < n && lit < 128 && out < cap) {
+            if (i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2]) {
+                break;
+            }
+            dst[out++] = src[i++];
+            lit++;
+        }
+        dst[start] = lit - 1;
+    }
+    *used = i;
+    return out;
+}
+
+// What the display was last sent, to send only what changed.
+static uint8_t g_fb_sent[OLED_MATRIX_SIZE];
+
+// Send the bytes of fb between the first and last that differ from what was
+// sent before, ending with HID_FB_END. Returns false if it was not acked.
+static bool send_framebuffer(const uint8_t *fb) {
+    uint16_t first = 0, last = OLED_MATRIX_SIZE;
+    while (first < last && fb[first] == g_fb_sent[first]) {
+        first++;
+    }
+    while (last > first && fb[last - 1] == g_fb_sent[last - 1]) {
+        last--;
+    }
+    memcpy(g_fb_sent, fb, sizeof(g_fb_sent));
+    uint8_t payload[29];
+    do {
+        uint16_t used;
+        uint8_t  len = fb_encode(&fb[first], last - first, &payload[4], HID_FB_CHUNK_SIZE, &used);
+        first += used;
+        payload[0] = first == last ? HID_FB_END : 0;
+        payload[1] = (first - used) & 0xff;
+        payload[2] = (first - used) >> 8;
+        payload[3] = len;
+        uint32_t replies = g_host_counters.hid_frames_out;
+        send_frame(HID_CMD_OLED_FRAMEBUFFER, payload, len + 4);
+        if (first < last && g_host_counters.hid_frames_out != replies) {
+            return false;
+        }
+    } while (first < last);
+    return host_last_hid_reply()[0] == HID_CMD_ACK;
+}
+
+// Let the main loop run until the firmware is idle, including deferred
+// eeprom writes.
+static void settle(void) {
+    host_task();
+    host_advance_ms(PERSIST_QUIET_MS);
+    host_task();
+}
+
+// Whether the display shows what clearing it and writing text would, leaving
+// the display as it was.
+static bool shows(const char *text) {
+    uint8_t shown[OLED_MATRIX_SIZE];
+    memcpy(shown, host_oled_buffer(), sizeof(shown));
+    oled_clear();
+    oled_write(text, false);
+    bool ok = !memcmp(shown, host_oled_buffer(), sizeof(shown));
+    // put back what the firmware believes is on the display.
+    oled_set_cursor(0, 0);
+    oled_write_raw((const char *)shown, sizeof(shown));
+    return ok;
+}
+
+struct scenario {
+    const char *name;
+    void (*setup)(void);
+    bool (*run)(long i);
+};
+
+static void setup_layer0(void) {
+    layer_move(0);
+    settle();
+}
+
+static bool run_hello(long i) {
+    return send_frame(HID_CMD_HELLO, NULL, 0);
+}
+
+static bool run_label_active(long i) {
+    return send_layer_update(0, g_labels[i % 2]);
+}
+
+static bool run_label_windowed(long i) {
+    return send_windowed(HID_CMD_OLED_UPDATE, &g_labels[i % 2], 1);
+}
+
+static bool run_label_burst(long i) {
+    for (uint8_t j = 0; j < 5; j++) {
+        if (!send_layer_update(0, g_labels[(i + j) % LAYER_COUNT])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_label_inactive(long i) {
+    return send_layer_update(2, g_labels[i % 2 + 2]);
+}
+
+static bool run_label_edit(long i) {
+    return send_layer_update(1, i % 2 ? g_label_edit : g_labels[1]);
+}
+
+static void setup_layer1(void) {
+    layer_move(1);
+    send_layer_update(1, g_labels[1]);
+    settle();
+}
+
+static bool send_field(const char *name, const char *value) {
+    uint8_t payload[2 + HID_FIELD_DATA_SIZE] = {strlen(name), strlen(value)};
+    memcpy(&payload[2], name, payload[0]);
+    memcpy(&payload[2 + payload[0]], value, payload[1]);
+    return send_frame(HID_CMD_OLED_FIELD, payload, 2 + payload[0] + payload[1]);
+}
+
+static void setup_field(void) {
+    layer_move(0);
+    send_layer_update(0, g_field_label);
+    send_field("mic", "muted");
+    settle();
+}
+
+// A meeting timer ticking, its minute changing every 60th operation.
+static bool run_field(long i) {
+    char value[8];
+    snprintf(value, sizeof(value), "%02ld:%02ld", i / 60 % 100, i % 60);
+    return send_field("t", value);
+}
+
+static bool run_all_layers(long i) {
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        if (!send_layer_update(l, g_labels[(l + i) % LAYER_COUNT])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_all_layers_bulk(long i) {
+    const char *texts[LAYER_COUNT];
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        texts[l] = g_labels[(l + i) % LAYER_COUNT];
+    }
+    return send_windowed(HID_CMD_OLED_BULK_UPDATE, texts, LAYER_COUNT);
+}
+
+static bool run_get_layers(long i) {
+    uint8_t payload[1] = {HID_GET_ALL_LAYERS};
+    return send_frame(HID_CMD_OLED_GET, payload, sizeof(payload));
+}
+
+static bool run_layer_hashes(long i) {
+    return send_frame(HID_CMD_OLED_HASHES, NULL, 0);
+}
+
+static bool run_stats(long i) {
+    for (uint8_t id = 0; id < STAT_COUNT; id++) {
+        uint8_t payload[2] = {id, 0};
+        if (!send_frame(HID_CMD_STATS, payload, sizeof(payload))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A full image of diagonal stripes, alternating direction.
+static void image_stripes(uint8_t *fb, long i) {
+    for (uint16_t b = 0; b < OLED_MATRIX_SIZE; b++) {
+        fb[b] = (i % 2 ? 0x11 : 0x88) << (b % 4) | (i % 2 ? 0x11 : 0x88) >> (4 - b % 4);
+    }
+}
+
+// Two level meters on the bottom line with a fixed caption above, as a live
+// volume display would send.
+static void image_meter(uint8_t *fb, long i) {
+    memset(fb, 0, OLED_MATRIX_SIZE);
+    for (uint8_t x = 0; x < 32; x++) {
+        fb[x] = x % 4 ? 0x7e : 0;
+    }
+    uint8_t left = i * 7 % 128, right = i * 13 % 128;
+    for (uint8_t x = 0; x < 128; x++) {
+        fb[384 + x] = (x < left ? 0x0f : 0) | (x < right ? 0xf0 : 0);
+    }
+}
+
+static void setup_framebuffer(void) {
+    memset(g_fb_sent, 0, sizeof(g_fb_sent));
+    set_oled_state(false);
+    settle();
+}
+
+// Send an image and check that the display shows it.
+static bool run_image(void (*image)(uint8_t *, long), long i) {
+    uint8_t fb[OLED_MATRIX_SIZE];
+    image(fb, i);
+    return send_framebuffer(fb) && !memcmp(fb, host_oled_buffer(), sizeof(fb));
+}
+
+static bool run_fb_full(long i) {
+    return run_image(image_stripes, i);
+}
+
+static bool run_fb_meter(long i) {
+    return run_image(image_meter, i);
+}
+
+// Turn the encoder by the given detents, 2ms apart as a fast spin delivers
+// them, then check the taps sent once its window has passed.
+static bool turn_encoder(int8_t detents, uint8_t expected_taps) {
+    uint32_t reports = g_host_counters.key_reports;
+    for (int8_t d = 0; d < (detents < 0 ? -detents : detents); d++) {
+        encoder_update_user(0, detents > 0);
+        host_advance_ms(2);
+        host_task();
+    }
+    host_advance_ms(ENCODER_WINDOW_MS);
+    host_task();
+    return g_host_counters.key_reports - reports == 2 * expected_taps && (!expected_taps || host_last_tap() == (detents > 0 ? KC_VOLD : KC_VOLU));
+}
+
+static bool run_encoder_detent(long i) {
+    return turn_encoder(i % 2 ? 1 : -1, 1);
+}
+
+static bool run_encoder_spin(long i) {
+    const uint8_t accel[] = ENCODER_ACCEL_TAPS;
+    return turn_encoder(i % 2 ? 9 : -9, accel[sizeof(accel) - 1]);
+}
+
+// Steps typing text on a US layout; only letters and a little punctuation.
+static uint16_t text_steps(const char *text, uint8_t *steps) {
+    uint16_t n = 0;
+    for (; *text; text++) {
+        char c     = *text;
+        bool upper = c >= 'A' && c <= 'Z';
+        steps[n++] = upper ? 0x02 : 0; // left shift
+        steps[n++] = upper ? c - 'A' + 0x04 : c >= 'a' && c <= 'z' ? c - 'a' + 0x04 : c == '.' ? 0x37 : c == ',' ? 0x36 : 0x2c;
+    }
+    return n;
+}
+
+// Upload a macro the way kbp does, a frame at a time.
+static bool upload_macro(uint8_t id, uint8_t layer, uint8_t pos, const uint8_t *steps, uint16_t len) {
+    uint8_t payload[29] = {id, layer, pos, len & 0xff, len >> 8};
+    if (!send_frame(HID_CMD_MACRO_BEGIN, payload, 5)) {
+        return false;
+    }
+    for (uint16_t off = 0; off < len; off += HID_MACRO_CHUNK_SIZE) {
+        uint8_t n  = len - off < HID_MACRO_CHUNK_SIZE ? len - off : HID_MACRO_CHUNK_SIZE;
+        payload[1] = off & 0xff;
+        payload[2] = off >> 8;
+        payload[3] = n;
+        memcpy(&payload[4], &steps[off], n);
+        if (!send_frame(HID_CMD_MACRO_DATA, payload, n + 4)) {
+            return false;
+        }
+    }
+    return send_frame(HID_CMD_MACRO_END, &id, 1);
+}
+
+// Replace one of two macros, so that the space of the replaced steps has to be
+// reclaimed every few uploads.
+static bool run_macro_upload(long i) {
+    uint8_t  steps[256];
+    uint16_t len = text_steps(g_macro_text, steps);
+    return upload_macro(i % 2, i % 2 ? MACRO_UNBOUND : 0, MACRO_KEY_POS(2, 2), steps, len);
+}
+
+static void setup_macro(void) {
+    run_macro_upload(0);
+    layer_move(0);
+    settle();
+}
+
+// Reports playing steps takes with up to max keys per report, as macro_task
+// groups them: a press and a release per group, none for a pause.
+static uint32_t macro_reports(const uint8_t *steps, uint16_t len, uint8_t max) {
+    uint32_t reports = 0;
+    for (uint16_t i = 0, n; i < len; i += 2 * n) {
+        n = 1;
+        while (steps[i + 1] && n < max && i + 2 * n < len && steps[i + 2 * n] == steps[i] && steps[i + 2 * n + 1] > steps[i + 2 * n - 1]) {
+            n++;
+        }
+        reports += steps[i] || steps[i + 1] ? 2 : 0;
+    }
+    return reports;
+}
+
+// Press the key the macro is bound to and let it type; check what the host
+// would have read, and that keys were grouped into as few reports as allowed.
+static bool run_macro_play(long i) {
+    uint8_t     steps[256], typed[256];
+    uint16_t    len     = text_steps(g_macro_text, steps);
+    uint32_t    reports = g_host_counters.key_reports;
+    keyrecord_t key     = {.event = {.key = {.row = 2, .col = 2}, .pressed = true}};
+    process_record_user(KC_NO, &key);
+    key.event.pressed = false;
+    process_record_user(KC_NO, &key);
+    while (macro_playing()) {
+        host_advance_ms(MACRO_REPORT_DELAY_MS);
+        host_task();
+    }
+    reports = g_host_counters.key_reports - reports;
+    return reports == macro_reports(steps, len, keymap_config.nkro ? MACRO_KEYS_PER_REPORT : 6) && host_typed(typed, sizeof(typed) / 2) * 2 == len && !memcmp(typed, steps, len);
+}
+
+// As above, but the text needs more reports than with nkro.
+static bool run_macro_play_6kro(long i) {
+    uint8_t  steps[256];
+    uint16_t len = text_steps(g_macro_text, steps);
+
+    keymap_config.nkro = false;
+    bool ok            = run_macro_play(i);
+    keymap_config.nkro = true;
+    return ok && macro_reports(steps, len, 6) > macro_reports(steps, len, MACRO_KEYS_PER_REPORT);
+}
+
+// The new layer is shown as the layer changes, before the main loop runs.
+static bool run_layer_switch(long i) {
+    uint32_t renders = g_host_counters.oled_render_calls;
+    layer_move((i + 1) % LAYER_COUNT);
+    return g_host_counters.oled_render_calls == renders + 1;
+}
+
+// Switch at the given key and scan once a millisecond until the change has
+// been debounced and processed.
+static void press_key(uint8_t row, uint8_t col, bool pressed) {
+    host_key(row, col, pressed);
+    for (uint8_t ms = 0; ms < DEBOUNCE; ms++) {
+        host_advance_ms(1);
+        host_task();
+    }
+}
+
+// Read the latency samples of the keys of operations i - 1 and i.
+static bool read_latency(long i) {
+    if (!send_frame(HID_CMD_LATENCY, NULL, 0)) {
+        return false;
+    }
+    const uint8_t *reply = host_last_hid_reply();
+    if (reply[2] != 4 || reply[3]) {
+        return false;
+    }
+    for (uint8_t s = 0; s < 4; s++) {
+        struct latency_sample sample;
+        long                  op = i - 1 + s / 2;
+        memcpy(&sample, &reply[4 + s * sizeof(sample)], sizeof(sample));
+        // the first scan sees the change a millisecond after it happened.
+        if (sample.pos != MACRO_KEY_POS(op % 8 / 3, op % 8 % 3) || sample.layer != (s % 2 ? LATENCY_RELEASE : 0) || sample.debounce != (DEBOUNCE - 1) * 1000) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void setup_keypress(void) {
+    layer_move(0);
+    settle();
+    // drop samples of keys pressed by other scenarios.
+    while (send_frame(HID_CMD_LATENCY, NULL, 0) && host_last_hid_reply()[2]) {
+    }
+}
+
+// Tap one of the keys not bound to a macro, reading the samples of every
+// two taps in one frame.
+static bool run_keypress(long i) {
+    uint8_t typed[2];
+    press_key(i % 8 / 3, i % 8 % 3, true);
+    press_key(i % 8 / 3, i % 8 % 3, false);
+    if (host_typed(typed, 1) != 1 || typed[1] != HOST_KEYCODE(i % 8 / 3, i % 8 % 3)) {
+        return false;
+    }
+    return i % 2 == 0 || read_latency(i);
+}
+
+// A log of many records, the last of each layer l holding g_labels[l].
+static void setup_boot(void) {
+    for (uint8_t j = 0; j < 6 * LAYER_COUNT; j++) {
+        uint8_t l = j % LAYER_COUNT;
+        send_layer_update(l, g_labels[j < 5 * LAYER_COUNT ? (l + j / LAYER_COUNT + 1) % LAYER_COUNT : l]);
+        settle();
+    }
+}
+
+// Start the firmware over with what is in eeprom and layer on top, as after
+// a power cycle; the operation ends with the first render, which must show
+// expected.
+static bool boot(uint8_t layer, const char *expected) {
+    oled_text_t buf;
+    uint32_t    renders = g_host_counters.oled_render_calls;
+    g_post_init      = false;
+    host_eeprom_power_on();
+    // nothing is drawn until the firmware is initialized.
+    set_oled_state(true);
+    layer_move(layer);
+    keyboard_post_init_user();
+    return g_host_counters.oled_render_calls == renders + 1 && !strcmp(peek_user_layer_label(layer, buf), expected);
+}
+
+static bool run_boot(long i) {
+    return boot(i % LAYER_COUNT, g_labels[i % LAYER_COUNT]);
+}
+
+// Boot from version 668, whose upgrade erases the macros and writes the
+// version.
+static bool run_boot_upgrade(long i) {
+    uint8_t *version = host_eeprom() + VIA_EEPROM_CUSTOM_CONFIG_ADDR + 2;
+    version[0]       = 668 & 0xff;
+    version[1]       = 668 >> 8;
+    return boot(i % LAYER_COUNT, g_labels[i % LAYER_COUNT]);
+}
+
+// Cut power during a bulk update of every layer, once it has staged more
+// layers than the label cache holds; boot must find the labels from before.
+static bool run_boot_torn_bulk(long i) {
+    const char *texts[LAYER_COUNT];
+    oled_text_t buf;
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        texts[l] = i % 2 ? g_label_edit : g_labels[(l + 1) % LAYER_COUNT];
+    }
+    if (!send_bulk_unfinished(texts, LAYER_COUNT) || !boot(i % LAYER_COUNT, g_labels[i % LAYER_COUNT])) {
+        return false;
+    }
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        if (strcmp(peek_user_layer_label(l, buf), g_labels[l])) {
+            fprintf(stderr, "layer %d kept part of an unfinished bulk update\n", l);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A label of 46 to 86 chars that the codec cannot shorten, so that the log is
+// compacted every few dozen writes. Its length varies so that records end at
+// varying offsets in a page, and compacted records do not land where they
+// were read from.
+static void long_label(long i, char *label) {
+    for (uint8_t k = 0; k < sizeof(oled_text_t) - 1; k++) {
+        label[k] = k % 22 == 21 ? '\n' : 'A' + (k * 7 + i) % 26;
+    }
+    label[46 + i * 7 % 41] = '\0';
+}
+
+// The log of setup_boot, written to a blank eeprom so that where each record
+// lands does not depend on the scenarios before.
+static void setup_boot_blank(void) {
+    oled_text_t label;
+    host_eeprom_erase();
+    system_layer_label(0, label);
+    boot(0, label);
+    settle();
+    setup_boot();
+}
+
+// Write long labels to layer 0, with only LABEL_CACHE_SIZE labels in RAM, so
+// that compactions read the other layers' labels from the log; boot must
+// find every layer's label.
+static bool run_boot_long_labels(long i) {
+    oled_text_t label, buf;
+    long_label(i, label);
+    if (!send_layer_update(0, label)) {
+        return false;
+    }
+    settle();
+    if (!boot(0, label)) {
+        return false;
+    }
+    for (uint8_t l = 1; l < LAYER_COUNT; l++) {
+        if (strcmp(peek_user_layer_label(l, buf), g_labels[l])) {
+            fprintf(stderr, "layer %d lost its label\n", l);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Write long labels to layer 0, cutting power after the first few pages of
+// each write, which is then done again; boot must find every layer's label
+// from before or after the write, also when a compaction was cut off.
+static bool run_boot_torn_compaction(long i) {
+    static oled_text_t before;
+    oled_text_t        label, buf;
+    if (!i) {
+        strcpy(before, g_labels[0]);
+    }
+    long_label(i, label);
+    if (!send_layer_update(0, label)) {
+        return false;
+    }
+    host_eeprom_power_cut(1 + i % 4);
+    settle();
+    if (!boot(1, g_labels[1])) {
+        return false;
+    }
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        const char *shown = peek_user_layer_label(l, buf);
+        if (l ? strcmp(shown, g_labels[l]) : strcmp(shown, before) && strcmp(shown, label)) {
+            fprintf(stderr, "layer %d lost its label to a torn write\n", l);
+            return false;
+        }
+    }
+    strcpy(before, label);
+    return send_layer_update(0, label);
+}
+
+// Boot from a blank eeprom, which is initialized once the labels are shown.
+static bool run_boot_blank(long i) {
+    oled_text_t label;
+    host_eeprom_erase();
+    system_layer_label(i % LAYER_COUNT, label);
+    return boot(i % LAYER_COUNT, label);
+}
+
+static void run_scenario(const struct scenario *s) {
+    if (s->setup) {
+        s->setup();
+    }
+    host_reset_counters();
+    uint64_t ack_us = 0;
+    double   start  = now_s();
+    for (long i = 0; i < g_iterations; i++) {
+        uint64_t busy = g_host_counters.busy_us;
+        if (!s->run(i)) {
+            fprintf(stderr, "%s: operation %ld was not acked\n", s->name, i);
+            exit(1);
+        }
+        ack_us += g_host_counters.busy_us - busy;
+        settle();
+    }
+    double elapsed = now_s() - start;
+    double n       = g_iterations;
+
+    struct host_counters *c = &g_host_counters;
+    printf("%-22s %10.0f %10.0f %8.2f %8.2f %8.1f %8.1f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", s->name, n / elapsed, c->hid_frames_in / elapsed, c->hid_frames_in / n, c->hid_frames_out / n, c->eeprom_bytes_written / n, c->eeprom_bytes_read / n, c->eeprom_write_cycles / n, ack_us / 1000.0 / n, c->busy_us / 1000.0 / n, c->oled_render_calls / n, c->oled_blocks_sent / n, c->key_reports / n);
+}
+
+// Check that what was persisted restores to the labels held in RAM.
+static bool verify_persisted(void) {
+    oled_text_t expected[LAYER_COUNT];
+    oled_text_t buf;
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        strcpy(expected[l], peek_user_layer_label(l, buf));
+    }
+    persistence_init();
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        const char *label = peek_user_layer_label(l, buf);
+        if (strcmp(expected[l], label)) {
+            fprintf(stderr, "layer %d restored as \"%s\", expected \"%s\"\n", l, label, expected[l]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that the hashes the firmware reports match its labels.
+static bool verify_hashes(void) {
+    oled_text_t buf;
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        const char *label = peek_user_layer_label(l, buf);
+        if (user_layer_hashes()[l] != crc16(label, strlen(label))) {
+            fprintf(stderr, "layer %d hash is stale\n", l);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that the display of each layer matches what clearing it and writing
+// the whole label would produce.
+static bool verify_rendered(void) {
+    oled_text_t buf;
+    for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+        layer_move(l);
+        host_task();
+        const char *label = peek_user_layer_label(l, buf);
+        if (!shows(label)) {
+            fprintf(stderr, "layer %d is not rendered as \"%s\"\n", l, label);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that fields show their values in place, and blank once cleared.
+static bool verify_fields(void) {
+    oled_text_t label, text;
+    oled_text_t buf;
+    strcpy(label, peek_user_layer_label(0, buf));
+    layer_move(0);
+    send_layer_update(0, g_field_label);
+    bool ok = send_field("t", "01:02") && send_field("mic", "muted");
+    host_task();
+    snprintf(text, sizeof(text), g_field_shown, 1L, 2L, "muted");
+    ok = ok && shows(text);
+    ok = ok && send_field("mic", "") && !send_field("mic", "too long for one line!");
+    host_task();
+    snprintf(text, sizeof(text), g_field_shown, 1L, 2L, "      ");
+    ok = ok && shows(text);
+    send_field("t", "");
+    send_layer_update(0, label);
+    settle();
+    if (!ok) {
+        fprintf(stderr, "fields are not rendered in place\n");
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        g_iterations = strtol(argv[1], NULL, 10);
+        if (g_iterations <= 0) {
+            fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    host_eeprom_erase();
+    eeprom_driver_init();
+    oled_init(OLED_ROTATION_0);
+    keyboard_post_init_user();
+    settle();
+
+    // clang-format off
+    const struct scenario scenarios[] = {
+        {"hello",                 NULL,         run_hello},
+        {"label (active layer)",  setup_layer0, run_label_active},
+        {"label (windowed)",      setup_layer0, run_label_windowed},
+        {"label (other layer)",   setup_layer0, run_label_inactive},
+        {"label (burst of 5)",    setup_layer0, run_label_burst},
+        {"label (1 char edit)",   setup_layer1, run_label_edit},
+        {"field (live value)",    setup_field,  run_field},
+        {"all layers",            setup_layer0, run_all_layers},
+        {"all layers (bulk)",     setup_layer0, run_all_layers_bulk},
+        {"layer switch",          setup_layer0, run_layer_switch},
+        {"keypress",              setup_keypress, run_keypress},
+        {"get (all layers)",      NULL,         run_get_layers},
+        {"hashes",                NULL,         run_layer_hashes},
+        {"stats (all)",           NULL,         run_stats},
+        {"encoder (1 detent)",    setup_layer1, run_encoder_detent},
+        {"encoder (fast spin)",   setup_layer1, run_encoder_spin},
+        {"macro (upload)",        NULL,         run_macro_upload},
+        {"macro (play)",          setup_macro,  run_macro_play},
+        {"macro (play, 6kro)",    setup_macro,  run_macro_play_6kro},
+        {"framebuffer (full)",    setup_framebuffer, run_fb_full},
+        {"framebuffer (meter)",   setup_framebuffer, run_fb_meter},
+        {"boot",                  setup_boot,   run_boot},
+        {"boot (upgrade)",        setup_boot,   run_boot_upgrade},
+        {"boot (torn bulk)",      setup_boot,   run_boot_torn_bulk},
+        {"boot (long labels)",    setup_boot_blank, run_boot_long_labels},
+        {"boot (torn compaction)", setup_boot_blank, run_boot_torn_compaction},
+        {"boot (blank eeprom)",   NULL,         run_boot_blank},
+    };
+    // clang-format on
+
+    printf("%ld operations per scenario; per-op columns are averages.\n\n", g_iterations);
+    printf("%-22s %10s %10s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "scenario", "ops/s", "frames/s", "frames", "replies", "ee_wr_B", "ee_rd_B", "ee_wcyc", "ack_ms", "dev_ms", "renders", "blocks", "reports");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&scenarios[i]);
+    }
+    // back to the labels.
+    set_oled_state(true);
+    if (!verify_fields() || !verify_rendered() || !verify_hashes() || !verify_persisted() || !verify_hashes()) {
+        return 1;
+    }
+    printf("\nops/s, frames/s: host throughput of user_hid_receive.\n"
+           "frames, replies: frames sent to and by the firmware (round trips).\n"
+           "ee_*: i2c eeprom bytes read/written and page write cycles.\n"
+           "ack_ms: modelled device time blocked before the operation was acked\n"
+           "        (for boot, until the first render).\n"
+           "dev_ms: modelled device time blocked in total, including deferred writes.\n"
+           "renders/blocks: oled_render calls and dirty blocks sent to the panel.\n"
+           "reports: keyboard and consumer reports sent, e.g. by the encoder or a macro.\n");
+    return 0;
+}
@@ -0,0 +1,538 @@
+#include "host_stubs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "action.h"
+#include "action_layer.h"
+#include "action_util.h"
+#include "debug.h"
+#include "eeprom.h"
+#include "i2c_master.h"
+#include "keycode_config.h"
+#include "matrix.h"
+#include "oled_driver.h"
+#include "raw_hid.h"
+#include "stats.h"
+#include "timer.h"
+#include "wait.h"
+
+struct host_counters g_host_counters;
+
+void host_reset_counters(void) {
+    memset(&g_host_counters, 0, sizeof(g_host_counters));
+}
+
+// ---------------------------------------------------------------------------
+// Clock
+
+static uint64_t g_clock_us = 0;
+
+uint64_t host_clock_us(void) {
+    return g_clock_us;
+}
+
+void host_advance_ms(uint32_t ms) {
+    g_clock_us += (uint64_t)ms * 1000;
+}
+
+void wait_us(uint32_t us) {
+    g_clock_us += us;
+    g_host_counters.busy_us += us;
+}
+
+void wait_ms(uint32_t ms) {
+    wait_us(ms * 1000);
+}
+
+// The firmware's stats read the virtual clock at full resolution.
+uint32_t stats_clock_us(void) {
+    return (uint32_t)g_clock_us;
+}
+
+uint32_t timer_read32(void) {
+    return (uint32_t)(g_clock_us / 1000);
+}
+
+uint16_t timer_read(void) {
+    return (uint16_t)timer_read32();
+}
+
+uint16_t timer_elapsed(uint16_t last) {
+    return timer_read() - last;
+}
+
+uint32_t timer_elapsed32(uint32_t last) {
+    return timer_read32() - last;
+}
+
+// ---------------------------------------------------------------------------
+// Keys
+
+static uint16_t g_last_tap = KC_NO;
+
+uint16_t host_last_tap(void) {
+    return g_last_tap;
+}
+
+void tap_code16(uint16_t code) {
+    g_last_tap = code;
+    g_host_counters.key_reports += 2;
+}
+
+keymap_config_t keymap_config = {.nkro = true};
+
+static uint8_t  g_report_keys[32]; // nkro bitmap of keys in the report
+static uint8_t  g_report_mods;
+static uint8_t  g_sent_keys[32]; // as last sent
+static uint8_t  g_typed[2048];   // < mods key > pairs pressed since host_typed
+static uint16_t g_typed_len;
+
+void add_key(uint8_t key) {
+    g_report_keys[key / 8] |= 1 << (key % 8);
+}
+
+void del_key(uint8_t key) {
+    g_report_keys[key / 8] &= ~(1 << (key % 8));
+}
+
+void add_weak_mods(uint8_t mods) {
+    g_report_mods |= mods;
+}
+
+void del_weak_mods(uint8_t mods) {
+    g_report_mods &= ~mods;
+}
+
+void send_keyboard_report(void) {
+    g_host_counters.key_reports++;
+    for (uint16_t key = 0; key < 256; key++) {
+        bool down = g_report_keys[key / 8] & (1 << (key % 8));
+        bool was  = g_sent_keys[key / 8] & (1 << (key % 8));
+        if (down && !was && g_typed_len + 2 <= sizeof(g_typed)) {
+            g_typed[g_typed_len++] = g_report_mods;
+            g_typed[g_typed_len++] = key;
+        }
+    }
+    memcpy(g_sent_keys, g_report_keys, sizeof(g_sent_keys));
+}
+
+uint16_t host_typed(uint8_t *typed, uint16_t max) {
+    uint16_t n = g_typed_len / 2 < max ? g_typed_len / 2 : max;
+    memcpy(typed, g_typed, n * 2);
+    g_typed_len = 0;
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Debug
+
+bool debug_enable = false;
+bool debug_matrix = false;
+
+// ---------------------------------------------------------------------------
+// Layers
+
+layer_state_t layer_state = 1;
+
+__attribute__((weak)) layer_state_t layer_state_set_user(layer_state_t state) {
+    return state;
+}
+
+uint8_t get_highest_layer(layer_state_t state) {
+    uint8_t layer = 0;
+    while (state >>= 1) {
+        layer++;
+    }
+    return layer;
+}
+
+void layer_state_set(layer_state_t state) {
+    layer_state = layer_state_set_user(state);
+}
+
+void layer_move(uint8_t layer) {
+    layer_state_set((layer_state_t)1 << layer);
+}
+
+// ---------------------------------------------------------------------------
+// Raw hid
+
+static uint8_t g_hid_reply[32];
+
+const uint8_t *host_last_hid_reply(void) {
+    return g_hid_reply;
+}
+
+void raw_hid_send(uint8_t *data, uint8_t length) {
+    g_host_counters.hid_frames_out++;
+    memset(g_hid_reply, 0, sizeof(g_hid_reply));
+    memcpy(g_hid_reply, data, length < sizeof(g_hid_reply) ? length : sizeof(g_hid_reply));
+}
+
+// ---------------------------------------------------------------------------
+// EEPROM (24LC256 on i2c)
+//
+// The firmware's own driver (eeprom_24lc256.c) runs against this model of the
+// chip. Transfers take HOST_I2C_US of bus time. A page write starts a write
+// cycle of HOST_EEPROM_WRITE_US, during which the chip acknowledges nothing, so
+// the driver ack polls it. The datasheet only bounds the write cycle
+// (EXTERNAL_EEPROM_WRITE_TIME); parts usually finish well before. The Makefile
+// sets it from EEPROM_WRITE_US.
+
+#if !defined(HOST_EEPROM_WRITE_US)
+#    define HOST_EEPROM_WRITE_US 3500
+#endif
+// 9 clocks (8 bits and the ack) per byte at 400kHz.
+#define HOST_I2C_US(bytes) ((uint32_t)(bytes) * 45 / 2)
+
+static uint8_t  g_eeprom[EXTERNAL_EEPROM_BYTE_COUNT];
+static uint64_t g_eeprom_busy_until = 0;  // end of the current write cycle
+static int32_t  g_eeprom_cycles_left = -1; // write cycles before power is lost; -1 if it is not
+
+uint8_t *host_eeprom(void) {
+    return g_eeprom;
+}
+
+void host_eeprom_erase(void) {
+    memset(g_eeprom, 0xff, sizeof(g_eeprom));
+}
+
+void host_eeprom_power_cut(uint32_t cycles) {
+    g_eeprom_cycles_left = cycles;
+}
+
+void host_eeprom_power_on(void) {
+    g_eeprom_cycles_left = -1;
+}
+
+static bool eeprom_acks(uint8_t address) {
+    return address == EXTERNAL_EEPROM_I2C_BASE_ADDRESS && g_clock_us >= g_eeprom_busy_until;
+}
+
+void i2c_init(void) {}
+
+i2c_status_t i2c_ping_address(uint8_t address, uint16_t timeout) {
+    bool ack = eeprom_acks(address);
+    wait_us(HOST_I2C_US(1));
+    return ack ? I2C_STATUS_SUCCESS : I2C_STATUS_ERROR;
+}
+
+// Sequential reads wrap at the end of the memory.
+i2c_status_t i2c_read_register16(uint8_t devaddr, uint16_t regaddr, uint8_t *data, uint16_t length, uint16_t timeout) {
+    if (!eeprom_acks(devaddr)) {
+        wait_us(HOST_I2C_US(1));
+        return I2C_STATUS_ERROR;
+    }
+    // address, register, address again to read, then the data.
+    wait_us(HOST_I2C_US(4 + length));
+    for (uint16_t i = 0; i < length; i++) {
+        data[i] = g_eeprom[(regaddr + i) % sizeof(g_eeprom)];
+    }
+    g_host_counters.eeprom_bytes_read += length;
+    return I2C_STATUS_SUCCESS;
+}
+
+// A page write wraps within its page, and starts a write cycle.
+i2c_status_t i2c_write_register16(uint8_t devaddr, uint16_t regaddr, const uint8_t *data, uint16_t length, uint16_t timeout) {
+    if (!eeprom_acks(devaddr)) {
+        wait_us(HOST_I2C_US(1));
+        return I2C_STATUS_ERROR;
+    }
+    wait_us(HOST_I2C_US(3 + length));
+    if (g_eeprom_cycles_left == 0) {
+        return I2C_STATUS_SUCCESS;
+    }
+    if (g_eeprom_cycles_left > 0) {
+        g_eeprom_cycles_left--;
+    }
+    uint16_t page = regaddr % sizeof(g_eeprom) / EXTERNAL_EEPROM_PAGE_SIZE * EXTERNAL_EEPROM_PAGE_SIZE;
+    for (uint16_t i = 0; i < length; i++) {
+        g_eeprom[page + (regaddr + i) % EXTERNAL_EEPROM_PAGE_SIZE] = data[i];
+    }
+    g_host_counters.eeprom_bytes_written += length;
+    g_host_counters.eeprom_write_cycles++;
+    g_eeprom_busy_until = g_clock_us + HOST_EEPROM_WRITE_US;
+    return I2C_STATUS_SUCCESS;
+}
+
+void eeprom_update_block(const void *buf, void *addr, size_t len) {
+    uint8_t read_buf[len];
+    eeprom_read_block(read_buf, addr, len);
+    if (memcmp(buf, read_buf, len) != 0) {
+        eeprom_write_block(buf, addr, len);
+    }
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+    uint8_t v;
+    eeprom_read_block(&v, addr, sizeof(v));
+    return v;
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr) {
+    uint16_t v;
+    eeprom_read_block(&v, addr, sizeof(v));
+    return v;
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value) {
+    eeprom_write_block(&value, addr, sizeof(value));
+}
+
+void eeprom_write_word(uint16_t *addr, uint16_t value) {
+    eeprom_write_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+    eeprom_update_block(&value, addr, sizeof(value));
+}
+
+// ---------------------------------------------------------------------------
+// OLED (SSD1306, 128x32), following the QMK driver's cursor and dirty logic.
+
+static uint8_t         g_oled_buffer[OLED_MATRIX_SIZE];
+static uint8_t        *g_oled_cursor = &g_oled_buffer[0];
+static OLED_BLOCK_TYPE g_oled_dirty  = 0;
+static bool            g_oled_active = true;
+
+const uint8_t *host_oled_buffer(void) {
+    return g_oled_buffer;
+}
+
+// Stand-in glyphs: blank for a space, otherwise a pattern unique per char.
+static uint8_t glyph_column(char c, uint8_t col) {
+    if (c == ' ') {
+        return 0;
+    }
+    return (uint8_t)(c * 7 + col * 13) | 1;
+}
+
+__attribute__((weak)) oled_rotation_t oled_init_user(oled_rotation_t rotation) {
+    return rotation;
+}
+
+bool oled_init(oled_rotation_t rotation) {
+    oled_init_user(rotation);
+    oled_clear();
+    return true;
+}
+
+void oled_clear(void) {
+    g_host_counters.oled_clears++;
+    memset(g_oled_buffer, 0, sizeof(g_oled_buffer));
+    g_oled_cursor = &g_oled_buffer[0];
+    g_oled_dirty  = (OLED_BLOCK_TYPE)~0;
+}
+
+void oled_render(void) {
+    g_host_counters.oled_render_calls++;
+    if (!g_oled_active) {
+        return;
+    }
+    for (uint8_t i = 0; i < OLED_BLOCK_COUNT; i++) {
+        if (g_oled_dirty & ((OLED_BLOCK_TYPE)1 << i)) {
+            g_host_counters.oled_blocks_sent++;
+        }
+    }
+    g_oled_dirty = 0;
+}
+
+void oled_set_cursor(uint8_t col, uint8_t line) {
+    uint16_t index = line * OLED_DISPLAY_WIDTH + col * OLED_FONT_WIDTH;
+    if (index >= OLED_MATRIX_SIZE) {
+        index = 0;
+    }
+    g_oled_cursor = &g_oled_buffer[index];
+}
+
+static void oled_advance_char(void) {
+    uint16_t next      = g_oled_cursor - &g_oled_buffer[0] + OLED_FONT_WIDTH;
+    uint8_t  remaining = OLED_DISPLAY_WIDTH - (next % OLED_DISPLAY_WIDTH);
+    if (remaining < OLED_FONT_WIDTH) {
+        next += remaining;
+    }
+    if (next >= OLED_MATRIX_SIZE) {
+        next = 0;
+    }
+    g_oled_cursor = &g_oled_buffer[next];
+}
+
+static void oled_advance_page(bool clear_remainder) {
+    uint16_t index     = g_oled_cursor - &g_oled_buffer[0];
+    uint8_t  remaining = OLED_DISPLAY_WIDTH - (index % OLED_DISPLAY_WIDTH);
+    if (clear_remainder) {
+        remaining = remaining / OLED_FONT_WIDTH;
+        while (remaining--) {
+            oled_write_char(' ', false);
+        }
+        return;
+    }
+    if (index + remaining >= OLED_MATRIX_SIZE) {
+        index     = 0;
+        remaining = 0;
+    }
+    g_oled_cursor = &g_oled_buffer[index + remaining];
+}
+
+void oled_write_char(const char data, bool invert) {
+    if (data == '\n') {
+        oled_advance_page(true);
+        return;
+    }
+    if (data == '\r') {
+        oled_advance_page(false);
+        return;
+    }
+    uint8_t before[OLED_FONT_WIDTH];
+    memcpy(before, g_oled_cursor, OLED_FONT_WIDTH);
+    for (uint8_t i = 0; i < OLED_FONT_WIDTH; i++) {
+        uint8_t b        = glyph_column(data, i);
+        g_oled_cursor[i] = invert ? ~b : b;
+    }
+    // Only changed glyphs dirty their blocks, as in the QMK driver.
+    if (memcmp(before, g_oled_cursor, OLED_FONT_WIDTH)) {
+        uint16_t index = g_oled_cursor - &g_oled_buffer[0];
+        g_oled_dirty |= ((OLED_BLOCK_TYPE)1 << (index / OLED_BLOCK_SIZE));
+        g_oled_dirty |= ((OLED_BLOCK_TYPE)1 << ((index + OLED_FONT_WIDTH - 1) / OLED_BLOCK_SIZE));
+    }
+    oled_advance_char();
+}
+
+void oled_write(const char *data, bool invert) {
+    while (*data) {
+        oled_write_char(*data++, invert);
+    }
+}
+
+void oled_write_raw_byte(const char data, uint16_t index) {
+    if (index >= OLED_MATRIX_SIZE) {
+        index -= OLED_MATRIX_SIZE;
+    }
+    if (g_oled_buffer[index] == (uint8_t)data) {
+        return;
+    }
+    g_oled_buffer[index] = data;
+    g_oled_dirty |= ((OLED_BLOCK_TYPE)1 << (index / OLED_BLOCK_SIZE));
+}
+
+void oled_write_raw(const char *data, uint16_t size) {
+    uint16_t cursor_start_index = g_oled_cursor - &g_oled_buffer[0];
+    if ((size + cursor_start_index) > OLED_MATRIX_SIZE) {
+        size = OLED_MATRIX_SIZE - cursor_start_index;
+    }
+    for (uint16_t i = cursor_start_index; i < cursor_start_index + size; i++) {
+        uint8_t c = *data++;
+        if (g_oled_buffer[i] == c) {
+            continue;
+        }
+        g_oled_buffer[i] = c;
+        g_oled_dirty |= ((OLED_BLOCK_TYPE)1 << (i / OLED_BLOCK_SIZE));
+    }
+}
+
+bool oled_on(void) {
+    g_oled_active = true;
+    return g_oled_active;
+}
+
+bool oled_off(void) {
+    g_oled_active = false;
+    return !g_oled_active;
+}
+
+uint8_t oled_max_chars(void) {
+    return OLED_DISPLAY_WIDTH / OLED_FONT_WIDTH;
+}
+
+uint8_t oled_max_lines(void) {
+    return OLED_DISPLAY_HEIGHT / OLED_FONT_HEIGHT;
+}
+
+__attribute__((weak)) bool oled_task_user(void) {
+    return true;
+}
+
+// One pass of the driver's housekeeping, as run from the main loop.
+void oled_task(void) {
+    oled_task_user();
+    oled_render();
+}
+
+// ---------------------------------------------------------------------------
+// Matrix
+//
+// Switches are debounced as QMK's default sym_defer_g does: the matrix takes
+// the raw state once no switch has changed for DEBOUNCE ms. Each change is
+// then processed like a key of the harness' keymap (HOST_KEYCODE) that QMK
+// adds to the report.
+
+matrix_row_t        raw_matrix[MATRIX_ROWS];
+static matrix_row_t g_matrix[MATRIX_ROWS];
+static bool         g_debouncing = false;
+static uint16_t     g_debounce_start;
+
+matrix_row_t matrix_get_row(uint8_t row) {
+    return g_matrix[row];
+}
+
+void host_key(uint8_t row, uint8_t col, bool pressed) {
+    if (pressed) {
+        raw_matrix[row] |= 1 << col;
+    } else {
+        raw_matrix[row] &= ~(1 << col);
+    }
+    g_debouncing     = true;
+    g_debounce_start = timer_read();
+}
+
+__attribute__((weak)) bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    return true;
+}
+
+__attribute__((weak)) void post_process_record_user(uint16_t keycode, keyrecord_t *record) {}
+
+__attribute__((weak)) void matrix_scan_user(void) {}
+
+// matrix_task: scan (calling matrix_scan_user once debounced), then process
+// each key that changed.
+static void matrix_task(void) {
+    matrix_row_t previous[MATRIX_ROWS];
+    memcpy(previous, g_matrix, sizeof(g_matrix));
+    if (g_debouncing && timer_elapsed(g_debounce_start) >= DEBOUNCE) {
+        memcpy(g_matrix, raw_matrix, sizeof(g_matrix));
+        g_debouncing = false;
+    }
+    matrix_scan_user();
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            if (!((previous[row] ^ g_matrix[row]) & (1 << col))) {
+                continue;
+            }
+            uint16_t    keycode = HOST_KEYCODE(row, col);
+            keyrecord_t record  = {.event = {.key = {.row = row, .col = col}, .pressed = g_matrix[row] & (1 << col), .time = timer_read()}};
+            if (!process_record_user(keycode, &record)) {
+                continue;
+            }
+            if (record.event.pressed) {
+                add_key(keycode);
+            } else {
+                del_key(keycode);
+            }
+            send_keyboard_report();
+            post_process_record_user(keycode, &record);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Main loop
+
+__attribute__((weak)) void housekeeping_task_user(void) {}
+
+void host_task(void) {
+    matrix_task();
+    housekeeping_task_user();
+    oled_task();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Harness-side view of the host stand-ins for QMK. Everything the firmware
+// does to the "hardware" is counted here so the benchmark can report it.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "eeprom.h"
+#include "matrix.h"
+#include "oled_driver.h"
+
+struct host_counters {
+    uint32_t hid_frames_in;        // frames delivered to the firmware
+    uint32_t hid_frames_out;       // frames sent with raw_hid_send
+    uint32_t eeprom_bytes_read;    // bytes read from the eeprom
+    uint32_t eeprom_bytes_written; // bytes written to the eeprom
+    uint32_t eeprom_write_cycles;  // page write cycles
+    uint32_t oled_clears;          // oled_clear calls
+    uint32_t oled_render_calls;    // oled_render calls
+    uint32_t oled_blocks_sent;     // dirty blocks pushed to the panel
+    uint32_t key_reports;          // keyboard and consumer reports sent
+    uint64_t busy_us;              // time the firmware spent blocked in waits
+};
+
+extern struct host_counters g_host_counters;
+
+// Reset all counters to zero.
+void host_reset_counters(void);
+// Reset the eeprom to its factory (all 0xff) state.
+void host_eeprom_erase(void);
+// Raw access to the in-memory eeprom.
+uint8_t *host_eeprom(void);
+// Lose power after the given number of further page write cycles, as when the
+// keyboard is unplugged mid-write: later writes never reach the eeprom, until
+// host_eeprom_power_on.
+void host_eeprom_power_cut(uint32_t cycles);
+void host_eeprom_power_on(void);
+// Raw access to the in-memory oled framebuffer.
+const uint8_t *host_oled_buffer(void);
+// Last keycode tapped.
+uint16_t host_last_tap(void);
+// Keys pressed by keyboard reports since the last call, as a host would read
+// them: a < mods key > pair each. Returns the number of pairs.
+uint16_t host_typed(uint8_t *typed, uint16_t max);
+// Last frame sent with raw_hid_send.
+const uint8_t *host_last_hid_reply(void);
+// Virtual clock in microseconds. Waits (including polling the eeprom until a
+// write cycle ends) advance it and count as busy time; host_advance_ms lets
+// idle time pass.
+uint64_t host_clock_us(void);
+void     host_advance_ms(uint32_t ms);
+
+// Open or close the switch at row, col. The change is debounced and processed
+// by the following host_task calls, as QMK would.
+void host_key(uint8_t row, uint8_t col, bool pressed);
+// Keycode the harness reports for the key at row, col.
+#define HOST_KEYCODE(row, col) (0x04 + (row) * MATRIX_COLS + (col))
+
+// One pass of the keyboard main loop (matrix scan, key processing,
+// housekeeping and oled tasks).
+void host_task(void);
+
+// QMK callbacks implemented by the firmware and driven by the harness.
+void keyboard_post_init_user(void);
+void housekeeping_task_user(void);
+void matrix_scan_user(void);
@@ -0,0 +1,30 @@
+#pragma once
+
+// Host stand-in for quantum/action.h.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "action_layer.h"
+#include "keycodes.h"
+
+typedef struct {
+    uint8_t col;
+    uint8_t row;
+} keypos_t;
+
+typedef struct {
+    keypos_t key;
+    bool     pressed;
+    uint16_t time;
+} keyevent_t;
+
+typedef struct {
+    keyevent_t event;
+} keyrecord_t;
+
+bool process_record_user(uint16_t keycode, keyrecord_t *record);
+void post_process_record_user(uint16_t keycode, keyrecord_t *record);
+
+// Press and release a keycode; counted by the harness.
+void tap_code16(uint16_t code);
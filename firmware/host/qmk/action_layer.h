@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for quantum/action_layer.h. Layer state is a plain global that
+// the harness may poke directly or drive through layer_move().
+
+#include <stdint.h>
+
+typedef uint8_t layer_state_t;
+
+extern layer_state_t layer_state;
+
+uint8_t       get_highest_layer(layer_state_t state);
+void          layer_move(uint8_t layer);
+void          layer_state_set(layer_state_t state);
+layer_state_t layer_state_set_user(layer_state_t state);
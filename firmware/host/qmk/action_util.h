@@ -0,0 +1,12 @@
+#pragma once
+
+// Host stand-in for quantum/action_util.h: the keyboard report. The harness
+// records the keys each report presses, in the order a host reads them.
+
+#include <stdint.h>
+
+void add_key(uint8_t key);
+void del_key(uint8_t key);
+void add_weak_mods(uint8_t mods);
+void del_weak_mods(uint8_t mods);
+void send_keyboard_report(void);
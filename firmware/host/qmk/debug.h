@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for quantum/logging/debug.h.
+
+#include <stdbool.h>
+
+extern bool debug_enable;
+extern bool debug_matrix;
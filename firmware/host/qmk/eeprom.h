@@ -0,0 +1,17 @@
+#pragma once
+
+// Host stand-in for platforms/eeprom.h. The block functions are the eeprom
+// driver's (eeprom_24lc256.c), talking to an in-memory 24LC256 on the i2c
+// stand-in; the rest are built on them, as in QMK's eeprom_driver.c.
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t  eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void     eeprom_read_block(void *buf, const void *addr, size_t len);
+void     eeprom_write_byte(uint8_t *addr, uint8_t value);
+void     eeprom_write_word(uint16_t *addr, uint16_t value);
+void     eeprom_write_block(const void *buf, void *addr, size_t len);
+void     eeprom_update_byte(uint8_t *addr, uint8_t value);
+void     eeprom_update_block(const void *buf, void *addr, size_t len);
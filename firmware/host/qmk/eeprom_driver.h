@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in for drivers/eeprom/eeprom_driver.h.
+
+#include <stdbool.h>
+
+#include "eeprom.h"
+
+void eeprom_driver_init(void);
+void eeprom_driver_format(bool erase);
+void eeprom_driver_erase(void);
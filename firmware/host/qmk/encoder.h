@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in for quantum/encoder.h: a single encoder, whose detents the
+// harness delivers by calling encoder_update_user.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NUM_ENCODERS 1
+
+bool encoder_update_user(uint8_t index, bool clockwise);
@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for quantum/keycode_config.h.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    bool nkro;
+} keymap_config_t;
+
+extern keymap_config_t keymap_config;
+
+uint16_t keycode_config(uint16_t keycode);
+uint8_t  mod_config(uint8_t mod);
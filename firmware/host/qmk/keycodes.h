@@ -0,0 +1,17 @@
+#pragma once
+
+// Host stand-in for quantum/keycodes.h; only the ranges the firmware uses.
+
+enum qk_keycode {
+    KC_NO             = 0x0000,
+    KC_TRANSPARENT    = 0x0001,
+    KC_AUDIO_VOL_UP   = 0x00A9,
+    KC_AUDIO_VOL_DOWN = 0x00AA,
+};
+#define KC_TRNS KC_TRANSPARENT
+#define KC_VOLU KC_AUDIO_VOL_UP
+#define KC_VOLD KC_AUDIO_VOL_DOWN
+
+enum qk_keycode_ranges {
+    QK_USER = 0x7E40,
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+// Host stand-in for quantum/matrix.h. QMK generates the matrix size from
+// info.json; the harness sets switches with host_key and debounces them on
+// each host_task.
+
+#include <stdint.h>
+
+#define MATRIX_ROWS 4
+#define MATRIX_COLS 3
+// QMK's default debounce time, in ms (sym_defer_g).
+#define DEBOUNCE 5
+
+typedef uint8_t matrix_row_t;
+
+// Debounced state of a row.
+matrix_row_t matrix_get_row(uint8_t row);
@@ -0,0 +1,40 @@
+#pragma once
+
+// Host stand-in for drivers/oled/oled_driver.h. Models a 128x32 SSD1306 with
+// the QMK driver's buffer, cursor and dirty-block bookkeeping so that render
+// traffic can be measured.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OLED_DISPLAY_WIDTH 128
+#define OLED_DISPLAY_HEIGHT 32
+#define OLED_MATRIX_SIZE (OLED_DISPLAY_HEIGHT / 8 * OLED_DISPLAY_WIDTH)
+#define OLED_BLOCK_TYPE uint16_t
+#define OLED_BLOCK_COUNT (sizeof(OLED_BLOCK_TYPE) * 8)
+#define OLED_BLOCK_SIZE (OLED_MATRIX_SIZE / OLED_BLOCK_COUNT)
+#define OLED_FONT_WIDTH 6
+#define OLED_FONT_HEIGHT 8
+
+typedef enum {
+    OLED_ROTATION_0   = 0,
+    OLED_ROTATION_90  = 1,
+    OLED_ROTATION_180 = 2,
+    OLED_ROTATION_270 = 3,
+} oled_rotation_t;
+
+bool            oled_init(oled_rotation_t rotation);
+oled_rotation_t oled_init_user(oled_rotation_t rotation);
+void            oled_clear(void);
+void            oled_render(void);
+void            oled_set_cursor(uint8_t col, uint8_t line);
+void            oled_write_char(const char data, bool invert);
+void            oled_write(const char *data, bool invert);
+void            oled_write_raw(const char *data, uint16_t size);
+void            oled_write_raw_byte(const char data, uint16_t index);
+bool            oled_on(void);
+bool            oled_off(void);
+uint8_t         oled_max_chars(void);
+uint8_t         oled_max_lines(void);
+void            oled_task(void);
+bool            oled_task_user(void);
@@ -0,0 +1,24 @@
+#pragma once
+
+// Host stand-in for quantum/logging/print.h. As on the device, debug output
+// is compiled out unless CONSOLE_ENABLE is set.
+
+#include "debug.h"
+
+#if defined(CONSOLE_ENABLE)
+#    include <stdio.h>
+#    define dprintf(...)               \
+        do {                           \
+            if (debug_enable) {        \
+                printf(__VA_ARGS__);   \
+            }                          \
+        } while (0)
+#    define dprint(s) dprintf("%s", s)
+#else
+#    define dprintf(...) \
+        do {             \
+        } while (0)
+#    define dprint(s) \
+        do {          \
+        } while (0)
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+// Host stand-in for platforms/progmem.h; flash is ordinary memory.
+
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define strncpy_P strncpy
@@ -0,0 +1,9 @@
+#pragma once
+
+// Host stand-in for quantum/raw_hid.h. Sent frames are captured by the
+// harness (see host_stubs.h).
+
+#include <stdint.h>
+
+void raw_hid_send(uint8_t *data, uint8_t length);
+void raw_hid_receive(uint8_t *data, uint8_t length);
@@ -0,0 +1,10 @@
+#pragma once
+
+// Host stand-in for platforms/timer.h, driven by the harness' virtual clock.
+
+#include <stdint.h>
+
+uint16_t timer_read(void);
+uint32_t timer_read32(void);
+uint16_t timer_elapsed(uint16_t last);
+uint32_t timer_elapsed32(uint32_t last);
@@ -0,0 +1,7 @@
+#pragma once
+
+// Host stand-in for quantum/via.h. The custom config block sits after
+// eeconfig and via's own header, as it does on the device.
+
+#define VIA_EEPROM_MAGIC_ADDR 37
+#define VIA_EEPROM_CUSTOM_CONFIG_ADDR (VIA_EEPROM_MAGIC_ADDR + 4)
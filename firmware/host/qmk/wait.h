@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for platforms/wait.h; waits advance the virtual clock.
+
+#include <stdint.h>
+
+void wait_ms(uint32_t ms);
+void wait_us(uint32_t us);
@@ -1,7 +1,12 @@
 #include "base.h"
 
 #include "config.h"
+#include "encoder_handlers.h"
+#include "latency.h"
+#include "macro_handlers.h"
+#include "oled_handlers.h"
 #include "persistence.h"
+#include "stats.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -26,9 +31,15 @@ void init(void) {
     wait_ms(1000);
     dprint("hi 0v0\n");
 #endif
-    // initialize layer labels
+    uint32_t start = stats_clock_us();
+    // initialize layer labels and macros
     persistence_init();
     g_post_init = 1;
+#if defined(OLED_ENABLE)
+    // later layer changes are shown as they happen.
+    oled_show_layer(get_highest_layer(layer_state));
+#endif
+    stats_record(STAT_BOOT, start);
 }
 
 void keyboard_post_init_user(void) {
@@ -37,6 +48,32 @@ void keyboard_post_init_user(void) {
     }
 }
 
+// Run deferred work from the main loop.
+void housekeeping_task_user(void) {
+    encoder_task();
+    macro_task();
+    persistence_task();
+}
+
+uint32_t g_last_scan = 0; // stats clock at the previous matrix scan
+
+// Time the main loop between matrix scans, and note switches changing for
+// latency samples.
+void matrix_scan_user(void) {
+    uint32_t now = stats_clock_us();
+    if (g_last_scan) {
+        stats_record(STAT_SCAN_INTERVAL, g_last_scan);
+    }
+    g_last_scan = now;
+    latency_scan();
+}
+
+// Write pending changes before rebooting or jumping to the bootloader.
+bool shutdown_user(bool jump_to_bootloader) {
+    flush_user_layer_labels();
+    return true;
+}
+
 // Move to next layer
 void cycle_layer(void) {
     uint8_t curr = get_highest_layer(layer_state);
@@ -46,8 +83,11 @@ void cycle_layer(void) {
     layer_move((curr + 1) % LAYER_COUNT);
 }
 
-// Listen for custom keycode
-bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+// Listen for custom keycode; keys bound to a macro play it instead.
+static bool process_key(uint16_t keycode, keyrecord_t *record) {
+    if (macro_process_key(get_highest_layer(layer_state), record->event.key.row, record->event.key.col, record->event.pressed)) {
+        return false;
+    }
     switch (keycode) {
         case KC_CYCLE_LAYERS:
             if (!record->event.pressed) {
@@ -60,6 +100,22 @@ bool process_record_user(uint16_t keycode, keyrecord_t *record) {
     }
 }
 
+// Time each key event until its report is queued, or it is handled here.
+bool process_record_user(uint16_t keycode, keyrecord_t *record) {
+    latency_key_start(record);
+    if (!process_key(keycode, record)) {
+        // handled here; no report follows.
+        latency_key_end();
+        return false;
+    }
+    return true;
+}
+
+// Runs once the key's report has been queued.
+void post_process_record_user(uint16_t keycode, keyrecord_t *record) {
+    latency_key_end();
+}
+
 uint16_t keycode_config(uint16_t keycode) {
     return keycode;
 }
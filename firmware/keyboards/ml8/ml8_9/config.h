@@ -15,13 +15,51 @@
 #define ENCODER_RESOLUTION 4
 // clang-format on
 
-// Enable external EEPROM
-#define EEPROM_I2C_24LC256
+// Detents are coalesced for ENCODER_WINDOW_MS from the first one, then sent as
+// ENCODER_ACCEL_TAPS[n - 1] taps for n net detents (the last entry for more),
+// so a fast spin moves further per detent without queueing a tap for each.
+#define ENCODER_WINDOW_MS 20
+#define ENCODER_ACCEL_TAPS {1, 2, 4, 6, 8}
+
+// External 24LC256 eeprom, driven by eeprom_24lc256.c
+#define EXTERNAL_EEPROM_BYTE_COUNT 32768
+#define EXTERNAL_EEPROM_PAGE_SIZE 64
+#define EXTERNAL_EEPROM_WRITE_TIME 5 // ms, the most a page write cycle takes
+#define EXTERNAL_EEPROM_I2C_BASE_ADDRESS 0b10100000
+#define EEPROM_SIZE EXTERNAL_EEPROM_BYTE_COUNT
 // reserve 8k for our use
 #define VIA_EEPROM_CUSTOM_CONFIG_SIZE (1 << 13)
 
 // Layer config
 #define LAYER_COUNT 4
+// User labels held in RAM: the layer shown and the most recently used. The
+// rest are read from eeprom when needed; without EEPROM_CFG all are held.
+#define LABEL_CACHE_SIZE 2
+// Labels may hold fields, written {name}, whose values are set over hid and
+// held in RAM only. Up to LABEL_FIELD_COUNT fields hold a value at once.
+#define LABEL_FIELD_COUNT 4
+#define LABEL_FIELD_NAME_SIZE 8   // longest name
+#define LABEL_FIELD_VALUE_SIZE 21 // longest value; a full line
 
 // Enable storing configuration in eeprom
 #define EEPROM_CFG
+// Label changes are written to eeprom once no further change has arrived for
+// PERSIST_QUIET_MS, or at the latest PERSIST_MAX_DELAY_MS after the first.
+#define PERSIST_QUIET_MS 1000
+#define PERSIST_MAX_DELAY_MS 10000
+
+// Macros uploaded over hid are stored in the last MACRO_EEPROM_SIZE bytes of the
+// custom config region, and played back with up to MACRO_KEYS_PER_REPORT keys
+// pressed per report (6 without nkro), a report every MACRO_REPORT_DELAY_MS.
+#define MACRO_COUNT 16
+#define MACRO_EEPROM_SIZE 2048
+#define MACRO_KEYS_PER_REPORT 10
+#define MACRO_REPORT_DELAY_MS 2
+
+// Keep timings of hid, persistence, oled and scan paths; read with
+// HID_CMD_STATS.
+#define STATS_ENABLE
+// Time key events from the switch changing to the report being queued, keeping
+// up to LATENCY_SAMPLES until read with HID_CMD_LATENCY. Needs STATS_ENABLE.
+#define LATENCY_ENABLE
+#define LATENCY_SAMPLES 16
@@ -0,0 +1,15 @@
+#include "crc16.h"
+
+#include <stdint.h>
+
+uint16_t crc16(const void *data, uint16_t len) {
+    const uint8_t *d   = data;
+    uint16_t       crc = 0xffff;
+    while (len--) {
+        crc ^= (uint16_t)*d++ << 8;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xffff) of len bytes.
+uint16_t crc16(const void *data, uint16_t len);
@@ -7,9 +7,8 @@
 
 #include QMK_KEYBOARD_H
 
-#if defined(ENCODER_MAP_ENABLE)
-const uint16_t PROGMEM encoder_map[][NUM_ENCODERS][2] = {[0] = {ENCODER_CCW_CW(KC_VOLU, KC_VOLD)}};
-#endif
+// Volume on every layer; see encoder_handlers.h.
+const uint16_t PROGMEM encoder_map[LAYER_COUNT][NUM_ENCODERS][2] = {[0] = {{KC_VOLU, KC_VOLD}}};
 
 const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {
     // clang-format off
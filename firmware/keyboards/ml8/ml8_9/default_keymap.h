@@ -9,5 +9,5 @@
 // Layer names, for convenience.
 enum layers { L_MEDIA, L_ZOOM, L_MEET, L_TEAMS };
 
-extern const uint16_t PROGMEM encoder_map[][NUM_ENCODERS][2];
+extern const uint16_t PROGMEM encoder_map[LAYER_COUNT][NUM_ENCODERS][2];
 extern const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS];
@@ -0,0 +1,76 @@
+// Eeprom driver for the 24LC256 (EEPROM_DRIVER = custom).
+//
+// QMK's i2c eeprom driver waits out the worst case write cycle
+// (EXTERNAL_EEPROM_WRITE_TIME) after every page it writes. This one returns as
+// soon as a page is sent, and before the next access polls the chip, which
+// does not acknowledge its address until the write cycle is over. Writes
+// therefore take as long as the part really needs, and cost nothing if other
+// work (e.g. rendering the oled on the same bus) runs before the next access.
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "eeprom_driver.h"
+#include "i2c_master.h"
+#include "timer.h"
+
+#define EEPROM_I2C_TIMEOUT 100
+
+bool     g_eeprom_busy        = false; // a write cycle may be in progress
+uint16_t g_eeprom_write_start = 0;     // time the last write cycle started
+
+// Wait for the last write cycle to end, bounded by the datasheet maximum in
+// case the chip does not answer at all.
+static void eeprom_wait_ready(void) {
+    if (!g_eeprom_busy) {
+        return;
+    }
+    while (i2c_ping_address(EXTERNAL_EEPROM_I2C_BASE_ADDRESS, EEPROM_I2C_TIMEOUT) != I2C_STATUS_SUCCESS && timer_elapsed(g_eeprom_write_start) <= EXTERNAL_EEPROM_WRITE_TIME) {
+    }
+    g_eeprom_busy = false;
+}
+
+void eeprom_driver_init(void) {
+    i2c_init();
+}
+
+void eeprom_driver_erase(void) {
+    uint8_t buf[EXTERNAL_EEPROM_PAGE_SIZE];
+    memset(buf, 0x00, sizeof(buf));
+    for (uint16_t addr = 0; addr < EXTERNAL_EEPROM_BYTE_COUNT; addr += EXTERNAL_EEPROM_PAGE_SIZE) {
+        eeprom_write_block(buf, (void *)(uintptr_t)addr, sizeof(buf));
+    }
+}
+
+void eeprom_driver_format(bool erase) {
+    if (erase) {
+        eeprom_driver_erase();
+    }
+}
+
+void eeprom_read_block(void *buf, const void *addr, size_t len) {
+    eeprom_wait_ready();
+    i2c_read_register16(EXTERNAL_EEPROM_I2C_BASE_ADDRESS, (uint16_t)(uintptr_t)addr, buf, len, EEPROM_I2C_TIMEOUT);
+}
+
+// Writes are split on page boundaries, as a page write wraps within its page.
+void eeprom_write_block(const void *buf, void *addr, size_t len) {
+    const uint8_t *src = buf;
+    uint16_t       a   = (uintptr_t)addr;
+    while (len > 0) {
+        uint16_t n = EXTERNAL_EEPROM_PAGE_SIZE - a % EXTERNAL_EEPROM_PAGE_SIZE;
+        if (n > len) {
+            n = len;
+        }
+        eeprom_wait_ready();
+        i2c_write_register16(EXTERNAL_EEPROM_I2C_BASE_ADDRESS, a, src, n, EEPROM_I2C_TIMEOUT);
+        g_eeprom_busy        = true;
+        g_eeprom_write_start = timer_read();
+        a += n;
+        src += n;
+        len -= n;
+    }
+}
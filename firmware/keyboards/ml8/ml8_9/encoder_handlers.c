@@ -0,0 +1,70 @@
+#include "encoder_handlers.h"
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "action.h"
+#include "action_layer.h"
+#include "debug.h"
+#include "keycodes.h"
+#include "print.h"
+#include "timer.h"
+
+// Taps sent for 1, 2, ... detents in a window; the last entry is the most
+// taps sent per window.
+const uint8_t g_encoder_accel[] = ENCODER_ACCEL_TAPS;
+#define ENCODER_ACCEL_STEPS (sizeof(g_encoder_accel) / sizeof(g_encoder_accel[0]))
+
+int8_t   g_encoder_detents[NUM_ENCODERS]; // net detents this window, clockwise positive
+uint16_t g_encoder_window[NUM_ENCODERS];  // timer_read when the window opened
+bool     g_encoder_open[NUM_ENCODERS];    // a window is open; detents may net to 0
+
+uint16_t encoder_keycode(uint8_t index, bool clockwise) {
+    uint8_t  layer = get_highest_layer(layer_state);
+    uint16_t kc    = layer < LAYER_COUNT ? pgm_read_word(&encoder_map[layer][index][clockwise]) : KC_NO;
+    if (kc == KC_NO || kc == KC_TRNS) {
+        kc = pgm_read_word(&encoder_map[0][index][clockwise]);
+    }
+    return kc;
+}
+
+// Called by QMK once per detent. Only counts it; taps are sent from
+// encoder_task so a fast spin becomes a few taps rather than a queue of them.
+bool encoder_update_user(uint8_t index, bool clockwise) {
+    if (index >= NUM_ENCODERS) {
+        return false;
+    }
+    if (!g_encoder_open[index]) {
+        g_encoder_open[index]   = true;
+        g_encoder_window[index] = timer_read();
+    }
+    int8_t d = g_encoder_detents[index];
+    if (clockwise ? d < INT8_MAX : d > INT8_MIN) {
+        g_encoder_detents[index] = clockwise ? d + 1 : d - 1;
+    }
+    return false;
+}
+
+void encoder_task(void) {
+    for (uint8_t i = 0; i < NUM_ENCODERS; i++) {
+        if (!g_encoder_open[i] || timer_elapsed(g_encoder_window[i]) < ENCODER_WINDOW_MS) {
+            continue;
+        }
+        int8_t  d       = g_encoder_detents[i];
+        bool    cw      = d > 0;
+        uint8_t detents = cw ? d : -d;
+        uint8_t taps    = 0;
+        if (detents) {
+            taps = g_encoder_accel[(detents < ENCODER_ACCEL_STEPS ? detents : ENCODER_ACCEL_STEPS) - 1];
+        }
+        dprintf("encoder %d: %d detents, %d taps\n", i, d, taps);
+        uint16_t kc = encoder_keycode(i, cw);
+        while (taps--) {
+            tap_code16(kc);
+        }
+        g_encoder_detents[i] = 0;
+        g_encoder_open[i]    = false;
+    }
+}
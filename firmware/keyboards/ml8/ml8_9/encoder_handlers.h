@@ -0,0 +1,19 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "encoder.h"
+#include "progmem.h"
+
+// Keycodes tapped per encoder and layer, {counter-clockwise, clockwise}.
+// KC_NO and KC_TRNS fall back to layer 0. The map is read by
+// encoder_handlers.c rather than QMK's ENCODER_MAP_ENABLE, which would tap it
+// once per detent.
+extern const uint16_t PROGMEM encoder_map[LAYER_COUNT][NUM_ENCODERS][2];
+
+// Send the detents coalesced over the current window, once it has passed.
+// Called from the main loop.
+void encoder_task(void);
@@ -2,6 +2,12 @@
 
 #define HID_CODE_HEADER 0x6d6c
 
+// Set on a command to mark a sequenced frame: < m l C|SEQ S data... >, where S
+// is the frame's sequence number within the transfer.
+#define HID_FLAG_SEQ 0x80
+// Sequenced frames are acked once per window and on completion.
+#define HID_WINDOW_SIZE 8
+
 enum hid_commands {
     // Basic protocol definitions.
     HID_CMD_NOOP     = 0x00,
@@ -11,16 +17,106 @@ enum hid_commands {
     HID_CMD_CONT     = 0x04,
     HID_CMD_ABORT    = 0x05,
     HID_CMD_COMPLETE = 0x06,
+    HID_CMD_CAPS     = 0x07,
+    // Reply to a frame of a layer update that was not taken until labels are
+    // written out, which the main loop does next: < BUSY cmd >, or
+    // < BUSY cmd seq > for a sequenced frame. Nothing of it was applied; the
+    // host sends it again, with the sequenced frames after it.
+    HID_CMD_BUSY     = 0x08,
 
     // Debug commands; hello and echo
     HID_CMD_HELLO = 0x30, // 0
     HID_CMD_ECHO  = 0x31,
+    // Read timings: < m l STATS id flags > is answered with
+    // < ACK STATS id count struct stat_entry >, where count is the number of
+    // stats.
+    HID_CMD_STATS = 0x32,
+    // Read keypress latency samples: < m l LATENCY > is answered with
+    // < ACK LATENCY count dropped struct latency_sample... >, the count oldest
+    // samples (up to HID_LATENCY_BATCH), which are removed from the device.
+    // dropped counts samples lost since the last read because none was read
+    // in time. Nacked if latency is not recorded.
+    HID_CMD_LATENCY = 0x33,
 
     // Control commands
     HID_CMD_OLED_OFF = 0x40, // @
     HID_CMD_OLED_ON  = 0x41,
+    HID_CMD_FLUSH    = 0x42, // write pending changes to eeprom now
 
     // OLED programming commands
     HID_CMD_OLED_UPDATE = 0x50, // P
     HID_CMD_OLED_RESET  = 0x51,
+    // Update several layers in one transfer; a CONT for a different layer
+    // starts that layer's text. All layers are committed on COMPLETE.
+    HID_CMD_OLED_BULK_UPDATE = 0x52,
+    // Read back layer text: < m l GET layer >, or HID_GET_ALL_LAYERS for all
+    // of them. Each layer's text is streamed as < CONT layer total data... >
+    // frames of HID_GET_CHUNK_SIZE bytes (at least one per layer), followed by
+    // < ACK GET count > once all layers are sent.
+    HID_CMD_OLED_GET = 0x53,
+    // Read the crc16 of every layer's text in one frame:
+    // < ACK HASHES count hash0 hash1 ... state >, little endian, where state
+    // holds HID_STATE_* bits.
+    HID_CMD_OLED_HASHES = 0x54,
+    // Set the value of a label field: < m l FIELD n v name... value... >,
+    // where n and v are the lengths of the name and value. The value is held
+    // in RAM only and only the field's cells are redrawn. An empty value
+    // clears the field. Acked, or nacked if the name or value is too long or
+    // every field is in use.
+    HID_CMD_OLED_FIELD = 0x55,
+    // Stream graphics straight into the display's framebuffer:
+    // < m l FB flags offset_lo offset_hi N rle... >, where the N bytes of
+    // run-length coded data are decoded to the framebuffer from offset on.
+    // Frames are not acked, except the one carrying HID_FB_END, which renders
+    // and is answered with an ack, or a nack if any frame was malformed.
+    // Labels are not drawn until the oled is turned on again.
+    HID_CMD_OLED_FRAMEBUFFER = 0x56,
+
+    // Macro commands; each frame is acked, or nacked if it is invalid.
+    // Upload a macro as < m l BEGIN id layer pos len_lo len_hi >, where the
+    // macro is bound to the key at pos (see MACRO_KEY_POS) on layer, or to no
+    // key if layer is MACRO_UNBOUND, and len is the bytes of its steps. The
+    // steps follow in order as < m l DATA id offset_lo offset_hi N steps... >
+    // of up to HID_MACRO_CHUNK_SIZE bytes; < m l END id > stores the macro.
+    // A macro of no steps deletes the macro.
+    HID_CMD_MACRO_BEGIN = 0x60,
+    HID_CMD_MACRO_DATA  = 0x61,
+    HID_CMD_MACRO_END   = 0x62,
+    HID_CMD_MACRO_ERASE = 0x63, // delete all macros, reclaiming their space
+    HID_CMD_MACRO_PLAY  = 0x64, // < m l PLAY id >
+};
+
+#define HID_GET_ALL_LAYERS 0xff
+#define HID_GET_CHUNK_SIZE 29
+
+// Flags of HID_CMD_OLED_FRAMEBUFFER.
+#define HID_FB_END 0x01 // last frame of an image
+// Run-length coded framebuffer data is a sequence of a control byte C and
+// either C + 1 literal bytes or, if C has HID_FB_RUN set, one byte repeated
+// (C & ~HID_FB_RUN) + 1 times.
+#define HID_FB_RUN 0x80
+#define HID_FB_CHUNK_SIZE 25
+
+// Bytes of name and value that fit a frame after its 5 byte header.
+#define HID_FIELD_DATA_SIZE 27
+
+// Whole steps that fit a frame after its 7 byte header.
+#define HID_MACRO_CHUNK_SIZE 24
+
+// Latency samples that fit a frame after its 4 byte header.
+#define HID_LATENCY_BATCH 4
+
+// Flags of HID_CMD_STATS.
+#define HID_STATS_CLEAR 0x01 // clear the stat once it has been sent
+
+// Capability bits reported by HID_CMD_CAPS.
+enum hid_caps {
+    HID_CAP_WINDOWED = 0x01, // sequenced frames with cumulative acks
+    HID_CAP_STATE    = 0x02, // HID_CMD_OLED_HASHES reports the device state
+};
+
+// Device state bits reported by HID_CMD_OLED_HASHES.
+enum hid_state {
+    HID_STATE_OLED_ON  = 0x01,
+    HID_STATE_OLED_RAW = 0x02, // showing a framebuffer rather than labels
 };
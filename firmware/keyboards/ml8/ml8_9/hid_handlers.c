@@ -6,8 +6,11 @@
 
 #include "config.h"
 #include "hid_codes.h"
+#include "latency.h"
+#include "macro_handlers.h"
 #include "oled_handlers.h"
 #include "persistence.h"
+#include "stats.h"
 
 #include "debug.h"
 #include "print.h"
@@ -18,13 +21,27 @@ struct transfer_state {
     uint8_t     cur_operation; // inflight operation
     uint8_t     cur_layer;     // layer operation applies to
     uint8_t     buffer_offset; // next offset to write to
+    uint8_t     bulk_layers;   // layers staged by an in-flight bulk update
+    uint8_t     next_seq;      // next expected sequence number (windowed)
+    bool        failed;        // windowed transfer failed; drop until restart
+    bool        busy;          // windowed frame next_seq was refused; drop until it is sent again
+    bool        fb_failed;     // a framebuffer frame of the current image was malformed
     oled_text_t buffer;        // buffer to use for chunked operations
 } g_transfer_state;
 
-// Clear transfer state
+// Clear transfer state. Layers staged by an unfinished bulk update are
+// reverted.
 void reset_transfer_state(void) {
+    if (g_transfer_state.bulk_layers) {
+        dprintf("reverting staged layers %d\n", g_transfer_state.bulk_layers);
+        revert_user_layer_labels(g_transfer_state.bulk_layers);
+        g_transfer_state.bulk_layers = 0;
+    }
     g_transfer_state.buffer_offset = 0;
     g_transfer_state.cur_operation = HID_CMD_NOOP;
+    g_transfer_state.next_seq      = 0;
+    g_transfer_state.failed        = false;
+    g_transfer_state.busy          = false;
 }
 
 // Send a nack
@@ -44,17 +61,74 @@ void ack_hid_message(uint8_t cmd) {
     raw_hid_send(buffer, 32);
 }
 
-// Complete an in-flight layer text update.
-void complete_oled_layer_update(void) {
+// Tell the host that the frame was not taken and is to be sent again.
+void busy_hid_message(uint8_t cmd) {
+    dprintf("sending busy for cmd %d\n", cmd);
+    uint8_t buffer[32] = {HID_CMD_BUSY, cmd};
+    raw_hid_send(buffer, 32);
+}
+
+// Send an ack, nack or busy reply for a sequenced frame.
+void reply_seq_hid_message(uint8_t code, uint8_t cmd, uint8_t seq) {
+    dprintf("sending %d for cmd %d seq %d\n", code, cmd, seq);
+    uint8_t buffer[32] = {code, cmd, seq};
+    raw_hid_send(buffer, 32);
+}
+
+// Complete an in-flight layer text update. Returns false, keeping the
+// transfer, if the text has to wait for labels to be written out.
+bool complete_oled_layer_update(void) {
     g_transfer_state.buffer[g_transfer_state.buffer_offset] = '\0';
-    oled_layer_update(g_transfer_state.cur_layer, g_transfer_state.buffer, g_transfer_state.buffer_offset);
+    // the layer was checked on the first frame.
+    if (!oled_layer_update(g_transfer_state.cur_layer, g_transfer_state.buffer, g_transfer_state.buffer_offset)) {
+        return false;
+    }
+    reset_transfer_state();
+    return true;
+}
+
+// Stage the buffered text of the current layer of a bulk update. Staged layers
+// are applied in memory, or staged in eeprom once they have to leave RAM, but
+// only persisted and rendered on completion. Returns false, staging nothing,
+// if that has to wait for labels to be written out: an abort reverts the layer
+// to its persisted label, so a committed change of it is persisted first.
+bool stage_bulk_layer(void) {
+    uint8_t layer = g_transfer_state.cur_layer;
+    if (dirty_user_layer_labels() & ~held_user_layer_labels() & (1 << layer)) {
+        dprintf("layer %d has a change to persist first\n", layer);
+        release_user_layer_labels();
+        return false;
+    }
+    g_transfer_state.buffer[g_transfer_state.buffer_offset] = '\0';
+    if (!oled_layer_set(layer, g_transfer_state.buffer)) {
+        return false;
+    }
+    g_transfer_state.bulk_layers |= 1 << layer;
+    g_transfer_state.buffer_offset = 0;
+    return true;
+}
+
+// Complete an in-flight bulk update, committing all staged layers at once.
+// Returns false, keeping the transfer, if the last layer cannot be staged yet.
+bool complete_bulk_layer_update(void) {
+    if (!stage_bulk_layer()) {
+        return false;
+    }
+    uint8_t layers               = g_transfer_state.bulk_layers;
+    g_transfer_state.bulk_layers = 0;
+    oled_layers_commit(layers);
     reset_transfer_state();
+    return true;
 }
 
 // Begin or continue an oled layer update.
 // oled layer update messages have the following format: < L N data... > where
-// L is the layer number and N is the length of the data that follows.
-bool start_or_continue_oled_layer_update(uint8_t cmd, uint8_t *buffer) {
+// L is the layer number and N is the length of the data that follows. In a
+// bulk update, a CONT for a different layer stages the current layer and
+// starts the next. Returns the reply: HID_CMD_ACK, HID_CMD_NACK if the
+// transfer failed, or HID_CMD_BUSY if the frame was not taken because labels
+// have to be written out first.
+uint8_t start_or_continue_oled_layer_update(uint8_t cmd, uint8_t *buffer) {
     uint8_t layer = buffer[0];
     uint8_t len   = buffer[1];
     dprintf("layer %d; text len %d\n", layer, len);
@@ -62,46 +136,60 @@ bool start_or_continue_oled_layer_update(uint8_t cmd, uint8_t *buffer) {
     if (len > 27) {
         // 32 bytes minus 5 byte header
         dprintf("message malformed; length of %d\n", len);
-        return false;
+        return HID_CMD_NACK;
     }
 
     if (layer < 0 || layer >= LAYER_COUNT) {
         dprintf("invalid layer number %d\n", layer);
-        return false;
+        return HID_CMD_NACK;
     }
 
     // validate command
     switch (cmd) {
         case HID_CMD_OLED_UPDATE:
+        case HID_CMD_OLED_BULK_UPDATE:
             // a new transfer; consider previous aborted.
             dprintf("new transfer; considering any in-flight aborted.\n");
             reset_transfer_state();
-            g_transfer_state.cur_operation = HID_CMD_OLED_UPDATE;
+            if (cmd == HID_CMD_OLED_BULK_UPDATE) {
+                // an abort reverts to the persisted labels, so committed
+                // changes are written before any layer is staged.
+                release_user_layer_labels();
+            }
+            g_transfer_state.cur_operation = cmd;
             break;
 
         case HID_CMD_CONT:
         case HID_CMD_COMPLETE:
             // an inflight transfer; validate that the transfer is known and
             // consistent.
-            if (g_transfer_state.cur_layer != layer) {
+            if (g_transfer_state.cur_operation == HID_CMD_OLED_BULK_UPDATE && cmd == HID_CMD_CONT && g_transfer_state.cur_layer != layer) {
+                dprintf("bulk update moving from layer %d to %d\n", g_transfer_state.cur_layer, layer);
+                if (!stage_bulk_layer()) {
+                    return HID_CMD_BUSY;
+                }
+            } else if (g_transfer_state.cur_layer != layer) {
                 // layer changed mid-transfer!
                 dprintf("layer has changed from %d to %d\n", g_transfer_state.cur_layer, layer);
 
-                return false;
+                return HID_CMD_NACK;
             }
             break;
         default:
             dprintf("unsupported command %d!\n", cmd);
             // TODO here and below: send HID_CMD_ERR
-            return false;
+            return HID_CMD_NACK;
     }
 
     if (cmd == HID_CMD_COMPLETE) {
         dprintf("completing update\n");
         // complete the update
-        complete_oled_layer_update();
+        bool done = g_transfer_state.cur_operation == HID_CMD_OLED_BULK_UPDATE ? complete_bulk_layer_update() : complete_oled_layer_update();
+        if (!done) {
+            return HID_CMD_BUSY;
+        }
         reset_transfer_state();
-        return true;
+        return HID_CMD_ACK;
     }
 
     g_transfer_state.cur_layer = layer;
@@ -109,11 +197,11 @@ bool start_or_continue_oled_layer_update(uint8_t cmd, uint8_t *buffer) {
     if (len < 1) {
         // no data to buffer
         dprintf("empty message\n");
-    } else if (len + g_transfer_state.buffer_offset > sizeof(g_transfer_state.buffer)) {
+    } else if (len + g_transfer_state.buffer_offset >= sizeof(g_transfer_state.buffer)) {
         // TODO move this check when cleaning up code.
-        // too much data to buffer.
+        // too much data to buffer (leaving room for the terminator).
         dprintf("buffered data too large: %d\n", len + g_transfer_state.buffer_offset);
-        return false;
+        return HID_CMD_NACK;
     } else {
         // buffer data
         dprintf("buffering %d bytes...\n", len);
@@ -123,23 +211,74 @@ bool start_or_continue_oled_layer_update(uint8_t cmd, uint8_t *buffer) {
         g_transfer_state.buffer[g_transfer_state.buffer_offset] = '\0';
         dprintf("current buffer: %s\n", g_transfer_state.buffer);
     }
-    return true;
+    return HID_CMD_ACK;
 }
 
 // Handle a hid command that may require multiple rounds.
 void start_or_continue_hid_command(uint8_t cmd, uint8_t *buffer) {
     // Only chunked transfer is oled for now.
-    if (!start_or_continue_oled_layer_update(cmd, buffer)) {
+    uint8_t reply = start_or_continue_oled_layer_update(cmd, buffer);
+    if (reply == HID_CMD_NACK) {
         dprintf("transfer failed\n");
         reset_transfer_state();
         nack_hid_message();
         return;
     }
+    if (reply == HID_CMD_BUSY) {
+        busy_hid_message(cmd);
+        return;
+    }
 
     ack_hid_message(cmd);
     return;
 }
 
+// Handle a sequenced frame of a multi-frame command. Frames must arrive in
+// order; they are acked cumulatively every HID_WINDOW_SIZE frames and on
+// completion, so the host can keep a window of frames in flight. On failure a
+// single nack carrying the expected sequence number is sent and the rest of
+// the transfer is dropped until a new one starts. A frame that is not taken
+// yet is answered with a busy reply carrying its sequence number, and the
+// frames after it are dropped until it is sent again.
+void continue_windowed_hid_command(uint8_t cmd, uint8_t seq, uint8_t *buffer) {
+    if (cmd == HID_CMD_OLED_UPDATE || cmd == HID_CMD_OLED_BULK_UPDATE) {
+        reset_transfer_state();
+    } else if (g_transfer_state.failed) {
+        dprintf("dropping frame %d of failed transfer\n", seq);
+        return;
+    } else if (g_transfer_state.busy && seq != g_transfer_state.next_seq) {
+        dprintf("dropping frame %d after busy frame %d\n", seq, g_transfer_state.next_seq);
+        return;
+    }
+
+    // one byte of the frame is taken by the sequence number.
+    uint8_t reply = seq != g_transfer_state.next_seq || buffer[1] > 26 ? HID_CMD_NACK : start_or_continue_oled_layer_update(cmd, buffer);
+    if (reply == HID_CMD_NACK) {
+        dprintf("windowed transfer failed at seq %d (expected %d)\n", seq, g_transfer_state.next_seq);
+        uint8_t expected = g_transfer_state.next_seq;
+        reset_transfer_state();
+        g_transfer_state.failed = true;
+        reply_seq_hid_message(HID_CMD_NACK, cmd, expected);
+        return;
+    }
+    g_transfer_state.busy = reply == HID_CMD_BUSY;
+    if (g_transfer_state.busy) {
+        reply_seq_hid_message(HID_CMD_BUSY, cmd, seq);
+        return;
+    }
+
+    g_transfer_state.next_seq = seq + 1;
+    if (cmd == HID_CMD_COMPLETE || g_transfer_state.next_seq % HID_WINDOW_SIZE == 0) {
+        reply_seq_hid_message(HID_CMD_ACK, cmd, seq);
+    }
+}
+
+// Report protocol capabilities: < ACK CAPS caps window >
+void hid_caps(void) {
+    uint8_t snd[32] = {HID_CMD_ACK, HID_CMD_CAPS, HID_CAP_WINDOWED | HID_CAP_STATE, HID_WINDOW_SIZE};
+    raw_hid_send(snd, 32);
+}
+
 // Echo a message
 void hid_echo(uint8_t *buffer) {
     uint8_t snd[32];
@@ -159,6 +298,153 @@ void hid_hello(void) {
     raw_hid_send(snd, 32);
 }
 
+// Stream the text of one layer, or all of them, in consecutive frames; the
+// reverse of start_or_continue_oled_layer_update.
+void hid_get_layers(uint8_t *buffer) {
+    uint8_t first = buffer[0];
+    uint8_t last  = buffer[0];
+    if (first == HID_GET_ALL_LAYERS) {
+        first = 0;
+        last  = LAYER_COUNT - 1;
+    } else if (first >= LAYER_COUNT) {
+        dprintf("invalid layer %d\n", first);
+        nack_hid_message();
+        return;
+    }
+    uint8_t     snd[32];
+    oled_text_t buf;
+    for (uint8_t layer = first; layer <= last; layer++) {
+        // labels not held in RAM are read without displacing those that are.
+        const char *txt = peek_user_layer_label(layer, buf);
+        uint8_t     tot = strlen(txt);
+        uint8_t     off = 0;
+        do {
+            uint8_t l = tot - off > HID_GET_CHUNK_SIZE ? HID_GET_CHUNK_SIZE : tot - off;
+            snd[0]    = HID_CMD_CONT;
+            snd[1]    = layer;
+            snd[2]    = tot;
+            memcpy(&snd[3], &txt[off], l);
+            raw_hid_send(snd, 32);
+            off += l;
+        } while (off < tot);
+    }
+    snd[0] = HID_CMD_ACK;
+    snd[1] = HID_CMD_OLED_GET;
+    snd[2] = last - first + 1;
+    raw_hid_send(snd, 32);
+}
+
+_Static_assert(4 + 2 * LAYER_COUNT <= 32, "layer hashes and state must fit in one frame");
+
+// Send the hash of every layer's text and the device state, so a host can
+// tell what differs from a profile in one round trip:
+// < ACK HASHES count hashes... state >
+void hid_layer_hashes(void) {
+    uint8_t         snd[32] = {HID_CMD_ACK, HID_CMD_OLED_HASHES, LAYER_COUNT};
+    const uint16_t *hashes  = user_layer_hashes();
+    for (uint8_t i = 0; i < LAYER_COUNT; i++) {
+        snd[3 + 2 * i] = hashes[i];
+        snd[4 + 2 * i] = hashes[i] >> 8;
+    }
+    snd[3 + 2 * LAYER_COUNT] = oled_state();
+    raw_hid_send(snd, 32);
+}
+
+// Set the value of a label field: < n v name... value... >
+void hid_field(uint8_t *buffer) {
+    uint8_t n = buffer[0], v = buffer[1];
+    if (n + v <= HID_FIELD_DATA_SIZE && oled_field_set((char *)&buffer[2], n, (char *)&buffer[2 + n], v)) {
+        ack_hid_message(HID_CMD_OLED_FIELD);
+    } else {
+        nack_hid_message();
+    }
+}
+
+// Decode a frame of framebuffer data: < flags offset_lo offset_hi N rle... >
+void hid_framebuffer(uint8_t *buffer) {
+#if defined(OLED_ENABLE)
+    uint16_t offset = buffer[1] | buffer[2] << 8;
+    uint8_t  len    = buffer[3];
+    if (len > HID_FB_CHUNK_SIZE || !oled_framebuffer_write(offset, &buffer[4], len)) {
+        dprintf("malformed framebuffer frame at %d\n", offset);
+        g_transfer_state.fb_failed = true;
+    }
+    if (buffer[0] & HID_FB_END) {
+        oled_framebuffer_render();
+        if (g_transfer_state.fb_failed) {
+            g_transfer_state.fb_failed = false;
+            nack_hid_message();
+        } else {
+            ack_hid_message(HID_CMD_OLED_FRAMEBUFFER);
+        }
+    }
+#else
+    nack_hid_message();
+#endif
+}
+
+// Send the stat with the given id: < ACK STATS id count struct stat_entry >
+void hid_stats(uint8_t *buffer) {
+#if defined(STATS_ENABLE)
+    uint8_t                  snd[32] = {HID_CMD_ACK, HID_CMD_STATS, buffer[0], STAT_COUNT};
+    const struct stat_entry *s       = stats_get(buffer[0]);
+    if (!s) {
+        nack_hid_message();
+        return;
+    }
+    memcpy(&snd[4], s, sizeof(*s));
+    raw_hid_send(snd, 32);
+    if (buffer[1] & HID_STATS_CLEAR) {
+        stats_clear(buffer[0]);
+    }
+#else
+    nack_hid_message();
+#endif
+}
+
+// Send the oldest latency samples:
+// < ACK LATENCY count dropped struct latency_sample... >
+void hid_latency(void) {
+#if defined(LATENCY_ENABLE)
+    _Static_assert(4 + HID_LATENCY_BATCH * sizeof(struct latency_sample) <= 32, "latency samples must fit in one frame");
+    struct latency_sample samples[HID_LATENCY_BATCH];
+    uint8_t               snd[32] = {HID_CMD_ACK, HID_CMD_LATENCY};
+    snd[2]                        = latency_take(samples, HID_LATENCY_BATCH, &snd[3]);
+    memcpy(&snd[4], samples, snd[2] * sizeof(samples[0]));
+    raw_hid_send(snd, 32);
+#else
+    nack_hid_message();
+#endif
+}
+
+// Dispatch a macro command: < id args... >
+void hid_macro(uint8_t cmd, uint8_t *buffer) {
+    bool ok = false;
+    switch (cmd) {
+        case HID_CMD_MACRO_BEGIN:
+            ok = macro_begin(buffer[0], buffer[1], buffer[2], buffer[3] | buffer[4] << 8);
+            break;
+        case HID_CMD_MACRO_DATA:
+            ok = buffer[3] <= HID_MACRO_CHUNK_SIZE && macro_write(buffer[0], buffer[1] | buffer[2] << 8, &buffer[4], buffer[3]);
+            break;
+        case HID_CMD_MACRO_END:
+            ok = macro_commit(buffer[0]);
+            break;
+        case HID_CMD_MACRO_ERASE:
+            macros_erase();
+            ok = true;
+            break;
+        case HID_CMD_MACRO_PLAY:
+            ok = macro_play(buffer[0]);
+            break;
+    }
+    if (ok) {
+        ack_hid_message(cmd);
+    } else {
+        nack_hid_message();
+    }
+}
+
 // Given a hid command and associated data, dispatch to handler.
 bool handle_hid_command(int16_t cmd, uint8_t *buffer) {
     bool oled_on = true;
@@ -171,6 +457,18 @@ bool handle_hid_command(int16_t cmd, uint8_t *buffer) {
             hid_echo(buffer);
             break;
 
+        case HID_CMD_CAPS:
+            hid_caps();
+            break;
+
+        case HID_CMD_STATS:
+            hid_stats(buffer);
+            break;
+
+        case HID_CMD_LATENCY:
+            hid_latency();
+            break;
+
         case HID_CMD_OLED_OFF:
             oled_on = false;
             // fallthrough intentional.
@@ -180,13 +478,44 @@ bool handle_hid_command(int16_t cmd, uint8_t *buffer) {
             ack_hid_message(cmd);
             break;
 
+        case HID_CMD_FLUSH:
+            dprintf("flushing pending writes\n");
+            flush_user_layer_labels();
+            ack_hid_message(cmd);
+            break;
+
         case HID_CMD_OLED_RESET:
             dprintf("resetting oled state\n");
             reset_layer_labels();
             ack_hid_message(cmd);
             break;
 
+        case HID_CMD_OLED_GET:
+            hid_get_layers(buffer);
+            break;
+
+        case HID_CMD_OLED_HASHES:
+            hid_layer_hashes();
+            break;
+
+        case HID_CMD_OLED_FIELD:
+            hid_field(buffer);
+            break;
+
+        case HID_CMD_OLED_FRAMEBUFFER:
+            hid_framebuffer(buffer);
+            break;
+
+        case HID_CMD_MACRO_BEGIN:
+        case HID_CMD_MACRO_DATA:
+        case HID_CMD_MACRO_END:
+        case HID_CMD_MACRO_ERASE:
+        case HID_CMD_MACRO_PLAY:
+            hid_macro(cmd, buffer);
+            break;
+
         case HID_CMD_OLED_UPDATE:
+        case HID_CMD_OLED_BULK_UPDATE:
         case HID_CMD_COMPLETE:
         case HID_CMD_CONT:
             dprintf("starting or continuing OLED update; current command %d, inflight "
@@ -228,17 +557,47 @@ int16_t validate_hid_message(uint8_t *data) {
     return cmd;
 }
 
+// Given a sequenced hid command and associated data, dispatch to handler.
+bool handle_sequenced_hid_command(uint8_t cmd, uint8_t seq, uint8_t *buffer) {
+    switch (cmd) {
+        case HID_CMD_OLED_UPDATE:
+        case HID_CMD_OLED_BULK_UPDATE:
+        case HID_CMD_COMPLETE:
+        case HID_CMD_CONT:
+            dprintf("windowed OLED update; current command %d, seq %d\n", cmd, seq);
+            continue_windowed_hid_command(cmd, seq, buffer);
+            break;
+
+        default:
+            dprintf("command %d cannot be sequenced\n", cmd);
+            reply_seq_hid_message(HID_CMD_NACK, cmd, seq);
+            break;
+    }
+
+    return true;
+}
+
 // Returns false iff via should handle the message.
-// Message format is <m l C ...>, where C is a command from hid_codes.h
+// Message format is <m l C ...>, where C is a command from hid_codes.h, or
+// <m l C|SEQ S ...> for sequenced frames.
 bool user_hid_receive(uint8_t *data, uint8_t length) {
     // length is meaningless here, it will always be a 32-byte frame.
     dprintf("received hid message.\n");
-    int16_t cmd = validate_hid_message(data);
+    uint32_t start = stats_clock_us();
+    int16_t  cmd   = validate_hid_message(data);
     if (cmd < 0) {
         // not for us.
         return false;
     }
-    return handle_hid_command(cmd, &data[3]);
+    // commands may write to the eeprom, which must be upgraded first.
+    persistence_upgrade();
+    if (cmd & HID_FLAG_SEQ) {
+        handle_sequenced_hid_command(cmd & ~HID_FLAG_SEQ, data[3], &data[4]);
+    } else {
+        handle_hid_command(cmd, &data[3]);
+    }
+    stats_record(STAT_HID_RECEIVE, start);
+    return true;
 }
 
 #if defined(VIA_ENABLE)
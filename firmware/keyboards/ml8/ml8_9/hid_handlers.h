@@ -1 +1,7 @@
 #pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Handle a raw hid frame. Returns false iff via should handle the message.
+bool user_hid_receive(uint8_t *data, uint8_t length);
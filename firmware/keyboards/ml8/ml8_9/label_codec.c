@@ -0,0 +1,100 @@
+#include "label_codec.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "oled_handlers.h"
+
+// Compressed labels are plain text plus codes for what the grid labels repeat:
+//     0x01-0x02     - an entry of g_dictionary (column separator, padding)
+//     0x80|n c      - n (3-127) copies of c
+//     0x03-0x7f     - that char
+// Labels using other bytes are stored raw.
+#define LABEL_RUN_CODE 0x80
+#define LABEL_RUN_MIN 3
+#define LABEL_RUN_MAX 0x7f
+
+static const char *const g_dictionary[] = {" | ", "  "};
+#define LABEL_DICTIONARY_SIZE (sizeof(g_dictionary) / sizeof(g_dictionary[0]))
+#define LABEL_LITERAL_MIN (1 + LABEL_DICTIONARY_SIZE)
+
+uint8_t label_encode(const char *label, uint8_t *dst) {
+    uint8_t raw_len = strnlen(label, sizeof(oled_text_t) - 1);
+    uint8_t len     = 0;
+    uint8_t i       = 0;
+    while (i < raw_len) {
+        uint8_t c = label[i];
+        if (c < LABEL_LITERAL_MIN || c >= LABEL_RUN_CODE) {
+            // not representable; store as is.
+            break;
+        }
+        uint8_t run = 1;
+        while (i + run < raw_len && label[i + run] == c && run < LABEL_RUN_MAX) {
+            run++;
+        }
+        uint8_t code = 0;
+        for (uint8_t d = 0; run < LABEL_RUN_MIN && d < LABEL_DICTIONARY_SIZE; d++) {
+            if (!strncmp(&label[i], g_dictionary[d], strlen(g_dictionary[d]))) {
+                code = d + 1;
+                break;
+            }
+        }
+        uint8_t size = run >= LABEL_RUN_MIN ? 2 : 1;
+        if (len + size >= raw_len) {
+            // no smaller than the text.
+            break;
+        }
+        if (run >= LABEL_RUN_MIN) {
+            dst[len++] = LABEL_RUN_CODE | run;
+            dst[len++] = c;
+            i += run;
+        } else if (code) {
+            dst[len++] = code;
+            i += strlen(g_dictionary[code - 1]);
+        } else {
+            dst[len++] = c;
+            i++;
+        }
+    }
+    if (i < raw_len) {
+        memcpy(dst, label, raw_len);
+        return LABEL_RAW | raw_len;
+    }
+    return len;
+}
+
+bool label_decode(uint8_t header, const uint8_t *data, oled_text_t label) {
+    uint8_t     len = LABEL_DATA_LENGTH(header);
+    oled_text_t buffer;
+    uint8_t     out = 0;
+    if (len >= sizeof(oled_text_t)) {
+        return false;
+    }
+    if (header & LABEL_RAW) {
+        memcpy(buffer, data, len);
+        out = len;
+        len = 0;
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c & LABEL_RUN_CODE) {
+            uint8_t n = c & ~LABEL_RUN_CODE;
+            if (i + 1 >= len || out + n >= sizeof(oled_text_t)) {
+                return false;
+            }
+            memset(&buffer[out], data[++i], n);
+            out += n;
+        } else if (c >= LABEL_LITERAL_MIN && out + 1 < sizeof(oled_text_t)) {
+            buffer[out++] = c;
+        } else if (c > 0 && c < LABEL_LITERAL_MIN && out + strlen(g_dictionary[c - 1]) < sizeof(oled_text_t)) {
+            memcpy(&buffer[out], g_dictionary[c - 1], strlen(g_dictionary[c - 1]));
+            out += strlen(g_dictionary[c - 1]);
+        } else {
+            return false;
+        }
+    }
+    buffer[out] = '\0';
+    memcpy(label, buffer, out + 1);
+    return true;
+}
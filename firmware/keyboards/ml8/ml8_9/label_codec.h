@@ -0,0 +1,19 @@
+#pragma once
+
+#include "oled_handlers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Labels are stored as a one byte header followed by the label's data. The
+// header holds the length of the data, with LABEL_RAW set if the data is the
+// label's plain text rather than its compressed form.
+#define LABEL_RAW 0x80
+#define LABEL_DATA_LENGTH(header) ((header) & ~LABEL_RAW)
+
+// Compress a label into dst, which must hold sizeof(oled_text_t) bytes.
+// Returns the header for the data written.
+uint8_t label_encode(const char *label, uint8_t *dst);
+// Decompress the data described by header into label. Returns false if the data
+// is malformed, leaving label unchanged.
+bool label_decode(uint8_t header, const uint8_t *data, oled_text_t label);
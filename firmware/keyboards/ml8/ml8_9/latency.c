@@ -0,0 +1,101 @@
+#include "latency.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "action_layer.h"
+#include "macro_handlers.h"
+#include "matrix.h"
+#include "stats.h"
+
+#if defined(LATENCY_ENABLE)
+
+// The matrix as read, before debouncing (quantum/matrix_common.c).
+extern matrix_row_t raw_matrix[MATRIX_ROWS];
+
+matrix_row_t g_latency_matrix[MATRIX_ROWS];  // debounced matrix at the last scan
+matrix_row_t g_latency_pending[MATRIX_ROWS]; // switches changed, not yet reported
+// Low 16 bits of the stats clock at the scan that first saw each switch change.
+uint16_t g_latency_since[MATRIX_ROWS * MATRIX_COLS];
+uint32_t g_latency_scan = 0; // stats clock at the last scan
+
+struct latency_sample g_latency_samples[LATENCY_SAMPLES];
+uint8_t               g_latency_first   = 0; // oldest sample
+uint8_t               g_latency_count   = 0;
+uint8_t               g_latency_dropped = 0;     // saturates at 0xff
+struct latency_sample g_latency_key;             // key event being timed
+bool                  g_latency_open    = false; // whether one is
+
+void latency_scan(void) {
+    uint32_t now   = stats_clock_us();
+    g_latency_scan = now;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+        matrix_row_t debounced = matrix_get_row(row);
+        matrix_row_t changed   = debounced ^ g_latency_matrix[row];
+        matrix_row_t bouncing  = raw_matrix[row] ^ debounced;
+        if (!(changed | bouncing | g_latency_pending[row])) {
+            continue;
+        }
+        for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+            matrix_row_t bit     = (matrix_row_t)1 << col;
+            bool         pending = g_latency_pending[row] & bit;
+            uint16_t    *since   = &g_latency_since[row * MATRIX_COLS + col];
+            if (changed & bit) {
+                // reported now; if it was not seen before, it was debounced
+                // as soon as it was seen.
+                if (!pending) {
+                    *since = now;
+                }
+                g_latency_pending[row] &= ~bit;
+            } else if (bouncing & bit) {
+                if (!pending) {
+                    *since = now;
+                    g_latency_pending[row] |= bit;
+                }
+            } else {
+                // bounced back without being reported.
+                g_latency_pending[row] &= ~bit;
+            }
+        }
+        g_latency_matrix[row] = debounced;
+    }
+}
+
+void latency_key_start(keyrecord_t *record) {
+    uint8_t row = record->event.key.row, col = record->event.key.col;
+    if (row >= MATRIX_ROWS || col >= MATRIX_COLS) {
+        return;
+    }
+    g_latency_key.pos      = MACRO_KEY_POS(row, col);
+    g_latency_key.layer    = get_highest_layer(layer_state) | (record->event.pressed ? 0 : LATENCY_RELEASE);
+    g_latency_key.debounce = (uint16_t)g_latency_scan - g_latency_since[row * MATRIX_COLS + col];
+    g_latency_open         = true;
+}
+
+void latency_key_end(void) {
+    if (!g_latency_open) {
+        return;
+    }
+    g_latency_open  = false;
+    uint32_t report = stats_clock_us() - g_latency_scan;
+    if (g_latency_count == LATENCY_SAMPLES) {
+        if (g_latency_dropped < 0xff) {
+            g_latency_dropped++;
+        }
+        return;
+    }
+    g_latency_key.report = report > 0xffff ? 0xffff : report;
+    g_latency_samples[(g_latency_first + g_latency_count++) % LATENCY_SAMPLES] = g_latency_key;
+}
+
+uint8_t latency_take(struct latency_sample *dst, uint8_t max, uint8_t *dropped) {
+    uint8_t n = 0;
+    for (; n < max && g_latency_count; n++, g_latency_count--) {
+        dst[n]          = g_latency_samples[g_latency_first];
+        g_latency_first = (g_latency_first + 1) % LATENCY_SAMPLES;
+    }
+    *dropped          = g_latency_dropped;
+    g_latency_dropped = 0;
+    return n;
+}
+#endif
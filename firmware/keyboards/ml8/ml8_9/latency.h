@@ -0,0 +1,42 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "action.h"
+
+// Keypress latency, timed from the matrix scan that first sees a switch change
+// to the key's report being queued. Samples are kept in RAM and read in
+// batches with HID_CMD_LATENCY, so timing a key costs a few clock reads and no
+// i/o. Durations are in microseconds, saturating at 0xffff.
+struct latency_sample {
+    uint8_t  pos;      // MACRO_KEY_POS of the key
+    uint8_t  layer;    // highest active layer, LATENCY_RELEASE set on release
+    uint16_t debounce; // first scan seeing the change to the scan reporting it
+    uint16_t report;   // that scan to the report being queued, or the key
+                       // being handled by the firmware (macros, layer cycling)
+};
+
+#define LATENCY_RELEASE 0x80
+
+#if defined(LATENCY_ENABLE)
+#    if !defined(STATS_ENABLE)
+#        error "LATENCY_ENABLE needs the stats clock (STATS_ENABLE)"
+#    endif
+// Note switches changing state; called from matrix_scan_user, once the matrix
+// has been debounced and before its changes are processed.
+void latency_scan(void);
+// Time a key event from process_record_user to its report (latency_key_end,
+// from post_process_record_user) or to being handled without one.
+void latency_key_start(keyrecord_t *record);
+void latency_key_end(void);
+// Move up to max of the oldest samples to dst. Returns how many were moved,
+// and in dropped the samples lost to a full buffer since the last call.
+uint8_t latency_take(struct latency_sample *dst, uint8_t max, uint8_t *dropped);
+#else
+static inline void latency_scan(void) {}
+static inline void latency_key_start(keyrecord_t *record) {}
+static inline void latency_key_end(void) {}
+#endif
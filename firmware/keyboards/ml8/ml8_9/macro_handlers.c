@@ -0,0 +1,294 @@
+#include "macro_handlers.h"
+
+#include "config.h"
+#include "persistence.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "action_util.h"
+#include "debug.h"
+#include "eeprom.h"
+#include "keycode_config.h"
+#include "print.h"
+#include "timer.h"
+
+#if defined(EEPROM_CFG)
+
+// A directory entry per macro, followed by the steps of all macros. Steps are
+// appended after the last macro's, so that a macro is replaced by writing its
+// new steps and then its entry. Once there is no room left, the steps of the
+// macros are moved down over the space of replaced ones.
+//     +--------+ EEPROM_MACRO_START
+//     | entry0 |    - start, length, bound layer and key
+//     |  ...   |
+//     +--------+ EEPROM_MACRO_DATA, first page after the directory
+//     | steps  |    - < mods key > per step
+//     |  ...   |
+//     +--------+ EEPROM_MACRO_END
+struct macro_entry {
+    uint16_t start; // offset of the steps from EEPROM_MACRO_DATA
+    uint16_t len;   // bytes of steps; 0 or 0xffff (erased) if there is no macro
+    uint8_t  layer; // layer of the bound key, or MACRO_UNBOUND
+    uint8_t  pos;   // MACRO_KEY_POS of the bound key
+};
+
+#define EEPROM_MACRO_ENTRY(id) (void *)(uintptr_t)(EEPROM_MACRO_START + (id) * sizeof(struct macro_entry))
+#define EEPROM_MACRO_DATA ((EEPROM_MACRO_START + MACRO_COUNT * sizeof(struct macro_entry) + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE * EEPROM_PAGE_SIZE)
+#define EEPROM_MACRO_DATA_SIZE (EEPROM_MACRO_END - EEPROM_MACRO_DATA)
+#define EEPROM_MACRO_PTR(offset) (void *)(uintptr_t)(EEPROM_MACRO_DATA + (offset))
+#define MACRO_VALID(e) ((e).len && (e).len != 0xffff)
+
+// Steps read from eeprom at a time while playing.
+#define MACRO_CHUNK_STEPS 8
+
+_Static_assert(EEPROM_MACRO_START % EEPROM_PAGE_SIZE == 0 && EEPROM_MACRO_DATA_SIZE > 0, "macros need a page aligned region larger than their directory");
+
+// Key each macro is bound to, as in its entry; layer MACRO_UNBOUND if none.
+struct {
+    uint8_t layer;
+    uint8_t pos;
+} g_macro_keys[MACRO_COUNT];
+
+// Macro being uploaded.
+struct {
+    uint8_t            id; // MACRO_COUNT if none
+    uint16_t           written;
+    struct macro_entry entry;
+} g_macro_upload = {MACRO_COUNT};
+
+// Macro playing, streamed from eeprom a chunk at a time.
+struct {
+    bool              active;
+    uint16_t          next; // offset of the next step to read
+    uint16_t          end;
+    struct macro_step chunk[MACRO_CHUNK_STEPS];
+    uint8_t           pos; // next step in chunk
+    uint8_t           len; // steps in chunk
+    uint8_t           keys[MACRO_KEYS_PER_REPORT];
+    uint8_t           nkeys; // keys held down by the last report
+    uint8_t           mods;  // modifiers held down by the last report
+    uint16_t          last;  // timer_read at the last report
+} g_macro_player;
+
+void macros_init(void) {
+    struct macro_entry e;
+    for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+        eeprom_read_block(&e, EEPROM_MACRO_ENTRY(i), sizeof(e));
+        g_macro_keys[i].layer = MACRO_VALID(e) ? e.layer : MACRO_UNBOUND;
+        g_macro_keys[i].pos   = e.pos;
+    }
+}
+
+void macros_clear(void) {
+    g_macro_player.active = false;
+    g_macro_upload.id     = MACRO_COUNT;
+    for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+        g_macro_keys[i].layer = MACRO_UNBOUND;
+    }
+}
+
+void macros_erase(void) {
+    struct macro_entry e;
+    dprint("erasing macros\n");
+    memset(&e, 0xff, sizeof(e));
+    macros_clear();
+    for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+        eeprom_update_block(&e, EEPROM_MACRO_ENTRY(i), sizeof(e));
+    }
+}
+
+// Bytes of steps up to the end of the last macro's.
+static uint16_t macros_used(void) {
+    struct macro_entry e;
+    uint16_t           used = 0;
+    for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+        eeprom_read_block(&e, EEPROM_MACRO_ENTRY(i), sizeof(e));
+        if (MACRO_VALID(e) && e.start + e.len > used) {
+            used = e.start + e.len;
+        }
+    }
+    return used;
+}
+
+// Move the steps of each macro, lowest first, down to the end of the one
+// before it, then point its entry at them. Steps only move down, so each is
+// read before anything is written over it; a power loss while moving a macro
+// that overlaps its old place leaves it garbled.
+static void macros_compact(void) {
+    struct macro_entry e;
+    uint8_t            buf[MACRO_CHUNK_STEPS * sizeof(struct macro_step)];
+    uint16_t           end = 0;
+    dprint("compacting macros\n");
+    // the macro playing may move.
+    g_macro_player.active = false;
+    for (;;) {
+        uint8_t  next  = MACRO_COUNT;
+        uint16_t start = 0xffff;
+        for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+            eeprom_read_block(&e, EEPROM_MACRO_ENTRY(i), sizeof(e));
+            if (MACRO_VALID(e) && e.start >= end && e.start < start) {
+                next  = i;
+                start = e.start;
+            }
+        }
+        if (next == MACRO_COUNT) {
+            return;
+        }
+        eeprom_read_block(&e, EEPROM_MACRO_ENTRY(next), sizeof(e));
+        if (e.start != end) {
+            for (uint16_t off = 0; off < e.len; off += sizeof(buf)) {
+                uint8_t n = e.len - off < sizeof(buf) ? e.len - off : sizeof(buf);
+                eeprom_read_block(buf, EEPROM_MACRO_PTR(e.start + off), n);
+                eeprom_update_block(buf, EEPROM_MACRO_PTR(end + off), n);
+            }
+            e.start = end;
+            eeprom_update_block(&e, EEPROM_MACRO_ENTRY(next), sizeof(e));
+        }
+        end += e.len;
+    }
+}
+
+bool macro_begin(uint8_t id, uint8_t layer, uint8_t pos, uint16_t len) {
+    uint16_t used;
+    if (id >= MACRO_COUNT || len % sizeof(struct macro_step)) {
+        return false;
+    }
+    // old steps stay intact until the new entry is written.
+    used = macros_used();
+    if (len > EEPROM_MACRO_DATA_SIZE - used) {
+        macros_compact();
+        used = macros_used();
+    }
+    if (len > EEPROM_MACRO_DATA_SIZE - used) {
+        dprintf("no room for macro %d of %u bytes\n", id, len);
+        return false;
+    }
+    g_macro_upload.id          = id;
+    g_macro_upload.written     = 0;
+    g_macro_upload.entry.start = used;
+    g_macro_upload.entry.len   = len;
+    g_macro_upload.entry.layer = layer;
+    g_macro_upload.entry.pos   = pos;
+    return true;
+}
+
+bool macro_write(uint8_t id, uint16_t offset, const uint8_t *data, uint8_t len) {
+    if (id != g_macro_upload.id || offset != g_macro_upload.written || len > g_macro_upload.entry.len - offset) {
+        return false;
+    }
+    eeprom_update_block(data, EEPROM_MACRO_PTR(g_macro_upload.entry.start + offset), len);
+    g_macro_upload.written += len;
+    return true;
+}
+
+bool macro_commit(uint8_t id) {
+    if (id != g_macro_upload.id || g_macro_upload.written != g_macro_upload.entry.len) {
+        return false;
+    }
+    if (g_macro_player.active) {
+        // the entry may be the one playing.
+        g_macro_player.active = false;
+    }
+    eeprom_update_block(&g_macro_upload.entry, EEPROM_MACRO_ENTRY(id), sizeof(g_macro_upload.entry));
+    g_macro_keys[id].layer = g_macro_upload.entry.len ? g_macro_upload.entry.layer : MACRO_UNBOUND;
+    g_macro_keys[id].pos   = g_macro_upload.entry.pos;
+    g_macro_upload.id      = MACRO_COUNT;
+    return true;
+}
+
+bool macro_play(uint8_t id) {
+    struct macro_entry e;
+    if (id >= MACRO_COUNT) {
+        return false;
+    }
+    eeprom_read_block(&e, EEPROM_MACRO_ENTRY(id), sizeof(e));
+    if (!MACRO_VALID(e)) {
+        return false;
+    }
+    dprintf("playing macro %d\n", id);
+    // keys held by a macro that was interrupted are released first.
+    g_macro_player.active = true;
+    g_macro_player.next   = e.start;
+    g_macro_player.end    = e.start + e.len;
+    g_macro_player.pos    = 0;
+    g_macro_player.len    = 0;
+    g_macro_player.last   = timer_read() - MACRO_REPORT_DELAY_MS;
+    return true;
+}
+
+bool macro_playing(void) {
+    return g_macro_player.active || g_macro_player.nkeys || g_macro_player.mods;
+}
+
+bool macro_process_key(uint8_t layer, uint8_t row, uint8_t col, bool pressed) {
+    for (uint8_t i = 0; i < MACRO_COUNT; i++) {
+        if (g_macro_keys[i].layer == layer && g_macro_keys[i].pos == MACRO_KEY_POS(row, col)) {
+            if (pressed) {
+                macro_play(i);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// The next step of the macro playing, read ahead a chunk at a time. Returns
+// false at the end of the macro.
+bool macro_peek(struct macro_step *step) {
+    if (g_macro_player.pos == g_macro_player.len) {
+        uint16_t left = (g_macro_player.end - g_macro_player.next) / sizeof(struct macro_step);
+        if (!left) {
+            return false;
+        }
+        g_macro_player.pos = 0;
+        g_macro_player.len = left < MACRO_CHUNK_STEPS ? left : MACRO_CHUNK_STEPS;
+        eeprom_read_block(g_macro_player.chunk, EEPROM_MACRO_PTR(g_macro_player.next), g_macro_player.len * sizeof(struct macro_step));
+        g_macro_player.next += g_macro_player.len * sizeof(struct macro_step);
+    }
+    *step = g_macro_player.chunk[g_macro_player.pos];
+    return true;
+}
+
+// Reports alternate between pressing keys and releasing them. Consecutive
+// steps with the same modifiers are pressed in one report as long as their
+// keys ascend, as hosts take the keys of a report in usage order.
+void macro_task(void) {
+    struct macro_step step;
+    if (!macro_playing() || timer_elapsed(g_macro_player.last) < MACRO_REPORT_DELAY_MS) {
+        return;
+    }
+    g_macro_player.last = timer_read();
+    if (g_macro_player.nkeys || g_macro_player.mods) {
+        while (g_macro_player.nkeys) {
+            del_key(g_macro_player.keys[--g_macro_player.nkeys]);
+        }
+        del_weak_mods(g_macro_player.mods);
+        g_macro_player.mods = 0;
+        send_keyboard_report();
+        return;
+    }
+    if (!g_macro_player.active || !macro_peek(&step)) {
+        g_macro_player.active = false;
+        return;
+    }
+    // a 6kro report holds no more than 6 keys.
+    uint8_t max  = keymap_config.nkro || MACRO_KEYS_PER_REPORT < 6 ? MACRO_KEYS_PER_REPORT : 6;
+    uint8_t mods = step.mods;
+    do {
+        g_macro_player.pos++;
+        if (step.key) {
+            g_macro_player.keys[g_macro_player.nkeys++] = step.key;
+            add_key(step.key);
+        }
+    } while (step.key && g_macro_player.nkeys < max && macro_peek(&step) && step.mods == mods && step.key > g_macro_player.keys[g_macro_player.nkeys - 1]);
+    if (!mods && !g_macro_player.nkeys) {
+        // a pause.
+        return;
+    }
+    g_macro_player.mods = mods;
+    add_weak_mods(mods);
+    send_keyboard_report();
+}
+#endif
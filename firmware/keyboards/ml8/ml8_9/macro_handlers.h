@@ -0,0 +1,71 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A macro is a sequence of steps, each tapping a key with modifiers held. A step
+// with neither a key nor modifiers pauses for one report. Macros are stored in
+// eeprom and streamed from it while they play.
+struct macro_step {
+    uint8_t mods; // MOD_BIT mask of modifiers held
+    uint8_t key;  // basic keycode (hid usage), or KC_NO for modifiers only
+};
+
+// Binding of a macro that is not bound to a key.
+#define MACRO_UNBOUND 0xff
+// Key position of a binding: < row col >.
+#define MACRO_KEY_POS(row, col) ((row) << 4 | (col))
+
+#if defined(EEPROM_CFG)
+// Read the key bindings; called by persistence_init once the eeprom is known
+// to be current.
+void macros_init(void);
+// Forget all macros without touching eeprom, until an upgrade erases them.
+void macros_clear(void);
+// Delete all macros.
+void macros_erase(void);
+
+// Start uploading len bytes of steps for the given macro, bound to the key at
+// pos on layer (or MACRO_UNBOUND). The steps follow with macro_write, in order;
+// the macro replaces any previous one of that id on macro_commit. The space of
+// replaced macros is reclaimed when needed. Returns false if the id is invalid
+// or the stored macros leave no room.
+bool macro_begin(uint8_t id, uint8_t layer, uint8_t pos, uint16_t len);
+bool macro_write(uint8_t id, uint16_t offset, const uint8_t *data, uint8_t len);
+bool macro_commit(uint8_t id);
+
+// Play a macro; any macro playing is stopped. Returns false if there is none.
+bool macro_play(uint8_t id);
+bool macro_playing(void);
+// Play the macro bound to the given key, if any. Returns true if the key is
+// bound, in which case its key event should not be processed further.
+bool macro_process_key(uint8_t layer, uint8_t row, uint8_t col, bool pressed);
+// Send the next report of the macro playing; called from the main loop.
+void macro_task(void);
+#else
+// Macros live in eeprom; without it there are none.
+static inline void macros_init(void) {}
+static inline void macros_clear(void) {}
+static inline void macros_erase(void) {}
+static inline bool macro_begin(uint8_t id, uint8_t layer, uint8_t pos, uint16_t len) {
+    return false;
+}
+static inline bool macro_write(uint8_t id, uint16_t offset, const uint8_t *data, uint8_t len) {
+    return false;
+}
+static inline bool macro_commit(uint8_t id) {
+    return false;
+}
+static inline bool macro_play(uint8_t id) {
+    return false;
+}
+static inline bool macro_playing(void) {
+    return false;
+}
+static inline bool macro_process_key(uint8_t layer, uint8_t row, uint8_t col, bool pressed) {
+    return false;
+}
+static inline void macro_task(void) {}
+#endif
@@ -4,15 +4,20 @@
 
 #include "base.h"
 #include "config.h"
+#include "crc16.h"
+#include "hid_codes.h"
 #include "persistence.h"
+#include "stats.h"
 
 #include "action_layer.h"
 #include "debug.h"
 #include "oled_driver.h"
 #include "print.h"
+#include "progmem.h"
 
+// System labels live in flash; only the user labels in use are held in RAM.
 // clang-format off
-oled_text_t g_sys_layer_text[LAYER_COUNT] = {
+const char g_sys_layer_text[LAYER_COUNT][sizeof(oled_text_t)] PROGMEM = {
   "Media\nPrev | Play | Next \nStop | Mute | ^\n  <  |   >  | v",
   "Zoom\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
   "Meet\nTalk | Mic  | Video \nFull | Quit | Enter\nHand |      |",
@@ -20,19 +25,167 @@ oled_text_t g_sys_layer_text[LAYER_COUNT] = {
 };
 // clang-format on
 
-uint8_t     g_last_layer = LAYER_COUNT; // Not a valid layer
-oled_text_t g_layer_text[LAYER_COUNT];
-bool        g_oled_on = true;
+// Without eeprom a label dropped from RAM could not be read back.
+#if !defined(EEPROM_CFG)
+#    undef LABEL_CACHE_SIZE
+#    define LABEL_CACHE_SIZE LAYER_COUNT
+#endif
+
+uint8_t     g_last_layer = LAYER_COUNT; // layer shown; LAYER_COUNT if none
+oled_text_t g_label_cache[LABEL_CACHE_SIZE];     // user labels held in RAM
+uint8_t     g_label_cache_age[LABEL_CACHE_SIZE]; // uses of other slots since each slot was used
+uint8_t     g_label_cache_layer[LABEL_CACHE_SIZE] = {[0 ... LABEL_CACHE_SIZE - 1] = LAYER_COUNT}; // layer of each slot; LAYER_COUNT if free
+uint16_t    g_layer_hash[LAYER_COUNT];                        // crc16 of each layer's text
+uint8_t     g_stale_hashes = (1 << LAYER_COUNT) - 1;          // layers whose hash is recomputed when next asked for
+bool        g_oled_on      = true;
+bool        g_oled_raw     = false; // showing framebuffer data rather than labels
+
+// A label field and its value; free if its name is empty.
+struct label_field {
+    char name[LABEL_FIELD_NAME_SIZE + 1];
+    char value[LABEL_FIELD_VALUE_SIZE + 1];
+};
+struct label_field g_fields[LABEL_FIELD_COUNT];
+
+// Text grid of the display: 4 lines of 21 chars.
+#define OLED_COLS 21
+#define OLED_CELLS (4 * OLED_COLS)
+char g_rendered[OLED_CELLS]; // chars last written to each cell of the display
+
+void system_layer_label(uint8_t layer, char *dst) {
+    strncpy_P(dst, g_sys_layer_text[layer], sizeof(oled_text_t));
+}
+
+// Slot holding the given layer's label, or LABEL_CACHE_SIZE if none does.
+uint8_t label_cache_find(uint8_t layer) {
+    uint8_t slot = 0;
+    while (slot < LABEL_CACHE_SIZE && g_label_cache_layer[slot] != layer) {
+        slot++;
+    }
+    return slot;
+}
+
+// Pick a slot for a layer that has none: a free one, or else the least
+// recently used one whose label can be read back from eeprom, sparing the
+// layer shown if another will do. Returns LABEL_CACHE_SIZE if every slot holds
+// a change only in RAM; nothing is written here, see label_cache_slot.
+uint8_t label_cache_victim(void) {
+    uint8_t  victim  = LABEL_CACHE_SIZE;
+    uint16_t best    = 0;
+    uint8_t  unsaved = unsaved_user_layer_labels();
+    for (uint8_t slot = 0; slot < LABEL_CACHE_SIZE; slot++) {
+        uint8_t layer = g_label_cache_layer[slot];
+        if (layer == LAYER_COUNT) {
+            return slot;
+        }
+        uint16_t score = 1 + g_label_cache_age[slot] + (layer != g_last_layer ? 0x100 : 0);
+        if (!(unsaved & (1 << layer)) && score > best) {
+            victim = slot;
+            best   = score;
+        }
+    }
+    return victim;
+}
 
-oled_text_t *system_layer_labels(void) {
-    return g_sys_layer_text;
+// Give the given layer a slot, reading its label into it if load is set.
+// Returns NULL if every slot holds a change only in RAM; they are written out
+// on the next persistence_task, after which one can be given.
+char *label_cache_slot(uint8_t layer, bool load) {
+    uint8_t slot = label_cache_find(layer);
+    if (slot == LABEL_CACHE_SIZE) {
+        slot = label_cache_victim();
+        if (slot == LABEL_CACHE_SIZE) {
+            dprint("label cache full of changes\n");
+            release_user_layer_labels();
+            return NULL;
+        }
+        if (load) {
+            load_user_layer_label(layer, g_label_cache[slot]);
+        }
+        g_label_cache_layer[slot] = layer;
+    }
+    for (uint8_t i = 0; i < LABEL_CACHE_SIZE; i++) {
+        if (g_label_cache_age[i] < 0xff) {
+            g_label_cache_age[i]++;
+        }
+    }
+    g_label_cache_age[slot] = 0;
+    return g_label_cache[slot];
 }
-oled_text_t *user_layer_labels(void) {
-    return g_layer_text;
+
+const char *user_layer_label(uint8_t layer, char *buf) {
+    const char *label = label_cache_slot(layer, true);
+    if (label) {
+        return label;
+    }
+    load_user_layer_label(layer, buf);
+    return buf;
+}
+
+const char *peek_user_layer_label(uint8_t layer, char *buf) {
+    uint8_t slot = label_cache_find(layer);
+    if (slot < LABEL_CACHE_SIZE) {
+        return g_label_cache[slot];
+    }
+    load_user_layer_label(layer, buf);
+    return buf;
+}
+
+const uint16_t *user_layer_hashes(void) {
+    oled_text_t buf;
+    for (uint8_t i = 0; i < LAYER_COUNT; i++) {
+        if (g_stale_hashes & (1 << i)) {
+            const char *label = peek_user_layer_label(i, buf);
+            g_layer_hash[i]   = crc16(label, strlen(label));
+        }
+    }
+    g_stale_hashes = 0;
+    return g_layer_hash;
+}
+
+void oled_layers_reload(uint8_t layers) {
+    for (uint8_t slot = 0; slot < LABEL_CACHE_SIZE; slot++) {
+        if (g_label_cache_layer[slot] < LAYER_COUNT && (layers & (1 << g_label_cache_layer[slot]))) {
+            g_label_cache_layer[slot] = LAYER_COUNT;
+        }
+    }
+    g_stale_hashes |= layers;
+}
+
+// Set the text for the given layer; persisted on the next commit.
+bool oled_layer_set(uint8_t layer, const char *data) {
+    dprintf("updating layer text with string:\n%s\n", data);
+    char *text = label_cache_slot(layer, false);
+    if (!text) {
+        return false;
+    }
+    strncpy(text, data, sizeof(oled_text_t));
+    // ensure dest is terminated
+    text[sizeof(oled_text_t) - 1] = '\0';
+    g_layer_hash[layer] = crc16(text, strlen(text));
+    g_stale_hashes &= ~(1 << layer);
+    mark_user_layer_label_dirty(layer);
+    if (label_cache_victim() == LABEL_CACHE_SIZE) {
+        // write the changes out before another layer needs a slot.
+        release_user_layer_labels();
+    }
+    return true;
+}
+
+// Persist changed layers and redraw the current one if it is among them.
+void oled_layers_commit(uint8_t layers) {
+    commit_user_layer_labels(layers);
+#if defined(OLED_ENABLE)
+    uint8_t curr = get_highest_layer(layer_state);
+    if (curr < LAYER_COUNT && (layers & (1 << curr))) {
+        // only need to update if it's the current layer.
+        oled_update(curr, true);
+    }
+#endif
 }
 
 // Update the text for the given layer.
-void oled_layer_update(uint8_t layer, char *data, uint8_t length) {
+bool oled_layer_update(uint8_t layer, char *data, uint8_t length) {
     // validate that the layer is in scope
     if (layer >= '0') {
         layer -= '0';
@@ -41,64 +194,231 @@ void oled_layer_update(uint8_t layer, char *data, uint8_t length) {
     dprintf("layer: %d\n", layer);
     if (layer < 0 || layer >= LAYER_COUNT) {
         dprint("invalid layer\n");
-        return;
+        return false;
     }
 
-    dprintf("updating layer text with string:\n%s\n", data);
-    strncpy(g_layer_text[layer], data, sizeof(oled_text_t));
-    // ensure dest is terminated
-    g_layer_text[layer][strnlen(data, sizeof(oled_text_t))] = '\0';
-    persist_user_layer_labels();
+    if (!oled_layer_set(layer, data)) {
+        return false;
+    }
+    oled_layers_commit(1 << layer);
+    return true;
+}
+
+// The field named by the len chars at name, or NULL if it has no value.
+struct label_field *label_field_find(const char *name, uint8_t len) {
+    for (uint8_t i = 0; i < LABEL_FIELD_COUNT; i++) {
+        if (g_fields[i].name[0] && !strncmp(g_fields[i].name, name, len) && !g_fields[i].name[len]) {
+            return &g_fields[i];
+        }
+    }
+    return NULL;
+}
+
+// If txt starts a field placeholder, returns its width and sets field to the
+// field it names (NULL if that has no value). Returns 0 otherwise; a
+// placeholder does not span lines.
+uint8_t label_field_at(const char *txt, struct label_field **field) {
+    if (*txt != '{') {
+        return 0;
+    }
+    const char *name = txt + 1;
+    const char *end  = name;
+    while (*end && *end != '}' && *end != '{' && *end != '\n' && *end != '\r') {
+        end++;
+    }
+    if (*end != '}') {
+        return 0;
+    }
+    uint8_t width = end - txt + 1;
+    while (*name == ' ') {
+        name++;
+    }
+    while (end > name && end[-1] == ' ') {
+        end--;
+    }
+    if (end == name || end - name > LABEL_FIELD_NAME_SIZE) {
+        return 0;
+    }
+    *field = label_field_find(name, end - name);
+    return width;
+}
+
+// Whether a label has a placeholder of the given field.
+bool label_has_field(const char *txt, const struct label_field *field) {
+    struct label_field *f;
+    for (; *txt; txt++) {
+        if (label_field_at(txt, &f) && f == field) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool oled_field_set(const char *name, uint8_t name_len, const char *value, uint8_t value_len) {
+    if (!name_len || name_len > LABEL_FIELD_NAME_SIZE || value_len > LABEL_FIELD_VALUE_SIZE) {
+        return false;
+    }
+    struct label_field *f = label_field_find(name, name_len);
+    if (!f) {
+        if (!value_len) {
+            return true;
+        }
+        for (f = g_fields; f < g_fields + LABEL_FIELD_COUNT && f->name[0]; f++) {
+        }
+        if (f == g_fields + LABEL_FIELD_COUNT) {
+            dprint("no free label field\n");
+            return false;
+        }
+        memcpy(f->name, name, name_len);
+        f->name[name_len] = '\0';
+        f->value[0]       = '\0';
+    }
+    if (!strncmp(f->value, value, value_len) && !f->value[value_len]) {
+        return true;
+    }
 #if defined(OLED_ENABLE)
-    if (layer == get_highest_layer(layer_state)) {
-        // only need to update if it's the current layer.
-        oled_update(layer, true);
+    oled_text_t buf;
+    bool        shown = g_oled_on && g_last_layer < LAYER_COUNT && label_has_field(user_layer_label(g_last_layer, buf), f);
+#endif
+    memcpy(f->value, value, value_len);
+    f->value[value_len] = '\0';
+    if (!value_len) {
+        f->name[0] = '\0';
+    }
+#if defined(OLED_ENABLE)
+    if (shown) {
+        // only the field's cells differ from what is shown.
+        oled_update(g_last_layer, true);
     }
 #endif
+    return true;
 }
 
 // To reduce firmware size.
 #if defined(OLED_ENABLE)
 
+// Forget what was rendered after the display was cleared; a cleared cell
+// shows the same as a space.
+void oled_clear_rendered(void) {
+    memset(g_rendered, ' ', sizeof(g_rendered));
+}
+
 oled_rotation_t oled_init_user(oled_rotation_t rotation) {
+    oled_clear_rendered();
     return OLED_ROTATION_180;
 }
 
+// Send dirty blocks to the display.
+void oled_render_timed(void) {
+    uint32_t start = stats_clock_us();
+    oled_render();
+    stats_record(STAT_OLED_RENDER, start);
+}
+
+// Write c to a cell if it differs from what the cell shows. Returns the next
+// cell, wrapping to the top like the driver's cursor.
+uint8_t oled_put_cell(uint8_t cell, char c) {
+    if (g_rendered[cell] != c) {
+        g_rendered[cell] = c;
+        oled_set_cursor(cell % OLED_COLS, cell / OLED_COLS);
+        oled_write_char(c, false);
+    }
+    return (cell + 1) % OLED_CELLS;
+}
+
 // Update OLED display. Update NOW if force_dirty is true.
+// Lays the text out the way oled_write would on a cleared display, but only
+// writes cells that changed, so only their blocks are sent to the panel.
 void oled_update(uint8_t layer, bool force_dirty) {
+    if (g_oled_raw) {
+        // labels are drawn once the oled is back in text mode.
+        return;
+    }
     if (layer < 0 || layer >= LAYER_COUNT) {
         dprintf("Request to render invalid layer\n");
         return;
     }
-    const char *txt = g_layer_text[layer];
-    oled_clear();
-    oled_set_cursor(0, 0);
-    oled_write(txt, false);
+    oled_text_t buf;
+    const char *txt     = user_layer_label(layer, buf);
+    uint8_t     cell    = 0;
+    uint8_t     written = 0; // cells visited, up to a full display
+    for (; *txt; txt++) {
+        // a field shows its value across its placeholder's width; a newline
+        // blanks the rest of the line (all of it at column 0).
+        struct label_field *field;
+        const char         *value = NULL;
+        uint8_t             n     = label_field_at(txt, &field);
+        if (n) {
+            value = field ? field->value : "";
+            txt += n - 1;
+        } else {
+            n = (*txt == '\n' || *txt == '\r') ? OLED_COLS - cell % OLED_COLS : 1;
+        }
+        char c = n == 1 && !value ? *txt : ' ';
+        while (n--) {
+            cell = oled_put_cell(cell, value && *value ? *value++ : c);
+            if (written < OLED_CELLS) {
+                written++;
+            }
+        }
+    }
+    // blank whatever the text did not reach.
+    for (; written < OLED_CELLS; written++) {
+        cell = oled_put_cell(cell, ' ');
+    }
     if (force_dirty) {
-        oled_render();
+        oled_render_timed();
     }
 }
 
-// Periodically update OLED display. Only redraw if the layer has changed.
-bool oled_task_user(void) {
-    if (!is_post_init() || !g_oled_on) {
-        return true;
+bool oled_framebuffer_write(uint16_t offset, const uint8_t *data, uint8_t len) {
+    uint8_t i = 0;
+    g_oled_raw = true;
+    while (i < len) {
+        uint8_t c   = data[i++];
+        uint8_t n   = (c & ~HID_FB_RUN) + 1;
+        bool    run = c & HID_FB_RUN;
+        if (offset + n > OLED_MATRIX_SIZE || i + (run ? 1 : n) > len) {
+            return false;
+        }
+        // the driver only marks blocks whose bytes change as dirty.
+        for (uint8_t j = 0; j < n; j++) {
+            oled_write_raw_byte(data[run ? i : i + j], offset++);
+        }
+        i += run ? 1 : n;
     }
-    // render status
-    uint8_t curr = get_highest_layer(layer_state);
-    if (curr == g_last_layer) {
-        return true;
+    return true;
+}
+
+void oled_framebuffer_render(void) {
+    oled_render_timed();
+}
+
+// Show the given layer's text, unless it is already shown.
+void oled_show_layer(uint8_t layer) {
+    if (!is_post_init() || !g_oled_on || g_oled_raw || layer == g_last_layer) {
+        return;
     }
-    oled_clear();
-    g_last_layer = curr;
+    g_last_layer = layer;
 
-    if (curr < 0 || curr >= LAYER_COUNT) {
+    if (layer < 0 || layer >= LAYER_COUNT) {
         // don't write anything
         dprint("oled; invalid layer...\n");
-        return true;
+        oled_clear();
+        oled_clear_rendered();
+        oled_render_timed();
+        return;
     }
-    oled_update(curr, false);
-    return true;
+    oled_update(layer, true);
+}
+
+// Redraw as soon as the layer changes rather than polling for it in
+// oled_task_user. Only the cells that differ between the layers are written.
+layer_state_t layer_state_set_user(layer_state_t state) {
+    uint32_t start = stats_clock_us();
+    oled_show_layer(get_highest_layer(state));
+    stats_record(STAT_LAYER_SWITCH, start);
+    return state;
 }
 #endif
 
@@ -106,12 +426,24 @@ bool oled_task_user(void) {
 void set_oled_state(bool on) {
     g_oled_on = on;
 #if defined(OLED_ENABLE)
+    if (g_oled_raw) {
+        // back to text mode; the labels are redrawn from scratch.
+        g_oled_raw = false;
+        oled_clear();
+        oled_clear_rendered();
+    }
     if (!on) {
         // clear oled
         oled_clear();
-        oled_render();
+        oled_clear_rendered();
+        oled_render_timed();
     } else {
-        oled_update(get_highest_layer(layer_state), true);
+        g_last_layer = LAYER_COUNT;
+        oled_show_layer(get_highest_layer(layer_state));
     }
 #endif
 }
+
+uint8_t oled_state(void) {
+    return (g_oled_on ? HID_STATE_OLED_ON : 0) | (g_oled_raw ? HID_STATE_OLED_RAW : 0);
+}
@@ -8,12 +8,55 @@
 // OLED supports 4 lines of 21 chars (+4 for newlines and final null terminator)
 typedef char oled_text_t[4 * 21 + 3];
 
-// Update the text for a given layer of the OLED.
-void oled_layer_update(uint8_t layer, char *data, uint8_t length);
+// Update the text for a given layer of the OLED. Returns false if it was not
+// updated: the layer is invalid, or the text has to wait (see oled_layer_set).
+bool oled_layer_update(uint8_t layer, char *data, uint8_t length);
+// Set the text for a given layer without persisting or rendering it; the
+// change is held back from persistence until oled_layers_commit. Returns
+// false, changing nothing, if every label in RAM is a change not written out
+// yet; they are written on the next persistence_task, so it can be set after.
+bool oled_layer_set(uint8_t layer, const char *data);
+// Persist layers changed with oled_layer_set and redraw if the current layer is
+// among them.
+void oled_layers_commit(uint8_t layers);
+// A label may hold field placeholders, written {name}. Each shows the value
+// last set with oled_field_set in its place, left aligned and padded or cut
+// to the placeholder's width; spaces inside the braces make room for longer
+// values, e.g. "Vol {vol  }". A field without a value shows blank.
+// Set the value of a field, held in RAM only, and redraw the layer shown if
+// it has the field. An empty value clears it. Returns false if the name or
+// value is too long, or LABEL_FIELD_COUNT other fields hold values.
+bool oled_field_set(const char *name, uint8_t name_len, const char *value, uint8_t value_len);
 // Update the display, optionally forcing it to be rendered.
 void oled_update(uint8_t layer, bool force_dirty);
+// Show the given layer's text, unless it is already shown. Layer changes are
+// shown through layer_state_set_user.
+void oled_show_layer(uint8_t layer);
+// Decode len bytes of run-length coded data (see HID_FB_RUN) into the
+// framebuffer from offset on, leaving text mode until the oled is turned on
+// again. Returns false if the data is malformed or overruns the framebuffer.
+bool oled_framebuffer_write(uint16_t offset, const uint8_t *data, uint8_t len);
+// Render what was written with oled_framebuffer_write.
+void oled_framebuffer_render(void);
 // Turn on/off the oled.
 void set_oled_state(bool on);
+// HID_STATE_* bits of the oled, as reported by HID_CMD_OLED_HASHES.
+uint8_t oled_state(void);
 
-oled_text_t *system_layer_labels(void);
-oled_text_t *user_layer_labels(void);
+// Forget what is held in RAM of the given layers' (a bitmask) text after it
+// was changed other than through oled_layer_set; it is read again when used.
+void oled_layers_reload(uint8_t layers);
+// CRC-16 of each layer's text, as reported by HID_CMD_OLED_HASHES.
+const uint16_t *user_layer_hashes(void);
+
+// Copy a system layer label, which lives in flash, to dst.
+void system_layer_label(uint8_t layer, char *dst);
+// User labels are held in RAM for LABEL_CACHE_SIZE layers, starting with the
+// one shown; the others are read from persistence when used. Returns the
+// given layer's label, reading it into RAM if it is not there, or into buf if
+// every label in RAM is a change not written out yet. The pointer is only
+// valid until the next call.
+const char *user_layer_label(uint8_t layer, char *buf);
+// Returns the given layer's label if it is in RAM, or else reads it into buf
+// without displacing any other.
+const char *peek_user_layer_label(uint8_t layer, char *buf);
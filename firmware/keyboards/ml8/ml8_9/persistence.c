@@ -1,7 +1,11 @@
 #include "persistence.h"
 
 #include "config.h"
+#include "crc16.h"
+#include "label_codec.h"
+#include "macro_handlers.h"
 #include "oled_handlers.h"
+#include "stats.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -11,28 +15,67 @@
 #include "debug.h"
 #include "eeprom.h"
 #include "print.h"
+#include "timer.h"
 #include "via.h"
 
 #define EEPROM_MAGIC_WORD 0xdead
-#define PERSISTENCE_VERSION 666
+#define PERSISTENCE_VERSION 669
+#define PERSISTENCE_VERSION_FULL_LOG 668
+#define PERSISTENCE_VERSION_RECORDS 667
+#define PERSISTENCE_VERSION_FIXED_SLOTS 666
+// Layers the layout has room for (LAYER_STATE_8BIT allows no more).
+#define EEPROM_LAYER_MAX 8
 #define EEPROM_OLED_VALID_CFG 0x55
-#define EEPROM_OLED_INVALID_CFG 0xff
 
 #define EEPROM_BASE_ADDR (void *)VIA_EEPROM_CUSTOM_CONFIG_ADDR
 #define EEPROM_MAGIC_ADDR (void *)(0 + EEPROM_BASE_ADDR)
 #define EEPROM_VERSION_ADDR (void *)(2 + EEPROM_BASE_ADDR)
 #define EEPROM_OLED_RESTORE_ADDR (void *)(4 + EEPROM_BASE_ADDR)
-#define EEPROM_OLED_CFG_ADDR (void *)(4 + (8 * sizeof(oled_text_t)) + EEPROM_BASE_ADDR)
-
-struct oled_cfg {
-    char valid; // whether the data is valid; set to 0x55
-                // char data_start;
-                // unused; start of data for layers. data is stored
-                // contiguously with the layout d0 d1 d2 ... where
-                // d0 is sizeof(oled_text_t) and contains the data for layer 0 (and so on).
+#define EEPROM_OLED_CFG_ADDR (void *)(4 + (EEPROM_LAYER_MAX * sizeof(oled_text_t)) + EEPROM_BASE_ADDR)
+// Version 667 stored a record per layer in a fixed slot after the valid marker
+// and layer count; version 666 stored plain text right after the marker.
+#define EEPROM_OLED_V667_LAYER_ADDR(layer) (void *)(EEPROM_OLED_CFG_ADDR + 2 + (layer) * sizeof(oled_text_t))
+#define EEPROM_OLED_V666_LAYER_ADDR(layer) (void *)(EEPROM_OLED_CFG_ADDR + 1 + (layer) * sizeof(oled_text_t))
+
+// The log takes the rest of the custom config region up to the macros, in two
+// page aligned halves. The first half is as large as it was in version 668,
+// when the log took the whole region; the second half ends at the macros.
+#define EEPROM_LOG_START ((VIA_EEPROM_CUSTOM_CONFIG_ADDR + 4 + EEPROM_LAYER_MAX * sizeof(oled_text_t) + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE * EEPROM_PAGE_SIZE)
+#define EEPROM_LOG_END EEPROM_MACRO_START
+#define EEPROM_LOG_V668_END EEPROM_MACRO_END
+#define EEPROM_LOG_HALF_SIZE ((EEPROM_LOG_V668_END - EEPROM_LOG_START) / 2 / EEPROM_PAGE_SIZE * EEPROM_PAGE_SIZE)
+#define EEPROM_LOG_HALF_START(half) (uint16_t)(EEPROM_LOG_START + (half) * EEPROM_LOG_HALF_SIZE)
+#define EEPROM_LOG_HALF_END(half) ((half) ? g_log_end : EEPROM_LOG_HALF_START(1))
+#define EEPROM_LOG_PTR(addr) (void *)(uintptr_t)(addr)
+#define EEPROM_LOG_HALF_OF(addr) ((addr) >= EEPROM_LOG_HALF_START(1))
+#define EEPROM_PAGES(len) (((len) + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE)
+// Layer of a record that reverts all layers to the system labels.
+#define EEPROM_LOG_RESET 0xfe
+// Layer of a record whose one data byte is a bitmask of layers; each takes the
+// label of its latest staged record.
+#define EEPROM_LOG_COMMIT 0xfd
+// Set in the layer of a staged record, which is ignored until committed.
+#define EEPROM_LOG_STAGED 0x80
+
+_Static_assert(LAYER_COUNT <= EEPROM_LAYER_MAX, "eeprom layout holds at most EEPROM_LAYER_MAX layers");
+
+struct log_header {
+    uint16_t seq;   // sequence number; one more than the previous record's
+    uint8_t  layer; // layer of the label, or EEPROM_LOG_RESET
+    uint8_t  label; // label_codec header of the data
 };
 
-// EEPROM layout (version 666)
+struct log_record {
+    struct log_header h;
+    uint8_t           data[sizeof(oled_text_t) - 1 + 2]; // label data, then crc
+};
+
+// A commit record: its header, the bitmask of layers and the crc.
+#define EEPROM_LOG_COMMIT_SIZE (sizeof(struct log_header) + 1 + 2)
+
+_Static_assert(EEPROM_LOG_END - EEPROM_LOG_HALF_START(1) >= 2 * LAYER_COUNT * sizeof(struct log_record), "a compacted log, with a staged record per layer, must fit in either half of the log");
+
+// EEPROM layout (version 669)
 //     +--------+ EEPROM_BASE_ADDR/EEPROM_MAGIC_ADDR
 //     |  dead  |    - magic
 //     +--------+ +2
@@ -44,19 +87,53 @@ struct oled_cfg {
 //     | layer1 |
 //     |  ...   |
 //     |  ...   |
+//     +--------+ EEPROM_LOG_START, first page after the restore data
+//     | S L H  |    - record: sequence number, layer, label_codec header,
+//     | data   |      (compressed) data and crc16 of all of it
+//     |  crc   |
+//     | S+1... |    - next record, appended right after, or at the next
+//     |  ...   |      page boundary if it starts a persist
+//     +--------+ EEPROM_LOG_START + EEPROM_LOG_HALF_SIZE
+//     | S L H  |    - second half of the log
 //     |  ...   |
-//     +--------+ +4 + 8*sizeof(oled_text_t)
-//     |   55   |     - valid oled text
-//     | layer0 |     - layer 0 data
-//     |  ...   |
-//     |  ...   |
-//     | layer1 |     - layer 1 data
+//     +--------+ EEPROM_LOG_END/EEPROM_MACRO_START
+//     | macros |    - see macro_handlers.c
 //     |  ...   |
-//     |  ...   |
-//     |        |
-//     |        |
-//     +--------+
+//     +--------+ EEPROM_MACRO_END, last page of the custom config region
 //
+// User labels are never rewritten in place. Each persist appends a record per
+// changed layer to the active half of the log, buffered so that each page is
+// written once. A persist starts on a fresh page when its records would
+// otherwise straddle one more page boundary, so a label costs one write cycle
+// rather than two. The latest intact record of a layer holds its label; a torn
+// append fails its crc, so the layer keeps its previous record. When the
+// active half is full, the current labels are compacted into the start of the
+// other half, leaving the old half intact until that has been written.
+// Changes of an unfinished bulk update are held back from the log. If one has
+// to leave RAM, it is appended as a staged record, with EEPROM_LOG_STAGED set
+// in its layer, which replay ignores until a commit record names the layer, so
+// a bulk update cut off by a power loss leaves nothing behind.
+// Versions 666 and 667 stored labels in fixed slots after a valid marker at
+// EEPROM_OLED_CFG_ADDR; they are migrated on boot. In version 668 the second
+// half of the log ran to the end of the region, where the macros now are.
+
+uint8_t  g_dirty_layers      = 0;     // bitmask of user layers changed since last persist
+uint8_t  g_held_layers       = 0;     // dirty layers not to be persisted until committed
+uint8_t  g_staged_layers     = 0;     // dirty layers whose label is in a staged record, at g_log_staged_addr
+bool     g_persist_pending   = false; // a write of dirty layers is scheduled
+bool     g_release_pending   = false; // labels only in RAM are to be written on the next persistence_task
+uint16_t g_first_change_time = 0;     // time the scheduled write was first requested
+uint16_t g_last_change_time  = 0;     // time of the most recent request
+
+uint16_t g_log_addr                    = EEPROM_LOG_START; // where the next record is appended
+uint8_t  g_log_half                    = 0;                // active half, which g_log_addr may have reached the end of
+uint16_t g_log_seq                     = 0;                // sequence number of the next record
+uint16_t g_log_layer_addr[LAYER_COUNT] = {0};              // latest record of each layer; 0 if none
+uint16_t g_log_staged_addr[LAYER_COUNT];                   // staged record of each layer in g_staged_layers
+uint16_t g_log_end                     = EEPROM_LOG_END;   // end of the second half
+
+uint16_t g_eeprom_version = PERSISTENCE_VERSION; // layout version found at boot, until persistence_upgrade
+uint8_t  g_slot_layers    = 0;                   // layers still in the fixed slots of versions 666 and 667
 
 #if defined(EEPROM_CFG)
 bool eeprom_is_init(void) {
@@ -73,89 +150,462 @@ uint16_t eeprom_version(void) {
     return v;
 }
 
-// Persist system layers. Read upon reset of layer text.
+// Writes are buffered a page at a time, so that each page costs one write
+// cycle however the data falls across pages.
+struct page_writer {
+    uint16_t *addr; // where the buffered bytes end; advanced as bytes are written
+    uint8_t   page[EEPROM_PAGE_SIZE];
+    uint8_t   len; // bytes buffered
+};
+
+void eeprom_page_flush(struct page_writer *w) {
+    if (w->len) {
+        eeprom_write_block(w->page, EEPROM_LOG_PTR(*w->addr - w->len), w->len);
+        w->len = 0;
+    }
+}
+
+void eeprom_page_write(struct page_writer *w, const void *src, uint16_t len) {
+    const uint8_t *s = src;
+    while (len--) {
+        w->page[w->len++] = *s++;
+        if (++*w->addr % EEPROM_PAGE_SIZE == 0) {
+            eeprom_page_flush(w);
+        }
+    }
+}
+
+// Persist system layers as the restore data, which firmware before the system
+// layers moved to flash read upon reset of layer text.
 void eeprom_persist_system_layers(void) {
     // TODO -- config is not really useful/used so far, refactor
     // persistence/recovery for system and user layers.
     dprint("persisting system layer labels...\n");
-    oled_text_t buffer;
-    void       *p = EEPROM_OLED_RESTORE_ADDR;
+    oled_text_t        buffer;
+    uint16_t           addr = (uintptr_t)EEPROM_OLED_RESTORE_ADDR;
+    struct page_writer w    = {.addr = &addr, .len = 0};
     for (int i = 0; i < LAYER_COUNT; i++) {
         dprintf("\tlayer %d\n", i);
-        strncpy(buffer, system_layer_labels()[i], sizeof(buffer));
+        system_layer_label(i, buffer);
         buffer[sizeof(buffer) - 1] = '\0';
-        // write at p, then increment pointer offset
-        eeprom_write_block(buffer, p, sizeof(buffer));
-        p += sizeof(buffer);
+        eeprom_page_write(&w, buffer, sizeof(buffer));
     }
+    eeprom_page_flush(&w);
     dprint("done\n");
 }
 
-// Recover system layers.
-void eeprom_restore_system_layers(void) {
-    oled_text_t buffer;
-    void       *p = EEPROM_OLED_RESTORE_ADDR;
-    dprintf("restoring system layer labels...\n");
+// Read the header of the record at addr. Returns the record's size, or 0 if
+// there cannot be a record there.
+uint8_t eeprom_log_read_header(uint16_t addr, struct log_header *h) {
+    uint16_t end = EEPROM_LOG_HALF_END(EEPROM_LOG_HALF_OF(addr));
+    if (addr + sizeof(*h) > end) {
+        return 0;
+    }
+    eeprom_read_block(h, EEPROM_LOG_PTR(addr), sizeof(*h));
+    uint8_t len = LABEL_DATA_LENGTH(h->label);
+    if (((h->layer & ~EEPROM_LOG_STAGED) >= EEPROM_LAYER_MAX && h->layer != EEPROM_LOG_RESET && h->layer != EEPROM_LOG_COMMIT) || len >= sizeof(oled_text_t) || addr + sizeof(*h) + len + 2 > end) {
+        return 0;
+    }
+    return sizeof(*h) + len + 2;
+}
+
+// Read the record at addr. Returns its size, or 0 if there is no intact
+// record there.
+uint8_t eeprom_log_read(uint16_t addr, struct log_record *r) {
+    if (!eeprom_log_read_header(addr, &r->h)) {
+        return 0;
+    }
+    uint8_t len = LABEL_DATA_LENGTH(r->h.label);
+    eeprom_read_block(r->data, EEPROM_LOG_PTR(addr + sizeof(r->h)), len + 2);
+    uint16_t crc = r->data[len] | r->data[len + 1] << 8;
+    return crc16(r, sizeof(r->h) + len) == crc ? sizeof(r->h) + len + 2 : 0;
+}
+
+// Read the record at addr, or only its header unless data is set.
+uint8_t eeprom_log_read_at(uint16_t addr, struct log_record *r, bool data) {
+    return data ? eeprom_log_read(addr, r) : eeprom_log_read_header(addr, &r->h);
+}
+
+// Read the record at addr if it is the one numbered seq. A batch of records
+// may have been started at the next page boundary instead (see
+// eeprom_log_align), so that is tried too; addr is moved to where the record
+// was found. Returns its size, or 0 if it is in neither place.
+uint8_t eeprom_log_read_next(uint16_t *addr, uint16_t seq, struct log_record *r, bool data) {
+    uint8_t size = eeprom_log_read_at(*addr, r, data);
+    if (size && r->h.seq == seq) {
+        return size;
+    }
+    uint16_t next = EEPROM_PAGES(*addr) * EEPROM_PAGE_SIZE;
+    if (next == *addr) {
+        return 0;
+    }
+    size = eeprom_log_read_at(next, r, data);
+    if (!size || r->h.seq != seq) {
+        return 0;
+    }
+    *addr = next;
+    return size;
+}
+
+// Bytes the records of the given layers take in the log.
+uint16_t eeprom_log_size(uint8_t layers) {
+    struct log_record r;
+    oled_text_t       buf;
+    uint16_t          size = 0;
     for (int i = 0; i < LAYER_COUNT; i++) {
-        dprintf("\tlayer %d\n", i);
-        eeprom_read_block(buffer, p, sizeof(buffer));
-        strncpy(user_layer_labels()[i], buffer, sizeof(oled_text_t));
-        p += sizeof(buffer);
+        if (layers & (1 << i)) {
+            size += sizeof(r.h) + LABEL_DATA_LENGTH(label_encode(peek_user_layer_label(i, buf), r.data)) + 2;
+        }
     }
-    dprint("done\n");
+    return size;
 }
 
-// Persist user layers. Read at start.
-void eeprom_persist_user_layers(void) {
-    oled_text_t     buffer;
-    struct oled_cfg config;
-    void           *p = EEPROM_OLED_CFG_ADDR;
+// Start a batch of size bytes at the next page boundary if that takes fewer
+// write cycles than filling the rest of the current page first. The gap is
+// left unwritten; replay skips it. If that leaves the batch no room in the
+// active half, its first append finds the half full and compacts the log.
+void eeprom_log_align(uint16_t size) {
+    uint16_t left = EEPROM_PAGE_SIZE - g_log_addr % EEPROM_PAGE_SIZE;
+    if (left < EEPROM_PAGE_SIZE && size > left && EEPROM_PAGES(size) < 1 + EEPROM_PAGES(size - left)) {
+        g_log_addr += left;
+    }
+}
 
-    dprint("persisting user layer labels...\n");
-    dprint("\theader...\n");
-    config.valid = EEPROM_OLED_VALID_CFG;
-    eeprom_write_block(&config, p, sizeof(config));
-    p += sizeof(struct oled_cfg);
+// Append r, whose layer and data are filled in, numbering it and adding its
+// crc. Returns false if the active half of the log is full.
+bool eeprom_log_write(struct page_writer *w, struct log_record *r) {
+    r->h.seq    = g_log_seq;
+    uint8_t len = sizeof(r->h) + LABEL_DATA_LENGTH(r->h.label);
+    if (g_log_addr + len + 2 > EEPROM_LOG_HALF_END(g_log_half)) {
+        return false;
+    }
+    uint16_t crc = crc16(r, len);
+    r->data[len - sizeof(r->h)]     = crc;
+    r->data[len - sizeof(r->h) + 1] = crc >> 8;
+    if (r->h.layer == EEPROM_LOG_RESET) {
+        memset(g_log_layer_addr, 0, sizeof(g_log_layer_addr));
+    } else if (r->h.layer == EEPROM_LOG_COMMIT) {
+        for (int i = 0; i < LAYER_COUNT; i++) {
+            if (r->data[0] & (1 << i)) {
+                g_log_layer_addr[i] = g_log_staged_addr[i];
+            }
+        }
+    } else if (r->h.layer & EEPROM_LOG_STAGED) {
+        g_log_staged_addr[r->h.layer & ~EEPROM_LOG_STAGED] = g_log_addr;
+    } else {
+        g_log_layer_addr[r->h.layer] = g_log_addr;
+    }
+    eeprom_page_write(w, r, len + 2);
+    g_log_seq++;
+    return true;
+}
+
+// Append a record of label for the given layer, a staged one if layer has
+// EEPROM_LOG_STAGED set, or a reset if layer is EEPROM_LOG_RESET and label
+// NULL. Returns false if the active half of the log is full.
+bool eeprom_log_append(struct page_writer *w, uint8_t layer, const char *label) {
+    struct log_record r;
+    r.h.layer = layer;
+    r.h.label = label ? label_encode(label, r.data) : 0;
+    return eeprom_log_write(w, &r);
+}
+
+// Append a record committing the staged records of the given layers (a
+// bitmask). Returns false if the active half of the log is full.
+bool eeprom_log_commit(struct page_writer *w, uint8_t layers) {
+    struct log_record r;
+    r.h.layer = EEPROM_LOG_COMMIT;
+    r.h.label = 1;
+    r.data[0] = layers;
+    return eeprom_log_write(w, &r);
+}
+
+// Read the label of the record at addr, which must be of the given layer,
+// staged or not, into dst. Returns false if there is no intact record of the
+// layer there.
+bool eeprom_log_read_label(uint16_t addr, uint8_t layer, char *dst) {
+    struct log_record r;
+    return eeprom_log_read(addr, &r) && (r.h.layer & ~EEPROM_LOG_STAGED) == layer && label_decode(r.h.label, r.data, dst);
+}
+
+// Apply the records from addr on, in sequence and up to the end of its half,
+// to the given layers, finding the latest record of each; a reset reverts them
+// to the system labels, and a staged record only applies once a commit record
+// names its layer. Labels are left to be read when used. Only record headers
+// are read, unless verify is set, when the replay ends at the first record
+// that fails its crc. Leaves the log positioned after the last record, which
+// is stored in last. Returns the layers it held a record or reset for.
+uint8_t eeprom_log_replay(uint16_t addr, uint8_t layers, bool verify, uint16_t *last) {
+    struct log_record r;
+    uint16_t          staged[LAYER_COUNT] = {0};
+    uint8_t           found               = 0;
+    uint8_t           size                = eeprom_log_read_at(addr, &r, verify);
+    uint16_t          seq                 = r.h.seq;
+    uint8_t           half                = EEPROM_LOG_HALF_OF(addr);
+    for (; size && EEPROM_LOG_HALF_OF(addr) == half; size = eeprom_log_read_next(&addr, seq, &r, verify)) {
+        if (r.h.layer == EEPROM_LOG_RESET) {
+            found |= layers;
+            for (int i = 0; i < LAYER_COUNT; i++) {
+                if (layers & (1 << i)) {
+                    g_log_layer_addr[i] = 0;
+                }
+            }
+        } else if (r.h.layer < LAYER_COUNT && (layers & (1 << r.h.layer))) {
+            found |= 1 << r.h.layer;
+            g_log_layer_addr[r.h.layer] = addr;
+        } else if (r.h.layer == EEPROM_LOG_COMMIT && (verify || eeprom_log_read(addr, &r))) {
+            for (int i = 0; i < LAYER_COUNT; i++) {
+                if ((r.data[0] & layers & (1 << i)) && staged[i]) {
+                    found |= 1 << i;
+                    g_log_layer_addr[i] = staged[i];
+                }
+            }
+        } else if ((r.h.layer & EEPROM_LOG_STAGED) && (r.h.layer & ~EEPROM_LOG_STAGED) < LAYER_COUNT) {
+            staged[r.h.layer & ~EEPROM_LOG_STAGED] = addr;
+        }
+        *last = addr;
+        addr += size;
+        seq++;
+    }
+    g_log_addr = addr;
+    g_log_seq  = seq;
+    return found;
+}
+
+// Restore the given user layers. Called at boot.
+// The active half is the one whose first record is newest. If it is missing
+// some of the layers, the compaction into it was torn, and the other half,
+// which was left intact, is the active one. Labels are only located, to be read by eeprom_read_user_layer when used.
+// Unless verify is set, the last record is then read in full; if it is torn,
+// the log is replayed again verifying every record, so that the next append
+// overwrites it.
+void eeprom_restore_user_layers(uint8_t layers, bool verify) {
+    struct log_record r;
+    bool              valid[2];
+    uint16_t          seq[2];
+    uint16_t          last = 0;
+    dprint("looking for user layers in eeprom...\n");
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (layers & (1 << i)) {
+            g_log_layer_addr[i] = 0;
+        }
+    }
+    for (uint8_t half = 0; half < 2; half++) {
+        valid[half] = eeprom_log_read(EEPROM_LOG_HALF_START(half), &r);
+        seq[half]   = r.h.seq;
+    }
+    if (!valid[0] && !valid[1]) {
+        dprintf("no layers to restore\n");
+        g_log_half = 0;
+        g_log_addr = EEPROM_LOG_START;
+        return;
+    }
+    uint8_t active = !valid[0] || (valid[1] && (int16_t)(seq[1] - seq[0]) > 0);
+    dprintf("\treplaying half %d from %u\n", active, seq[active]);
+    g_log_half = active;
+    if (eeprom_log_replay(EEPROM_LOG_HALF_START(active), layers, verify, &last) != layers && valid[!active]) {
+        dprintf("\tcompaction torn; replaying half %d\n", !active);
+        for (int i = 0; i < LAYER_COUNT; i++) {
+            if (layers & (1 << i)) {
+                g_log_layer_addr[i] = 0;
+            }
+        }
+        g_log_half = !active;
+        eeprom_log_replay(EEPROM_LOG_HALF_START(!active), layers, verify, &last);
+    }
+    if (!verify && !eeprom_log_read(last, &r)) {
+        dprint("\tlast record torn\n");
+        eeprom_restore_user_layers(layers, true);
+        return;
+    }
+    dprintf("done!\n");
+}
+
+// Read the given user layer's label into dst, or its system label if it has
+// no record. A layer whose latest record turns out to be damaged is replayed
+// from the active half of the log, which finds its last intact record.
+void eeprom_read_user_layer(uint8_t layer, char *dst) {
+    uint16_t last;
+    dprintf("reading layer %d\n", layer);
+    system_layer_label(layer, dst);
+    if (!g_log_layer_addr[layer] || eeprom_log_read_label(g_log_layer_addr[layer], layer, dst)) {
+        return;
+    }
+    uint16_t addr           = g_log_addr;
+    uint16_t next           = g_log_seq;
+    g_log_layer_addr[layer] = 0;
+    eeprom_log_replay(EEPROM_LOG_HALF_START(g_log_half), 1 << layer, true, &last);
+    g_log_addr = addr;
+    g_log_seq  = next;
+    if (g_log_layer_addr[layer]) {
+        eeprom_log_read_label(g_log_layer_addr[layer], layer, dst);
+    }
+}
+
+// Read the label a compaction writes for the given layer into buf: the
+// label of its record if its change is held, else its current label.
+const char *eeprom_log_compacted_label(uint8_t layer, char *buf) {
+    if (g_held_layers & (1 << layer)) {
+        eeprom_read_user_layer(layer, buf);
+        return buf;
+    }
+    return peek_user_layer_label(layer, buf);
+}
+
+// Write the current labels to the start of the other half of the log, which
+// becomes the active half, followed by staged records of the held layers that
+// are staged or in stage. Every label not in RAM is read once before the
+// other half is written to: a damaged record is replayed then rather than
+// halfway through, and a record found in the other half stops the compaction
+// before it can be overwritten. Returns false if it was stopped, leaving the
+// log as it was. The old half is left intact until the new one is written.
+bool eeprom_log_compact(struct page_writer *w, uint8_t stage) {
+    oled_text_t buf;
+    uint8_t     staged = g_held_layers & (g_staged_layers | stage);
+    dprint("compacting user layer labels...\n");
+    eeprom_page_flush(w);
     for (int i = 0; i < LAYER_COUNT; i++) {
+        eeprom_log_compacted_label(i, buf);
+        if (staged & (1 << i)) {
+            peek_user_layer_label(i, buf);
+        }
+        if ((g_log_layer_addr[i] && EEPROM_LOG_HALF_OF(g_log_layer_addr[i]) != g_log_half) || ((g_staged_layers & (1 << i)) && EEPROM_LOG_HALF_OF(g_log_staged_addr[i]) != g_log_half)) {
+            dprintf("layer %d is in the half to compact into\n", i);
+            return false;
+        }
+    }
+    g_log_half = !g_log_half;
+    g_log_addr = EEPROM_LOG_HALF_START(g_log_half);
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        eeprom_log_append(w, i, eeprom_log_compacted_label(i, buf));
+    }
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (staged & (1 << i)) {
+            eeprom_log_append(w, EEPROM_LOG_STAGED | i, peek_user_layer_label(i, buf));
+        }
+    }
+    return true;
+}
+
+// Persist dirty user layers whose change is not held, and stage the held
+// layers in stage, so that their labels can leave RAM. If some of the layers
+// to persist are staged already, the others are staged too and all of them
+// committed by one record, so that their changes apply together.
+void eeprom_persist_user_layers(uint8_t stage) {
+    struct page_writer w       = {.addr = &g_log_addr, .len = 0};
+    uint8_t            layers  = g_dirty_layers & ~g_held_layers;
+    uint8_t            commit  = layers & g_staged_layers ? layers : 0;
+    uint8_t            staged  = (stage | commit) & ~g_staged_layers;
+    uint8_t            written = 0;
+    bool               full    = false;
+    oled_text_t        buf;
+    dprint("persisting user layer labels...\n");
+    eeprom_log_align(eeprom_log_size((layers & ~commit) | staged) + (commit ? EEPROM_LOG_COMMIT_SIZE : 0));
+    for (int i = 0; i < LAYER_COUNT && !full; i++) {
+        if (!(((layers & ~commit) | staged) & (1 << i))) {
+            continue;
+        }
         dprintf("\tlayer %d...\n", i);
-        strncpy(buffer, user_layer_labels()[i], sizeof(buffer));
-        buffer[sizeof(buffer) - 1] = '\0';
-        eeprom_write_block(buffer, p, sizeof(buffer));
-        p += sizeof(oled_text_t);
+        full = !eeprom_log_append(&w, staged & (1 << i) ? EEPROM_LOG_STAGED | i : i, peek_user_layer_label(i, buf));
+        written |= full ? 0 : 1 << i;
     }
+    full = full || (commit && !eeprom_log_commit(&w, commit));
+    if (full) {
+        // compaction writes every layer and stages the held ones; if it
+        // cannot, only what was appended is kept, uncommitted.
+        if (eeprom_log_compact(&w, stage)) {
+            written = layers | stage;
+        } else {
+            layers &= written & ~commit;
+        }
+    }
+    eeprom_page_flush(&w);
+    g_dirty_layers &= ~layers;
+    g_staged_layers = (g_staged_layers | (written & staged)) & ~layers;
     dprint("done\n");
 }
 
-// Clear persisted user layers. Destory valid marker.
+// Clear persisted user layers. Appends a reset record; user labels must
+// already be dropped from RAM, so that a compaction writes the system labels.
 void eeprom_clear_user_layers(void) {
-    struct oled_cfg config;
-    config.valid = EEPROM_OLED_INVALID_CFG;
-    void *p      = EEPROM_OLED_CFG_ADDR;
+    struct page_writer w = {.addr = &g_log_addr, .len = 0};
     dprintf("voiding user layer labels\n");
-    eeprom_write_block(&config, p, sizeof(config));
+    memset(g_log_layer_addr, 0, sizeof(g_log_layer_addr));
+    if (!eeprom_log_append(&w, EEPROM_LOG_RESET, NULL)) {
+        eeprom_log_compact(&w, 0);
+    }
+    eeprom_page_flush(&w);
     dprintf("done\n");
 }
 
-// Restore user layers. Called on recovery.
-void eeprom_restore_user_layers(void) {
-    oled_text_t     buffer;
-    struct oled_cfg config;
-    void           *p = EEPROM_OLED_CFG_ADDR;
-    dprint("looking for user layers in eeprom...\n");
-    eeprom_read_block(&config, p, sizeof(config));
-    dprintf("\tfound marker %d (wanted %d)\n", config.valid, EEPROM_OLED_VALID_CFG);
-    if (config.valid != EEPROM_OLED_VALID_CFG) {
-        dprintf("no layers to restore\n");
-        return;
+// Check the fixed slots of versions 666 and 667 at boot. Labels are read from
+// them until eeprom_migrate_user_layers writes them to the log.
+void eeprom_read_slots(uint16_t version) {
+    dprintf("reading user layers of version %d...\n", version);
+    bool valid = eeprom_read_byte(EEPROM_OLED_CFG_ADDR) == EEPROM_OLED_VALID_CFG;
+    if (version == PERSISTENCE_VERSION_RECORDS) {
+        valid = valid && eeprom_read_byte(EEPROM_OLED_CFG_ADDR + 1) == LAYER_COUNT;
     }
-    p += sizeof(struct oled_cfg);
+    g_slot_layers = valid ? (1 << LAYER_COUNT) - 1 : 0;
+}
+
+// Read the given layer's label from its fixed slot into dst.
+void eeprom_read_slot(uint16_t version, uint8_t layer, char *dst) {
+    if (version == PERSISTENCE_VERSION_FIXED_SLOTS) {
+        eeprom_read_block(dst, EEPROM_OLED_V666_LAYER_ADDR(layer), sizeof(oled_text_t));
+        dst[sizeof(oled_text_t) - 1] = '\0';
+    } else {
+        uint8_t header = eeprom_read_byte(EEPROM_OLED_V667_LAYER_ADDR(layer));
+        uint8_t data[sizeof(oled_text_t)];
+        system_layer_label(layer, dst);
+        if (LABEL_DATA_LENGTH(header) < sizeof(oled_text_t)) {
+            eeprom_read_block(data, EEPROM_OLED_V667_LAYER_ADDR(layer) + 1, LABEL_DATA_LENGTH(header));
+            label_decode(header, data, dst);
+        }
+    }
+}
+
+// Migrate the user layers found by eeprom_read_slots to the log.
+void eeprom_migrate_user_layers(uint16_t version) {
+    struct page_writer w = {.addr = &g_log_addr, .len = 0};
+    oled_text_t        buf;
+    dprint("migrating user layers...\n");
+    // write the log to the second half, clear of the old slots, so that they
+    // can be migrated again if this is interrupted before the version is.
+    g_log_half = 1;
+    g_log_addr = EEPROM_LOG_HALF_START(1);
     for (int i = 0; i < LAYER_COUNT; i++) {
-        dprintf("\tlayer %d...\n", i);
-        eeprom_read_block(buffer, p, sizeof(oled_text_t));
-        strncpy(user_layer_labels()[i], buffer, sizeof(oled_text_t));
-        p += sizeof(oled_text_t);
+        if (g_slot_layers & (1 << i)) {
+            eeprom_read_slot(version, i, buf);
+            eeprom_log_append(&w, i, buf);
+        }
     }
-    dprintf("done!\n");
+    eeprom_page_flush(&w);
+    g_slot_layers = 0;
+    dprint("done\n");
+}
+
+// Locate the labels of a version 668 log, whose second half ran to the end of
+// the region. It is read as such until eeprom_migrate_full_log.
+void eeprom_read_full_log(void) {
+    dprint("reading user layers of version 668...\n");
+    g_log_end = EEPROM_LOG_V668_END;
+    eeprom_restore_user_layers((1 << LAYER_COUNT) - 1, false);
+}
+
+// Make room for the macros at the end of a version 668 log, read by
+// eeprom_read_full_log. Its second half is compacted into the first half if it
+// reaches into the macros; after that nothing past EEPROM_LOG_END is needed,
+// so the macros can be erased before the version is written.
+void eeprom_migrate_full_log(void) {
+    dprint("migrating user layers from version 668...\n");
+    if (g_log_addr > EEPROM_LOG_END) {
+        struct page_writer w = {.addr = &g_log_addr, .len = 0};
+        eeprom_log_compact(&w, 0);
+        eeprom_page_flush(&w);
+    }
+    g_log_end = EEPROM_LOG_END;
+    dprint("done\n");
 }
 
 // Initialize eeprom
@@ -170,65 +620,217 @@ void eeprom_config_init(uint16_t version) {
     }
     // persist system layers when initializing eeprom
     eeprom_persist_system_layers();
+    g_log_half = 0;
+    g_log_addr = EEPROM_LOG_START;
+    memset(g_log_layer_addr, 0, sizeof(g_log_layer_addr));
+    macros_erase();
+}
+
+// Read what boot needs from an eeprom of an older (or unknown) version. The
+// rest of the upgrade, which writes, is left to persistence_upgrade.
+void eeprom_read_old_version(uint16_t version) {
+    if (version == PERSISTENCE_VERSION_FIXED_SLOTS || version == PERSISTENCE_VERSION_RECORDS) {
+        eeprom_read_slots(version);
+    } else if (version == PERSISTENCE_VERSION_FULL_LOG) {
+        eeprom_read_full_log();
+    } else if (version) {
+        // TODO: migrate persistence.
+        dprint("persistence mismatch!\n");
+    }
+    // the macro region is erased by the upgrade.
+    macros_clear();
 }
 #endif
 
-// Write user layer labels to persistence
-void persist_user_layer_labels(void) {
+// Finish upgrading the eeprom found at boot: write the migrated labels, erase
+// the macros and write the version. Deferred so that boot only reads.
+void persistence_upgrade(void) {
+#if defined(EEPROM_CFG)
+    uint16_t version = g_eeprom_version;
+    if (version == PERSISTENCE_VERSION) {
+        return;
+    }
+    g_eeprom_version = PERSISTENCE_VERSION;
+    if (version == PERSISTENCE_VERSION_FIXED_SLOTS || version == PERSISTENCE_VERSION_RECORDS) {
+        eeprom_migrate_user_layers(version);
+    } else if (version == PERSISTENCE_VERSION_FULL_LOG) {
+        eeprom_migrate_full_log();
+    } else {
+        eeprom_config_init(PERSISTENCE_VERSION);
+        return;
+    }
+    macros_erase();
+    uint16_t v = PERSISTENCE_VERSION;
+    eeprom_write_block(&v, EEPROM_VERSION_ADDR, sizeof(v));
+#endif
+}
+
+void load_user_layer_label(uint8_t layer, char *dst) {
 #if defined(EEPROM_CFG)
-    eeprom_persist_user_layers();
+    uint32_t start = stats_clock_us();
+    if ((g_staged_layers & (1 << layer)) && eeprom_log_read_label(g_log_staged_addr[layer], layer, dst)) {
+        dprintf("read staged layer %d\n", layer);
+    } else if (g_slot_layers & (1 << layer)) {
+        eeprom_read_slot(g_eeprom_version, layer, dst);
+    } else {
+        eeprom_read_user_layer(layer, dst);
+    }
+    stats_record(STAT_LABEL_LOAD, start);
+#else
+    system_layer_label(layer, dst);
+#endif
+}
+
+// Mark a user layer label as changed, to be written on the next persist once
+// it is committed. The label is in RAM, so a staged record no longer holds it.
+void mark_user_layer_label_dirty(uint8_t layer) {
+    if (layer < LAYER_COUNT) {
+        g_dirty_layers |= 1 << layer;
+        g_held_layers |= 1 << layer;
+        g_staged_layers &= ~(1 << layer);
+    }
+}
+
+uint8_t dirty_user_layer_labels(void) {
+    return g_dirty_layers;
+}
+
+uint8_t held_user_layer_labels(void) {
+    return g_held_layers;
+}
+
+uint8_t unsaved_user_layer_labels(void) {
+    return g_dirty_layers & ~g_staged_layers;
+}
+
+void release_user_layer_labels(void) {
+    g_release_pending = true;
+}
+
+void commit_user_layer_labels(uint8_t layers) {
+    g_held_layers &= ~layers;
+    persist_user_layer_labels();
+}
+
+// Write committed changes of user layer labels to persistence now, and stage
+// the held layers in stage.
+void write_user_layer_labels(uint8_t stage) {
+    g_persist_pending = false;
+#if defined(EEPROM_CFG)
+    persistence_upgrade();
+    if ((g_dirty_layers & ~g_held_layers) || stage) {
+        uint32_t start = stats_clock_us();
+        eeprom_persist_user_layers(stage);
+        stats_record(STAT_PERSIST, start);
+    }
 #else
     dprintf("no recovery medium; not persisting.\n");
+    g_dirty_layers &= g_held_layers;
 #endif
 }
 
-void recover_from_in_mem_system_layer_labels(void) {
-    for (int i = 0; i < LAYER_COUNT; i++) {
-        strncpy(user_layer_labels()[i], system_layer_labels()[i], sizeof(oled_text_t));
+// Write changed user layer labels to persistence now.
+void flush_user_layer_labels(void) {
+    write_user_layer_labels(0);
+}
+
+// Schedule changed user layer labels to be written once updates have been
+// quiet for PERSIST_QUIET_MS, so back-to-back updates coalesce into one write.
+void persist_user_layer_labels(void) {
+    if (!(g_dirty_layers & ~g_held_layers)) {
+        return;
+    }
+    uint16_t now = timer_read();
+    if (!g_persist_pending) {
+        g_persist_pending   = true;
+        g_first_change_time = now;
+    }
+    g_last_change_time = now;
+}
+
+// Write out the labels only in RAM if asked to release them. Otherwise flush
+// scheduled writes once updates have been quiet long enough, or have been
+// pending for PERSIST_MAX_DELAY_MS.
+void persistence_task(void) {
+    persistence_upgrade();
+    if (g_release_pending) {
+        g_release_pending = false;
+        dprintf("releasing layers %d\n", unsaved_user_layer_labels());
+        write_user_layer_labels(unsaved_user_layer_labels() & g_held_layers);
+        return;
+    }
+    if (!g_persist_pending) {
+        return;
     }
+    if (timer_elapsed(g_last_change_time) >= PERSIST_QUIET_MS || timer_elapsed(g_first_change_time) >= PERSIST_MAX_DELAY_MS) {
+        dprintf("flushing layers %d\n", g_dirty_layers);
+        flush_user_layer_labels();
+    }
+}
+
+void revert_user_layer_labels(uint8_t layers) {
+    g_dirty_layers &= ~layers;
+    g_held_layers &= ~layers;
+    g_staged_layers &= ~layers;
+    oled_layers_reload(layers);
+#if !defined(EEPROM_CFG)
+    dprintf("no recovery medium; using default.\n");
+#endif
 }
 
 // Restore user layer labels from persistence
 void restore_user_layer_labels(void) {
+    oled_layers_reload((1 << LAYER_COUNT) - 1);
 #if defined(EEPROM_CFG)
-    eeprom_restore_user_layers();
+    eeprom_restore_user_layers((1 << LAYER_COUNT) - 1, false);
     oled_update(get_highest_layer(layer_state), true);
 #else
     dprintf("no recovery medium; using default.\n");
-    recover_from_in_mem_system_layer_labels();
 #endif
 }
 
 // Reset layer labels to initial values
 void reset_layer_labels(void) {
-    // reset to initial config.
+    // reset to initial config; pending changes are dropped.
+    g_dirty_layers    = 0;
+    g_held_layers     = 0;
+    g_staged_layers   = 0;
+    g_persist_pending = false;
+    g_release_pending = false;
+    oled_layers_reload((1 << LAYER_COUNT) - 1);
 #if defined(EEPROM_CFG)
-    eeprom_restore_system_layers();
-    oled_update(get_highest_layer(layer_state), true);
     eeprom_clear_user_layers();
+    oled_update(get_highest_layer(layer_state), true);
 #else
     dprintf("no recover medium; using default.\n");
-    recover_from_in_mem_system_layer_labels();
 #endif
 }
 
 void persistence_init(void) {
-    recover_from_in_mem_system_layer_labels();
+    // labels are read as they are used; changes not persisted are gone.
+    g_dirty_layers    = 0;
+    g_held_layers     = 0;
+    g_staged_layers   = 0;
+    g_persist_pending = false;
+    g_release_pending = false;
+    oled_layers_reload((1 << LAYER_COUNT) - 1);
 
 #if defined(EEPROM_CFG)
+    memset(g_log_layer_addr, 0, sizeof(g_log_layer_addr));
+    g_slot_layers = 0;
     // check if eeprom is initialized.
+    g_eeprom_version = 0;
     if (eeprom_is_init()) {
         dprint("eeprom initialized!\n");
-        uint16_t version = eeprom_version();
-        if (version != PERSISTENCE_VERSION) {
-            // TODO: migrate persistence.
-            dprint("persistence mismatch!\n");
-            eeprom_config_init(PERSISTENCE_VERSION);
-        } else {
-            eeprom_restore_user_layers();
-        }
+        g_eeprom_version = eeprom_version();
+    }
+    if (g_eeprom_version == PERSISTENCE_VERSION) {
+        // only the active layer's label is needed to show something; the
+        // others are read as they are first used.
+        eeprom_restore_user_layers((1 << LAYER_COUNT) - 1, false);
+        macros_init();
     } else {
-        eeprom_config_init(PERSISTENCE_VERSION);
+        eeprom_read_old_version(g_eeprom_version);
     }
 #endif
 }
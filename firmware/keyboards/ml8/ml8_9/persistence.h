@@ -1,6 +1,57 @@
 #pragma once
 
+#include "config.h"
+
+#include <stdint.h>
+
+#include "via.h"
+
+#if defined(EXTERNAL_EEPROM_PAGE_SIZE)
+#    define EEPROM_PAGE_SIZE EXTERNAL_EEPROM_PAGE_SIZE
+#else
+#    define EEPROM_PAGE_SIZE 64 // 24LC256
+#endif
+
+// Macros take the last MACRO_EEPROM_SIZE bytes of the custom config region;
+// labels take the rest.
+#define EEPROM_MACRO_END ((VIA_EEPROM_CUSTOM_CONFIG_ADDR + VIA_EEPROM_CUSTOM_CONFIG_SIZE) / EEPROM_PAGE_SIZE * EEPROM_PAGE_SIZE)
+#define EEPROM_MACRO_START (EEPROM_MACRO_END - MACRO_EEPROM_SIZE)
+
+// Mark a user layer label as changed; persist_user_layer_labels writes only
+// changed layers. The change is held back until commit_user_layer_labels.
+void mark_user_layer_label_dirty(uint8_t layer);
+// Layers (a bitmask) whose label has changed since it was persisted.
+uint8_t dirty_user_layer_labels(void);
+// Changed layers (a bitmask) that are not committed yet.
+uint8_t held_user_layer_labels(void);
+// Changed layers (a bitmask) whose label is only in RAM, so must stay there.
+uint8_t unsaved_user_layer_labels(void);
+// Write the labels only in RAM on the next persistence_task, so that they can
+// leave RAM: committed changes are persisted, and held ones staged in eeprom,
+// where boot ignores them until they are committed.
+void release_user_layer_labels(void);
+// Commit the changes of the given layers (a bitmask) and schedule them to be
+// written.
+void commit_user_layer_labels(uint8_t layers);
+
 void persist_system_layer_labels(void);
+// Schedule committed changes of user layer labels to be written after
+// PERSIST_QUIET_MS.
 void persist_user_layer_labels(void);
+// Write committed changes of user layer labels now.
+void flush_user_layer_labels(void);
+// Run scheduled writes; called from the housekeeping task.
+void persistence_task(void);
+// Discard changes to the given layers (a bitmask) that were not persisted,
+// reloading them from persistence.
+void revert_user_layer_labels(uint8_t layers);
 void reset_layer_labels(void);
+// Read the label of the given user layer into dst: its staged label if it has
+// one, else the persisted one, or its system label if none was persisted.
+void load_user_layer_label(uint8_t layer, char *dst);
+// Finish an upgrade of the eeprom found at boot, which is deferred so that
+// boot only reads; called before anything writes to the eeprom.
+void persistence_upgrade(void);
+// Boot only locates each layer's label; it is read when the layer is shown or
+// its label is requested.
 void persistence_init(void);
@@ -9,8 +9,9 @@ EXTRAKEY_ENABLE = yes
 CONSOLE_ENABLE = yes
 DEBUG_EEPROM_OUTPUT = yes
 
-# enable external eeprom
-EEPROM_DRIVER = i2c
+# enable external eeprom, with our own driver (eeprom_24lc256.c)
+EEPROM_DRIVER = custom
+I2C_DRIVER_REQUIRED = yes
 
 # disable unused features
 AUDIO_ENABLE   = no
@@ -23,4 +24,4 @@ AUDIO_ENABLE = no
 AVR_USE_MINIMAL_PRINTF = yes
 
 # include all sources
-SRC += base.c hid_handlers.c oled_handlers.c persistence.c
+SRC += base.c crc16.c eeprom_24lc256.c encoder_handlers.c hid_handlers.c label_codec.c latency.c macro_handlers.c oled_handlers.c persistence.c stats.c
@@ -0,0 +1,68 @@
+#include "stats.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "timer.h"
+
+#if defined(STATS_ENABLE)
+
+struct stat_entry g_stats[STAT_COUNT];
+
+#    if defined(__AVR__)
+#        include <avr/interrupt.h>
+#        include <avr/io.h>
+
+// QMK's millisecond tick is timer0 in CTC mode at F_CPU / 64; its count
+// refines the tick.
+extern volatile uint32_t timer_count;
+#        define STATS_TICKS_PER_MS (F_CPU / 64 / 1000)
+
+uint32_t stats_clock_us(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t ms    = timer_count;
+    uint8_t  ticks = TCNT0;
+    if (TIFR0 & _BV(OCF0A)) {
+        // the count wrapped, but the tick has not been taken yet.
+        ms++;
+        ticks = TCNT0;
+    }
+    SREG = sreg;
+    return ms * 1000 + ticks * (1000 / STATS_TICKS_PER_MS);
+}
+#    else
+__attribute__((weak)) uint32_t stats_clock_us(void) {
+    return timer_read32() * 1000;
+}
+#    endif
+
+void stats_record(uint8_t id, uint32_t start) {
+    uint32_t           elapsed = stats_clock_us() - start;
+    uint16_t           t       = elapsed > 0xffff ? 0xffff : elapsed;
+    struct stat_entry *s       = &g_stats[id];
+    if (!s->count || t < s->min) {
+        s->min = t;
+    }
+    if (t > s->max) {
+        s->max = t;
+    }
+    s->count++;
+    s->sum += elapsed;
+    uint8_t b = 0;
+    for (elapsed >>= 4; elapsed && b < STAT_BUCKETS - 1; elapsed >>= 2) {
+        b++;
+    }
+    if (s->buckets[b] < 0xffff) {
+        s->buckets[b]++;
+    }
+}
+
+const struct stat_entry *stats_get(uint8_t id) {
+    return id < STAT_COUNT ? &g_stats[id] : NULL;
+}
+
+void stats_clear(uint8_t id) {
+    memset(&g_stats[id], 0, sizeof(g_stats[id]));
+}
+#endif
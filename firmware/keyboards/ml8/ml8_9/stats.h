@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timings of the firmware's hot paths, kept in RAM and read over hid with
+// HID_CMD_STATS. Durations are in microseconds, measured with the hardware
+// timer rather than through the console, which would distort them.
+enum stat_ids {
+    STAT_HID_RECEIVE,   // handling one hid frame
+    STAT_PERSIST,       // writing changed labels to eeprom
+    STAT_OLED_RENDER,   // sending dirty blocks to the display
+    STAT_SCAN_INTERVAL, // time between matrix scans, i.e. one main loop pass
+    STAT_LAYER_SWITCH,  // showing a new layer's text once the layer changed
+    STAT_BOOT,          // from keyboard_post_init_user to the first render
+    STAT_LABEL_LOAD,    // reading a user label not held in RAM from eeprom
+    STAT_COUNT,
+};
+
+// Histogram bucket b counts durations below 16 << 2b us; the last one counts
+// the rest.
+#define STAT_BUCKETS 8
+
+struct stat_entry {
+    uint32_t count;
+    uint32_t sum;
+    uint16_t min; // saturates at 0xffff, as do max and the buckets
+    uint16_t max;
+    uint16_t buckets[STAT_BUCKETS];
+};
+
+#if defined(STATS_ENABLE)
+uint32_t stats_clock_us(void);
+// Record the time elapsed since start, a stats_clock_us reading.
+void                     stats_record(uint8_t id, uint32_t start);
+const struct stat_entry *stats_get(uint8_t id);
+void                     stats_clear(uint8_t id);
+#else
+static inline uint32_t stats_clock_us(void) {
+    return 0;
+}
+static inline void stats_record(uint8_t id, uint32_t start) {}
+#endif